@@ -1,26 +1,102 @@
 #!/usr/bin/env python3
 
-import glob, os, sys
+import glob, os, struct, sys
+
+# --manifest=FILE writes a binary manifest (see Manifest in asset_conv.cpp)
+# to FILE instead of printing the tasks.
+manifest = None
+args = []
+for arg in sys.argv[1:]:
+    if arg.startswith("--manifest="):
+        manifest = arg[len("--manifest="):]
+    else:
+        args.append(arg)
 
 dirname = "./"
-if len(sys.argv) >= 2:
-    dirname = sys.argv[1]
+if len(args) >= 1:
+    dirname = args[0]
+
+width = "480"
+if len(args) >= 2:
+    out_dirname = args[1]
+
+# A comma separated list (e.g. 48,96,192) gives one multi-size task per file.
+if len(args) >= 3:
+    width = ",".join(str(int(w)) for w in args[2].split(","))
+
+
+MANIFEST_MAGIC = b"ACMANIF1"
 
-width = 480
-if len(sys.argv) >= 3:
-    out_dirname = sys.argv[2]
+def content_hash(fname):
+    """64 bits FNV-1a of the file content, as contentHash in asset_conv.cpp."""
+    h = 0xcbf29ce484222325
+    with open(fname, "rb") as f:
+        for b in f.read():
+            h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+    # 0 means "no hash" in the manifest.
+    return h or 1
 
-if len(sys.argv) >= 4:
-    width = int(sys.argv[3])
+def write_manifest(fname, tasks):
+    """Writes tasks, (input, output, sizes) tuples, as a binary manifest.
 
+    Layout, little endian:
+      header:  magic (8 bytes), u32 string count, u32 task count,
+               u32 size count, u32 reserved (0)
+      strings: per string, u32 offset in the string data and u32 length
+      tasks:   per task, u32 input string, u32 output string, u32 first
+               size, u32 size count and u64 content hash of the input
+      sizes:   u32 each
+      then the string data (UTF-8, not null terminated)
+    """
+    strings = {}
+    def intern(s):
+        return strings.setdefault(s, len(strings))
 
+    records = []
+    sizes = []
+    for fname_in, fname_out, task_sizes in tasks:
+        records.append((intern(fname_in), intern(fname_out), len(sizes),
+                        len(task_sizes), content_hash(fname_in)))
+        sizes += task_sizes
+
+    data = b""
+    entries = []
+    for s in strings:   # In insertion order, i.e. by index.
+        b = s.encode("utf-8")
+        entries.append((len(data), len(b)))
+        data += b
+
+    with open(fname, "wb") as f:
+        f.write(MANIFEST_MAGIC)
+        f.write(struct.pack("<IIII", len(entries), len(records), len(sizes),
+                            0))
+        for entry in entries:
+            f.write(struct.pack("<II", *entry))
+        for record in records:
+            f.write(struct.pack("<IIIIQ", *record))
+        f.write(struct.pack("<%dI" % len(sizes), *sizes))
+        f.write(data)
+
+
+start_dir = os.getcwd()
 os.chdir(dirname)
-files = glob.glob("*.svg")
+# Sorted, so that tasks on the same input follow each other.
+files = sorted(glob.glob("*.svg"))
 
+tasks = []
 for f in files:
     basename    = os.path.splitext(f)[0]
     pngname     = basename + ".png"
-    print("%s;%s;%s"%(
-        os.path.join(dirname, f),
-        os.path.join(out_dirname, pngname),
-        width))
+    if "," in width:
+        pngname = basename + "_{size}.png"
+    tasks.append((os.path.join(dirname, f),
+                  os.path.join(out_dirname, pngname),
+                  [int(w) for w in width.split(",")]))
+
+if manifest is None:
+    for fname_in, fname_out, _ in tasks:
+        print("%s;%s;%s"%(fname_in, fname_out, width))
+else:
+    # The paths are relative to where the script was started.
+    os.chdir(start_dir)
+    write_manifest(manifest, tasks)
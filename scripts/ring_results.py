@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+
+# Runs asset_conv with its results handed in a shared memory ring (see
+# ResultRing in result_ring.h) and reads them as numpy arrays, without
+# output files. Expects to be run from build/, like the other scripts:
+#
+#   ../scripts/gen_tasks.py ../data ./output/ 480 | ../scripts/ring_results.py
+#
+# As a module, RingResults(tasks) gives (name, image) pairs: a (size, size, 4)
+# uint8 array over the slot itself for RGBA, or the PNG bytes with png=True.
+# The slot is released when the next result is asked for, so an image has to
+# be copied to be kept.
+
+import mmap, os, struct, subprocess, sys, threading, time
+import numpy as np
+
+RING_MAGIC  = b"ACRING01"
+HEADER      = struct.Struct("=8sIIQQQQII") # magic, slots, name bytes, slot
+                                           # bytes, data offset, head, tail,
+                                           # closed, reserved
+HEAD_OFFSET     = 32
+TAIL_OFFSET     = 40
+CLOSED_OFFSET   = 48
+HEADER_BYTES    = 64
+SLOT            = struct.Struct("=IIIIQII")  # format, status, width, height,
+                                             # size, name size, reserved
+FORMAT_PNG      = 1
+
+class RingResults:
+    def __init__(self, tasks, threads=4, fname="/dev/shm/asset_conv_ring",
+                 png=False, args=()):
+        """Starts asset_conv on tasks, an iterable of task lines."""
+        self.ready = os.eventfd(0)
+        self.free = os.eventfd(0)
+        cmd = ["./asset_conv", str(threads), "-", "--quiet",
+               "--ring=" + fname,
+               "--ring-events=%d,%d" % (self.ready, self.free)]
+        if png:
+            cmd.append("--ring-png")
+        self.proc = subprocess.Popen(cmd + list(args), stdin=subprocess.PIPE,
+                                     pass_fds=(self.ready, self.free))
+        # Fed from a thread: asset_conv stops reading once its slots are
+        # full, until they are consumed here.
+        def feed():
+            for line in tasks:
+                self.proc.stdin.write(line.encode())
+            self.proc.stdin.close()
+        self.feeder = threading.Thread(target=feed, daemon=True)
+        self.feeder.start()
+
+        # The first signal tells the ring is created.
+        os.eventfd_read(self.ready)
+        with open(fname, "r+b") as f:
+            self.mm = mmap.mmap(f.fileno(), 0)
+        (magic, self.slots, self.name_bytes, self.slot_bytes,
+         self.data_offset, _, _, _, _) = HEADER.unpack_from(self.mm, 0)
+        if magic != RING_MAGIC:
+            raise RuntimeError("Invalid ring " + fname)
+        self.tail = 0
+
+    def _u64(self, offset):
+        return struct.unpack_from("=Q", self.mm, offset)[0]
+
+    def __iter__(self):
+        """Gives (name, image) for every task, or (name, None) if failed."""
+        while True:
+            head = self._u64(HEAD_OFFSET)
+            closed = struct.unpack_from("=I", self.mm, CLOSED_OFFSET)[0]
+            if self.tail == head:
+                if closed:
+                    break
+                os.eventfd_read(self.ready)
+                continue
+            index = self.tail % self.slots
+            desc = HEADER_BYTES + index * (SLOT.size + self.name_bytes)
+            fmt, status, width, height, size, name_size, _ = \
+                SLOT.unpack_from(self.mm, desc)
+            name = bytes(self.mm[desc + SLOT.size:
+                                 desc + SLOT.size + name_size]).decode()
+            offset = self.data_offset + index * self.slot_bytes
+            image = None
+            if status == 0 and fmt == FORMAT_PNG:
+                image = memoryview(self.mm)[offset:offset + size]
+            elif status == 0:
+                image = np.ndarray((height, width, 4), np.uint8,
+                                   buffer=self.mm, offset=offset)
+            yield name, image
+            # Release the slot.
+            image = None
+            self.tail += 1
+            struct.pack_into("=Q", self.mm, TAIL_OFFSET, self.tail)
+            os.eventfd_write(self.free, 1)
+
+    def close(self):
+        """Waits for asset_conv and returns its exit code. The images given
+        must not be referenced anymore."""
+        self.feeder.join()
+        self.proc.wait()
+        self.mm.close()
+        os.close(self.ready)
+        os.close(self.free)
+        return self.proc.returncode
+
+
+if __name__ == "__main__":
+    start = time.time()
+    ring = RingResults(sys.stdin)
+    count = failed = 0
+    for name, image in ring:
+        if image is None:
+            failed += 1
+            print("Failed:", name)
+        else:
+            count += 1
+            print(name, image.shape, int(image[..., 3].mean()))
+    image = None
+    ring.close()
+    print("%d images (%d failed) in %.2f s." % (count, failed,
+                                               time.time() - start))
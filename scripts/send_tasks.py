@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+
+# Sends the task lines read on stdin to an asset_conv server (asset_conv
+# --serve=SOCKET) and waits for them to be done. Exits with 1 if some failed.
+#
+#   ../scripts/gen_tasks.py ../data ./output/ 480 | ../scripts/send_tasks.py asset_conv.sock
+
+import socket, sys
+
+if len(sys.argv) != 2:
+    print("Usage: send_tasks.py SOCKET < tasks", file=sys.stderr)
+    sys.exit(2)
+
+sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+sock.connect(sys.argv[1])
+# Lines are sent as they are read: the server starts on them right away.
+for line in sys.stdin.buffer:
+    sock.sendall(line)
+sock.shutdown(socket.SHUT_WR)
+
+reply = b""
+while True:
+    data = sock.recv(4096)
+    if not data:
+        break
+    reply += data
+sock.close()
+
+# "done <count> failed <count>"
+reply = reply.decode().strip()
+print(reply)
+fields = reply.split()
+sys.exit(0 if len(fields) == 4 and fields[3] == "0" else 1)
@@ -2,6 +2,11 @@
 # Assumes it is running in the build folder.
 
 echo "../data/ic_adb_48px.svg;output.png;480" | ./asset_conv 2>/dev/null
+echo "../data/ic_adb_48px.svg;output_rgba.png;480" | ./asset_conv 1 - --png=rgba 2>/dev/null
+echo "../data/ic_adb_48px.svg;output_{size}.png;480,240" | ./asset_conv 2>/dev/null
+echo "../data/ic_adb_48px.svg;output_down_{size}.png;480,240" | ./asset_conv 1 - --downsample 2>/dev/null
+echo "../data/ic_adb_48px.svg;output_analytic.png;480" | ./asset_conv 1 - --aa=analytic 2>/dev/null
+echo "../scripts/test_color.svg;output_color.png;480" | ./asset_conv 2>/dev/null
 if md5sum --quiet -c ../scripts/test_single.md5; then
     echo "OK"
     return 0
@@ -1,4 +1,14 @@
 #include "stb/stb_image_write.h"
+#include "stb/stb_image_resize.h"
+#include "deflate_backend.h"
+#include "metrics_server.h"
+#include "net_util.h"
+#include "png_data.h"
+#include "remote.h"
+#include "result_ring.h"
+#include "sharding.h"
+#include "task_log.h"
+#include "task_server.h"
 
 #include "nanosvg/nanosvg.h"
 #include "nanosvg/nanosvgrast.h"
@@ -7,16 +17,36 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <queue>
+#include <deque>
+#include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
+#include <list>
 #include <string>
 #include <cstring>
+#include <cctype>
 #include <thread>
-#include <semaphore>
 #include <mutex>
-#include <string>
+#include <condition_variable>
+#include <string_view>
+#include <charconv>
 #include <filesystem>
 #include <atomic>
+#include <future>
+#include <functional>
+#include <array>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <cerrno>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <csignal>
 
 namespace fs = std::filesystem;
 
@@ -24,73 +54,521 @@ namespace gif643 {
 
 const size_t    BPP         = 4;    // Bytes per pixel
 const float     ORG_WIDTH   = 48.0; // Original SVG image width in px.
+const int       MAX_SIZE    = 16384; // Largest image size of a task in px.
 const int       NUM_THREADS = 1;    // Default value, changed by argv. 
-std::binary_semaphore take_from_queu_signal{1};
-std::counting_semaphore queu_updated_signal{0};
-std::mutex cache_mutex_;
-std::mutex queu_mutex;
+const size_t    QUEUE_CAPACITY = 1024; // Max. pending tasks before producers
+                                       // block.
+const size_t    PNG_CACHE_BYTES  = 256 << 20; // Max. compressed bytes kept in
+                                              // memory by PNGCache.
+const size_t    PNG_CACHE_SHARDS = 16;        // Independent locks in PNGCache.
+const size_t    SVG_CACHE_BYTES  = 64 << 20;  // Max. (estimated) bytes of 
+                                              // parsed images in SVGCache.
+const size_t    SVG_CACHE_SHARDS = 16;        // Independent locks in SVGCache.
+const size_t    PIXEL_ARENA_MAX   = 64 << 20; // Largest pixel buffer kept by 
+                                              // a thread between tasks.
+const size_t    BAND_RASTER_SIZE  = 2048;     // Images at least this wide are
+                                              // rasterized by several threads.
+const int       BAND_ROWS         = 64;       // Rows per band in that case.
+const size_t    STREAM_RASTER_SIZE = 4096;    // Images at least this wide are
+                                              // rasterized and compressed a
+                                              // band at a time instead.
+const int       STREAM_BANDS      = 8;        // Most bands they render at 
+                                              // once, by several threads.
+const size_t    OUTPUT_THREADS    = 2;        // Threads writing output files.
+const size_t    OUTPUT_MAX_BYTES  = 64 << 20; // Most PNG data waiting for 
+                                              // them before workers block.
+const size_t    INGEST_BLOCK      = 1 << 20;  // Bytes of task definitions
+                                              // read and queued at a time.
+const size_t    INDEX_SHARDS      = 16;  // Independent locks in TaskIndex.
+const size_t    INDEX_FLUSH_BATCH = 64;  // Done tasks kept in memory before
+                                         // being appended to the index file.
+const size_t    SHARD_TASKS_PER_THREAD = 2; // Pending tasks a process of a
+                                            // sharded run takes at most.
 
-using PNGDataVec = std::vector<char>;
-using PNGDataPtr = std::shared_ptr<PNGDataVec>;
+using Clock = std::chrono::steady_clock;
 
-/// \brief Wraps callbacks from stbi_image_write
-//
-// Provides a static method to give to stbi_write_png_to_func (rawCallback),
-// which will call with a void* pointer to the instance of PNGWriter.
-// The actual processing should occur in callback(...).
-//
-// Usage (see stbi_write_png for w,h, BPP, image_data and stride parameters): 
-//
-//   PNGWriter writer;
-//   writer(w, h, BPP, image_data, stride); // Will ultimately 
-//                                          // call callback(data, len) and
-//                                          // return when it's done.
-//                                          // Throws if an error occured.
-//
-class PNGWriter
+/// \brief Processing stages timed by Metrics.
+enum class Stage
 {
+    QUEUE_WAIT,     // From queueing to a worker taking the task.
+    PARSE,
+    FLATTEN,        // Building the SharedGeometry of a multi-size task.
+    RASTERIZE,
+    ENCODE,
+    WRITE,
+    COUNT
+};
+
+const char* stageName(Stage stage)
+{
+    static const char* names[] = {
+        "queue_wait", "parse", "flatten", "rasterize", "encode", "write"
+    };
+    return names[size_t(stage)];
+}
+
+/// \brief A histogram of durations, in buckets of a quarter of a power of 
+///        two nanoseconds (at most 19% wide).
+///
+/// Recorded by a single thread, but can be read concurrently: the counters
+/// are atomics only updated with relaxed loads and stores, which cost as 
+/// much as plain ones.
+class Histogram
+{
+public:
+    static constexpr size_t BUCKETS = 252;
+
+    /// \brief Counts of a histogram, or of several merged ones.
+    struct Snapshot
+    {
+        uint64_t counts[BUCKETS] = {};
+        uint64_t count  = 0;
+        uint64_t sum_ns = 0;
+        uint64_t max_ns = 0;
+
+        void merge(const Snapshot& other)
+        {
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                counts[i] += other.counts[i];
+            }
+            count  += other.count;
+            sum_ns += other.sum_ns;
+            max_ns  = std::max(max_ns, other.max_ns);
+        }
+
+        /// \brief Returns the p-th percentile (0 to 1), as the middle of its
+        ///        bucket, in nanoseconds.
+        double percentile(double p) const
+        {
+            if (count == 0) {
+                return 0.0;
+            }
+            uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(p * count)));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    return std::min<double>(max_ns, 
+                        (lowerBound(i) + lowerBound(i + 1)) / 2.0);
+                }
+            }
+            return double(max_ns);
+        }
+
+        /// \brief Returns how many durations were below ns (a power of two).
+        uint64_t countBelow(uint64_t ns) const
+        {
+            uint64_t below = 0;
+            for (size_t i = 0; i < BUCKETS && lowerBound(i + 1) <= ns; ++i) {
+                below += counts[i];
+            }
+            return below;
+        }
+    };
+
+    /// \brief Returns the bucket of a duration.
+    static size_t bucket(uint64_t ns)
+    {
+        if (ns < 4) {
+            return size_t(ns);
+        }
+        const int e = 63 - __builtin_clzll(ns);
+        return size_t(4 * (e - 1) + ((ns >> (e - 2)) & 3));
+    }
+
+    /// \brief Returns the smallest duration of a bucket (BUCKETS for the 
+    ///        end of the last one).
+    static uint64_t lowerBound(size_t i)
+    {
+        if (i < 4) {
+            return i;
+        }
+        const int e = int(i / 4) + 1;
+        return (4 + (i & 3)) << (e - 2);
+    }
+
+    void record(uint64_t ns)
+    {
+        increment(counts_[bucket(ns)], 1);
+        increment(count_, 1);
+        increment(sum_, ns);
+        if (ns > max_.load(std::memory_order_relaxed)) {
+            max_.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void snapshot(Snapshot& out) const
+    {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            out.counts[i] += counts_[i].load(std::memory_order_relaxed);
+        }
+        out.count  += count_.load(std::memory_order_relaxed);
+        out.sum_ns += sum_.load(std::memory_order_relaxed);
+        out.max_ns  = std::max(out.max_ns, max_.load(std::memory_order_relaxed));
+    }
+
 private:
-    PNGDataPtr png_data_;
+    std::atomic<uint64_t> counts_[BUCKETS] = {};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+
+    static void increment(std::atomic<uint64_t>& counter, uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, 
+                      std::memory_order_relaxed);
+    }
+};
+
+/// \brief Latency histograms of the processing stages, one set per thread 
+///        so that recording never contends.
+///
+/// A thread's histograms are registered on its first record, and merged in
+/// the totals of the exited threads when it ends.
+class Metrics
+{
+public:
+    using Snapshots = std::array<Histogram::Snapshot, size_t(Stage::COUNT)>;
+
+    static Metrics& global()
+    {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    /// \brief Records a duration of stage for the calling thread.
+    void record(Stage stage, Clock::duration duration)
+    {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            duration).count();
+        local().stages[size_t(stage)].record(ns);
+    }
+
+    /// \brief Returns the merged histograms of all threads.
+    Snapshots snapshot()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Snapshots out = exited_;
+        for (const ThreadStages* thread: threads_) {
+            for (size_t i = 0; i < size_t(Stage::COUNT); ++i) {
+                thread->stages[i].snapshot(out[i]);
+            }
+        }
+        return out;
+    }
+
+private:
+    struct ThreadStages
+    {
+        Histogram stages[size_t(Stage::COUNT)];
+    };
+
+    /// \brief Registers a thread's histograms while it lives.
+    struct Registration
+    {
+        ThreadStages stages;
+
+        Registration()
+        {
+            Metrics& metrics = global();
+            std::lock_guard<std::mutex> lock(metrics.mutex_);
+            metrics.threads_.push_back(&stages);
+        }
+
+        ~Registration()
+        {
+            Metrics& metrics = global();
+            std::lock_guard<std::mutex> lock(metrics.mutex_);
+            for (size_t i = 0; i < size_t(Stage::COUNT); ++i) {
+                stages.stages[i].snapshot(metrics.exited_[i]);
+            }
+            auto& threads = metrics.threads_;
+            threads.erase(std::find(threads.begin(), threads.end(), &stages));
+        }
+    };
+
+    std::mutex                  mutex_;
+    std::vector<ThreadStages*>  threads_;
+    Snapshots                   exited_;
+
+    ThreadStages& local()
+    {
+        thread_local Registration registration;
+        return registration.stages;
+    }
+};
+
+/// \brief Records the time between its construction and destruction as a 
+///        duration of stage.
+class StageTimer
+{
+private:
+    Stage               stage_;
+    Clock::time_point   start_;
 
 public:
-    static void rawCallback(void* context, void* data, int len)
+    explicit StageTimer(Stage stage):
+        stage_(stage),
+        start_(Clock::now())
+    {
+    }
+
+    ~StageTimer()
+    {
+        Metrics::global().record(stage_, Clock::now() - start_);
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+};
+
+/// \brief Writes size bytes of data to fname, replacing it.
+///
+/// Uses write(2) directly: no stream buffer, so the data is not copied again
+/// on its way to the file. An existing fname is unlinked first rather than
+/// truncated, since it can be a hard link to a DiskCache entry. Returns 
+/// false, with errno set, on failure.
+bool writeFile(const std::string& fname, const void* data, size_t size)
+{
+    ::unlink(fname.c_str());
+    int fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 
+                    0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, bytes, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return ::close(fd) == 0;
+}
+
+/// \brief Writes a PNG file. Returns false, with an error on stderr, on 
+///        failure.
+bool writePNG(const std::string& fname, const PNGData& data)
+{
+    StageTimer timer(Stage::WRITE);
+    if (!writeFile(fname, data.data(), data.size())) {
+        std::cerr << "Cannot write '" << fname << "': "
+                  << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A parsed SVG, deleted with nsvgDelete when the last user is done with it.
+using SVGImagePtr = std::shared_ptr<NSVGimage>;
+
+/// \brief PNG encoder settings.
+///
+/// level:  Deflate compression level, from deflateBackendMinLevel() to 
+///         deflateBackendMaxLevel().
+/// filter: PNG filter used for every row (0: none, 1: sub, 2: up, 
+///         3: average, 4: paeth), or -1 to try all of them on each row and 
+///         keep the best one.
+/// rgba:   Always write RGBA, even for the images painted with a single 
+///         color (see SingleColor), written as gray and alpha or indexed
+///         otherwise.
+struct PNGSettings
+{
+    int  level  = 8;
+    int  filter = -1;
+    bool rgba   = false;
+
+    bool operator==(const PNGSettings&) const = default;
+
+    /// \brief Parses settings given as a preset name or "level[:filter]", 
+    ///        followed by ":rgba" (or only "rgba", for the default ones) to
+    ///        set rgba. Returns false, with an error on stderr, if invalid.
+    ///
+    /// Presets:
+    ///  - default: level 8, all filters tried (stb's defaults).
+    ///  - fast:    level 1, sub filter only.
+    ///  - small:   highest level of the backend, all filters tried.
+    ///
+    /// Levels below deflateBackendMinLevel() (stb's lowest is 5) are raised
+    /// to it, as the backend would, and said once on stderr: the settings 
+    /// then hold the level actually used.
+    static bool parse(std::string spec, PNGSettings& settings)
+    {
+        const std::string rgba_suffix = ":rgba";
+        bool rgba = false;
+        if (spec == "rgba") {
+            spec = "default";
+            rgba = true;
+        } else if (spec.size() > rgba_suffix.size() &&
+                   spec.ends_with(rgba_suffix)) {
+            spec.resize(spec.size() - rgba_suffix.size());
+            rgba = true;
+        }
+
+        if (spec == "default") {
+            settings = {8, -1};
+        } else if (spec == "fast") {
+            settings = {1, 1};
+        } else if (spec == "small") {
+            settings = {deflateBackendMaxLevel(), -1};
+        } else {
+            char* end = nullptr;
+            long level = std::strtol(spec.c_str(), &end, 10);
+            long filter = -1;
+            if (end != spec.c_str() && *end == ':') {
+                const char* start = end + 1;
+                filter = std::strtol(start, &end, 10);
+                if (end == start) {
+                    end = nullptr;
+                }
+            }
+            if (end == nullptr || end == spec.c_str() || *end != '\0' ||
+                level < 0 || level > deflateBackendMaxLevel() ||
+                filter < -1 || filter > 4) {
+                std::cerr << "Error: Invalid PNG settings '" << spec 
+                          << "' (expected default, fast, small or "
+                          << "level[:filter], level from 0 to "
+                          << deflateBackendMaxLevel() 
+                          << " and filter from -1 to 4, then optionally "
+                          << ":rgba)."
+                          << std::endl;
+                return false;
+            }
+            settings = {int(level), int(filter)};
+        }
+        if (settings.level < deflateBackendMinLevel()) {
+            static std::atomic<bool> warned(false);
+            if (!warned.exchange(true)) {
+                std::cerr << "Warning: The " << deflateBackendName() 
+                          << " deflate backend has no level below "
+                          << deflateBackendMinLevel() << ", level " 
+                          << settings.level << " is compressed at level "
+                          << deflateBackendMinLevel() << "." << std::endl;
+            }
+            settings.level = deflateBackendMinLevel();
+        }
+        settings.rgba = rgba;
+        return true;
+    }
+
+    /// \brief Returns the settings in the "level:filter[:rgba]" form.
+    std::string spec() const
     {
-        PNGWriter* writer = (PNGWriter*)context;
-        writer->callback(data, len);
+        return std::to_string(level) + ':' + std::to_string(filter) 
+            + (rgba ? ":rgba" : "");
     }
+};
+
+/// \brief Rasterizer anti-aliasing settings (see nsvgSetAntialias).
+///
+/// subsamples: Scanlines sampled per row of pixels, from 1 to 
+///             MAX_SUBSAMPLES (unused if analytic).
+/// analytic:   Exact area coverage instead of sampling.
+struct RasterSettings
+{
+    // nanosvg truncates the partial coverage of an edge pixel on each 
+    // scanline, to a weight of 255 / subsamples: the loss grows with the
+    // count and beyond nanosvg's 5 (about 2.5 of 255 on average, 7.5 at 
+    // 15), outweighs what the extra scanlines gain. Use analytic instead.
+    static constexpr int MAX_SUBSAMPLES = 5;
 
-    /// \brief Copies the PNG data in png_data_ when compression is done and
-    ///        ready to write.
+    int  subsamples = 5;
+    bool analytic   = false;
+
+    bool operator==(const RasterSettings&) const = default;
+
+    /// \brief Parses settings given as a preset name or a subsample count.
+    ///        Returns false, with an error on stderr, if invalid.
     ///
-    /// Meant to be called by stbi_image_write_to_func as callback.
-    /// NOTE: The given data array is deleted by the caller once callback is 
-    /// finished.
-    /// \param data Raw pointer to uint8 array.
-    /// \param len  size of the data array.
-    void callback(void* data, size_t len)
+    /// Presets:
+    ///  - default:  5 subsamples (nanosvg's own).
+    ///  - fast:     1 subsample, for previews and thumbnails.
+    ///  - analytic: exact area coverage.
+    static bool parse(const std::string& spec, RasterSettings& settings)
+    {
+        if (spec == "default") {
+            settings = {5, false};
+        } else if (spec == "fast") {
+            settings = {1, false};
+        } else if (spec == "analytic") {
+            settings = {5, true};
+        } else {
+            char* end = nullptr;
+            long subsamples = std::strtol(spec.c_str(), &end, 10);
+            if (end == spec.c_str() || *end != '\0' ||
+                subsamples < 1 || subsamples > MAX_SUBSAMPLES) {
+                std::cerr << "Error: Invalid anti-aliasing settings '" << spec 
+                          << "' (expected default, fast, analytic or a "
+                          << "subsample count from 1 to " << MAX_SUBSAMPLES
+                          << ")." << std::endl;
+                return false;
+            }
+            settings = {int(subsamples), false};
+        }
+        return true;
+    }
+
+    /// \brief Returns the settings as "analytic" or the subsample count.
+    std::string spec() const
+    {
+        return analytic ? "analytic" : std::to_string(subsamples);
+    }
+
+    /// \brief Sets the settings on a rasterizer.
+    void apply(NSVGrasterizer* rast) const
     {
-        char* data_raw = static_cast<char *>(data);
-        png_data_ = PNGDataPtr(new PNGDataVec(&data_raw[0], &data_raw[len]));
+        nsvgSetAntialias(rast, analytic ? NSVG_AA_ANALYTIC : NSVG_AA_SAMPLED,
+                         subsamples);
     }
+};
+
+/// \brief Compresses images to PNG with stbi_image_write
+//
+// Usage (see stbi_write_png for w,h, BPP, image_data and stride parameters): 
+//
+//   PNGWriter writer;
+//   writer(w, h, BPP, image_data, stride); // Returns when compression is 
+//                                          // done. Throws if an error 
+//                                          // occured.
+//   PNGDataPtr data = writer.getData();
+//
+class PNGWriter
+{
+private:
+    PNGDataPtr png_data_;
 
+public:
     void operator()(size_t width,
                     size_t height,
                     size_t BPP,
                     const unsigned char* image_data,
-                    size_t stride)
+                    size_t stride,
+                    const PNGSettings& settings = PNGSettings())
     {
-            stbi_write_func* fun = PNGWriter::rawCallback;
-            int r = stbi_write_png_to_func(fun, 
-                                           this,
-                                           width,
-                                           height,
-                                           BPP,
-                                           &image_data[0],
-                                           stride);
+            StageTimer timer(Stage::ENCODE);
+            int len = 0;
+            unsigned char* png = stbi_write_png_to_mem_ex(&image_data[0],
+                                                          stride,
+                                                          width,
+                                                          height,
+                                                          BPP,
+                                                          &len,
+                                                          settings.level,
+                                                          settings.filter);
 
-            if (r == 0) {
-                throw std::runtime_error("Error in write_png_to_func");
+            if (png == nullptr) {
+                throw std::runtime_error("Error in write_png_to_mem");
             }
+            png_data_ = std::make_shared<const PNGData>(png, len);
     }
 
     /// \brief Return a shared pointer to the compressed PNG data.
@@ -100,145 +578,2830 @@ public:
     }
 };
 
-/// \brief Task definition
-///
-/// fname_in:  The file to process (SVG format)
-/// fname_out: Where to write the result in PNG.
-/// size:      The size, in pixel, of the produced image.
+/// \brief The color of an image painted with a single one (see 
+///        nsvgSingleColor), which is then rasterized to its coverage only
+///        (see nsvgSetCoverage) and written as gray and alpha if the color 
+///        is a gray, or 8 bits indexed otherwise.
 ///
-/// NOTE: Assumes the input SVG is ORG_WIDTH wide (48px) and the result will be
-/// square. Does not matter if it does not fit in the resulting image, it will //// simply be cropped.
-struct TaskDef
+/// The coverage of each pixel is its alpha. Rows are encoded in place with
+/// encodeRow: a coverage row, its first w bytes, becomes a row of 
+/// w * channels() bytes.
+struct SingleColor
 {
-    std::string fname_in;
-    std::string fname_out; 
-    int size;
+    /// \brief Colors of an indexed image, as RGBA, and the index of each 
+    ///        coverage.
+    struct Palette
+    {
+        int             count;
+        unsigned char   index[256];
+        unsigned char   colors[256 * 4];
+    };
+
+    unsigned char r, g, b;
+
+    /// \brief Sets color and returns true if image is painted with a single
+    ///        color.
+    static bool of(NSVGimage* image, SingleColor& color)
+    {
+        unsigned int c = 0;
+        if (!nsvgSingleColor(image, &c)) {
+            return false;
+        }
+        color = {(unsigned char)c, (unsigned char)(c >> 8), 
+                 (unsigned char)(c >> 16)};
+        return true;
+    }
+
+    bool gray() const 
+    { 
+        return r == g && g == b; 
+    }
+
+    /// \brief Bytes per pixel of the encoded rows: gray and alpha, or index.
+    size_t channels() const
+    {
+        return gray() ? 2 : 1;
+    }
+
+    /// \brief Returns the palette of the coverage image of w * h pixels 
+    ///        (rows of stride bytes), with only the coverages it uses, in 
+    ///        order. Every coverage has an index if pixels is null (when 
+    ///        streaming, before the rows are known).
+    Palette palette(const unsigned char* pixels, int w, int h, 
+                    size_t stride) const
+    {
+        bool used[256];
+        std::fill(std::begin(used), std::end(used), pixels == nullptr);
+        for (int y = 0; pixels && y < h; ++y) {
+            const unsigned char* row = pixels + y * stride;
+            for (int x = 0; x < w; ++x) {
+                used[row[x]] = true;
+            }
+        }
+
+        Palette palette;
+        palette.count = 0;
+        for (int a = 0; a < 256; ++a) {
+            if (used[a]) {
+                unsigned char* color = &palette.colors[palette.count * 4];
+                color[0] = r;
+                color[1] = g;
+                color[2] = b;
+                color[3] = a;
+                palette.index[a] = palette.count++;
+            }
+        }
+        return palette;
+    }
+
+    /// \brief Encodes a coverage row of w pixels in place, with the indices 
+    ///        of palette if not gray().
+    void encodeRow(unsigned char* row, int w, const Palette& palette) const
+    {
+        if (gray()) {
+            // Backwards, so that a coverage is read before being overwritten.
+            for (int x = w - 1; x >= 0; --x) {
+                row[2 * x + 1] = row[x];
+                row[2 * x]     = r;
+            }
+        } else {
+            for (int x = 0; x < w; ++x) {
+                row[x] = palette.index[row[x]];
+            }
+        }
+    }
 };
 
-/// \brief A class representing the processing of one SVG file to a PNG stream.
-///
-/// Not thread safe !
-///
-class TaskRunner
+/// \brief Flattened edges of an image, shared by the sizes of a multi-size
+///        task (see nsvgFlattenImage): the curves are flattened and the
+///        strokes expanded once, at the largest size, by the first size 
+///        rendered, and the other sizes rescale them. Thread-safe.
+class SharedGeometry
 {
 private:
-    TaskDef task_def_;
+    const int       size_;
+    std::once_flag  built_;
+    SVGImagePtr     image_;
+    std::unique_ptr<NSVGflattened, void (*)(NSVGflattened*)> flat_;
 
 public:
-    TaskRunner(const TaskDef& task_def):
-        task_def_(task_def)
+    /// \param size: The largest size the image is rendered at.
+    explicit SharedGeometry(int size):
+        size_(size),
+        flat_(nullptr, nsvgDeleteFlattened)
     {
     }
 
-    void operator()()
+    /// \brief The size the edges are flattened at.
+    int size() const
     {
-        const std::string&  fname_in    = task_def_.fname_in;
-        const std::string&  fname_out   = task_def_.fname_out;
-        const size_t&       width       = task_def_.size; 
-        const size_t&       height      = task_def_.size; 
-        const size_t        stride      = width * BPP;
-        const size_t        image_size  = height * stride;
-        const float&        scale       = float(width) / ORG_WIDTH;
+        return size_;
+    }
 
-        std::cerr << "Running for "
-                  << fname_in 
-                  << "..." 
-                  << std::endl;
+    /// \brief Returns the edges of image, flattened with rast on the first 
+    ///        call, or null if they were built for another image (or could 
+    ///        not be).
+    const NSVGflattened* get(const SVGImagePtr& image, NSVGrasterizer* rast)
+    {
+        std::call_once(built_, [&] {
+            StageTimer timer(Stage::FLATTEN);
+            image_ = image;
+            flat_.reset(nsvgFlattenImage(rast, image.get(), 
+                                         float(size_) / ORG_WIDTH));
+        });
+        return image_ == image ? flat_.get() : nullptr;
+    }
+};
 
-        NSVGimage*          image_in        = nullptr;
-        NSVGrasterizer*     rast            = nullptr;
+/// \brief Completion of a group of tasks, such as those of a TaskServer 
+///        request.
+///
+/// Tasks of the group are added when queued, and then finished as done or
+/// failed. A multi-size task counts as its sizes once they are queued.
+class TaskGroup
+{
+private:
+    size_t                  pending_ = 0;
+    size_t                  done_    = 0;
+    size_t                  failed_  = 0;
+    std::mutex              mutex_;
+    std::condition_variable finished_signal_;
 
-    
-        
-    
-        try {
+public:
+    void add(size_t count)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_ += count;
+    }
 
-            // Read the file ...
-            image_in = nsvgParseFromFile(fname_in.c_str(), "px", 0);
-            if (image_in == nullptr) {
-                std::string msg = "Cannot parse '" + fname_in + "'.";
-                throw std::runtime_error(msg.c_str());
+    /// \brief Finishes an added task. Only counted as done or failed if 
+    ///        counted (not for multi-size tasks, whose sizes are counted).
+    void finish(bool success, bool counted = true)
+    {
+        bool finished;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (counted) {
+                ++(success ? done_ : failed_);
             }
-            // Raster it ...
-            std::vector<unsigned char> image_data(image_size, 0);
-            rast = nsvgCreateRasterizer();
-            nsvgRasterize(rast,
-                          image_in,
-                          0,
-                          0,
-                          scale,
-                          &image_data[0],
-                          width,
-                          height,
-                          stride);
-
-            // Compress it ...
-            PNGWriter writer;
-            writer(width, height, BPP, &image_data[0], stride);
-            // Write it out ...
-            std::ofstream file_out(fname_out, std::ofstream::binary);
-            auto data = writer.getData();
-            file_out.write(&(data->front()), data->size());
-            
-        } catch (std::runtime_error e) {
-            std::cerr << "Exception while processing "
-                      << fname_in
-                      << ": "
-                      << e.what()
-                      << std::endl;
+            finished = (--pending_ == 0);
         }
-        
-        // Bring down ...
-        nsvgDelete(image_in);
-        nsvgDeleteRasterizer(rast);
-
-        std::cerr << std::endl 
-                  << "Done for "
-                  << fname_in 
-                  << "." 
-                  << std::endl;
+        if (finished) {
+            finished_signal_.notify_all();
+        }
+    }
+
+    /// \brief Counts a task that could not even be queued (e.g. invalid).
+    void reject()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++failed_;
+    }
+
+    /// \brief Waits for every added task to be finished, and returns how 
+    ///        many were done and failed.
+    void wait(size_t& done, size_t& failed)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        finished_signal_.wait(lock, [this] { return pending_ == 0; });
+        done = done_;
+        failed = failed_;
     }
 };
 
-/// \brief A class that organizes the processing of SVG assets in PNG files.
-///
-/// Receives task definition as input and processes them, resulting in PNG 
-/// files being written on disk.
-///
-/// Two main methods are offered: 
-///  - parseAndRun(...): Parses a task definition string and immediately
-///    processes the request. Blocking call.
-///  - parseAndQueue(...): Parses a task definition string and put it at the
-///    back of a queue for future processing. Returns immediately. If the 
-///    definition is valid it will be processed in the future.
+/// \brief Task definition
 ///
-/// TODO: Process assets in a thread pool.
-/// TODO: Cache the PNG result in memory if the same requests arrives again.
+/// fname_in:  The file to process (SVG format)
+/// fname_out: Where to write the result in PNG.
+/// size:      The size, in pixel, of the produced image.
+/// sizes:     For a multi-size task, every size to produce (size is then 
+///            unused). Each occurence of SIZE_PATTERN in fname_out is
+///            replaced by the size.
+/// image:     The already parsed fname_in, if any (shared by the tasks of a
+///            multi-size task).
+/// png:       The PNG encoder settings.
+/// raster:    The rasterizer anti-aliasing settings.
+/// hash:      Content hash of fname_in (see contentHash), if known, or 0.
+/// master:    If not 0, the image is downsampled from a render at this size
+///            instead of rendered directly (see Processor::runDownsampled).
+/// queued:    When the task was queued, for the QUEUE_WAIT stage metrics.
+/// group:     The group the task is part of, if any.
+/// geometry:  The flattened image shared by the sizes of a multi-size task,
+///            if any.
+/// deliver:   If set, the PNG (nullptr if failed) is given to it instead of
+///            written to fname_out (see WorkerServer).
 ///
-class Processor
-{
+/// NOTE: Assumes the input SVG is ORG_WIDTH wide (48px) and the result will be
+/// square. Does not matter if it does not fit in the resulting image, it will //// simply be cropped.
+struct TaskDef
+{
+    std::string fname_in;
+    std::string fname_out; 
+    int size;
+    std::vector<int> sizes{};
+    SVGImagePtr image;
+    PNGSettings png;
+    RasterSettings raster;
+    uint64_t hash = 0;
+    int master = 0;
+    Clock::time_point queued{};
+    std::shared_ptr<TaskGroup> group;
+    std::function<void(PNGDataPtr)> deliver{};
+    std::shared_ptr<SharedGeometry> geometry;
+};
+
+const std::string SIZE_PATTERN = "{size}";  // Size placeholder in fname_out.
+
+/// \brief Replaces every SIZE_PATTERN in fname by size.
+void replaceSize(std::string& fname, int size)
+{
+    const std::string size_str = std::to_string(size);
+    size_t pos = 0;
+    while ((pos = fname.find(SIZE_PATTERN, pos)) != std::string::npos) {
+        fname.replace(pos, SIZE_PATTERN.size(), size_str);
+        pos += size_str.size();
+    }
+}
+
+/// \brief Returns the size def is rendered from the shared edges of, if 
+///        larger than its own, or 0.
+///
+/// Such renders can differ from direct ones (see nsvgFlattenImage): the 
+/// cache keys keep them apart.
+int sharedFlattenSize(const TaskDef& def)
+{
+    return def.geometry && def.geometry->size() > def.size 
+         ? def.geometry->size() : 0;
+}
+
+/// \brief Returns if size is a valid image size for a task, from 1 to 
+///        MAX_SIZE. Otherwise reports it on stderr, for the task of line.
+bool checkSize(int64_t size, std::string_view line)
+{
+    if (size < 1 || size > MAX_SIZE) {
+        std::cerr << "Error: Invalid size " << size << " (expected 1 to "
+                  << MAX_SIZE << ") in task '" << line << "'." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// \brief Returns the single-size task of def for the given size, with 
+///        SIZE_PATTERN replaced in fname_out.
+TaskDef taskForSize(const TaskDef& def, int size)
+{
+    TaskDef task = {.fname_in   = def.fname_in, 
+                    .fname_out  = def.fname_out, 
+                    .size       = size, 
+                    .image      = def.image, 
+                    .png        = def.png,
+                    .raster     = def.raster, 
+                    .hash       = def.hash,
+                    .queued     = def.queued,
+                    .group      = def.group,
+                    .geometry   = def.geometry};
+    replaceSize(task.fname_out, size);
+    return task;
+}
+
+/// \brief Builds a key identifying the current content of a source file,
+///        made of its normalized path and its modification time.
+///
+/// Returns false (and leaves key untouched) if the file cannot be stat'ed.
+bool sourceKey(const std::string& fname, std::string& key)
+{
+    std::error_code err;
+    fs::path path = fs::absolute(fname, err).lexically_normal();
+    if (err) {
+        return false;
+    }
+    auto mtime = fs::last_write_time(path, err);
+    if (err) {
+        return false;
+    }
+    key = path.string() 
+        + ';' + std::to_string(mtime.time_since_epoch().count());
+    return true;
+}
+
+/// \brief 64 bits FNV-1a hash of size bytes of data.
+///
+/// Content hash of the inputs in manifests (see Manifest and 
+/// scripts/gen_tasks.py, which must stay in sync). Never 0, which means "no
+/// hash".
+uint64_t contentHash(const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash ? hash : 1;
+}
+
+/// \brief Computes the contentHash of a file's content. Returns false if it
+///        cannot be read.
+bool fileHash(const std::string& fname, uint64_t& hash)
+{
+    int fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool success = false;
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            hash = contentHash(nullptr, 0);
+            success = true;
+        } else {
+            void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, 
+                                fd, 0);
+            if (data != MAP_FAILED) {
+                hash = contentHash(data, st.st_size);
+                ::munmap(data, st.st_size);
+                success = true;
+            }
+        }
+    }
+    ::close(fd);
+    return success;
+}
+
+/// \brief A thread-safe, byte-bounded LRU cache of compressed PNG results.
+///
+/// Keys are built by makeKey(...) from the normalized input path, its 
+/// modification time, the output size, the PNG settings (with the level
+/// actually used) and the deflate backend, so an edited SVG never hits a 
+/// stale entry. Tasks with a content hash use it instead of the path and 
+/// time: no stat, and identical inputs share their entries. The cache is 
+/// split in PNG_CACHE_SHARDS shards, each with its own lock, LRU list and 
+/// share of the byte budget, so concurrent lookups rarely contend.
+///
+class PNGCache
+{
+public:
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t bytes;
+    };
+
+    PNGCache(size_t max_bytes = PNG_CACHE_BYTES):
+        shard_bytes_(max_bytes / PNG_CACHE_SHARDS),
+        hits_(0),
+        misses_(0),
+        evictions_(0)
+    {
+    }
+
+    /// \brief Builds the cache key of a task. Returns false (and leaves key 
+    ///        untouched) if the input file cannot be stat'ed.
+    static bool makeKey(const TaskDef& def, std::string& key)
+    {
+        std::string source_key;
+        if (def.hash) {
+            char hex[20];
+            std::snprintf(hex, sizeof(hex), "#%016llx", 
+                          (unsigned long long)def.hash);
+            source_key = hex;
+        } else if (!sourceKey(def.fname_in, source_key)) {
+            return false;
+        }
+        key = source_key + ';' + std::to_string(def.size) 
+            + ';' + def.png.spec() + ';' + deflateBackendName();
+        if (!(def.raster == RasterSettings())) {
+            key += ";aa:" + def.raster.spec();
+        }
+        if (def.master) {
+            key += ";d" + std::to_string(def.master);
+        }
+        if (int flatten_size = sharedFlattenSize(def)) {
+            key += ";g" + std::to_string(flatten_size);
+        }
+        return true;
+    }
+
+    /// \brief Returns the cached data for key, or nullptr if absent.
+    PNGDataPtr get(const std::string& key)
+    {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            ++misses_;
+            return nullptr;
+        }
+        // Move to front (most recently used).
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        ++hits_;
+        return it->second->second;
+    }
+
+    /// \brief Inserts (or replaces) the data for key, evicting the least
+    ///        recently used entries of the shard to stay within budget.
+    ///
+    /// Data larger than a whole shard is not cached.
+    void put(const std::string& key, PNGDataPtr data)
+    {
+        if (!data || data->size() > shard_bytes_) {
+            return;
+        }
+
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            shard.bytes -= it->second->second->size();
+            shard.lru.erase(it->second);
+            shard.index.erase(it);
+        }
+
+        shard.lru.emplace_front(key, data);
+        shard.index[key] = shard.lru.begin();
+        shard.bytes += data->size();
+
+        while (shard.bytes > shard_bytes_) {
+            auto& last = shard.lru.back();
+            shard.bytes -= last.second->size();
+            shard.index.erase(last.first);
+            shard.lru.pop_back();
+            ++evictions_;
+        }
+    }
+
+    Stats stats()
+    {
+        size_t bytes = 0;
+        for (auto& shard: shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            bytes += shard.bytes;
+        }
+        return {hits_, misses_, evictions_, bytes};
+    }
+
+private:
+    using Entry     = std::pair<std::string, PNGDataPtr>;
+    using EntryList = std::list<Entry>;
+
+    struct Shard
+    {
+        std::mutex  mutex;
+        EntryList   lru;    // Most recently used first.
+        std::unordered_map<std::string, EntryList::iterator> index;
+        size_t      bytes = 0;
+    };
+
+    Shard& shardFor(const std::string& key)
+    {
+        return shards_[std::hash<std::string>()(key) % PNG_CACHE_SHARDS];
+    }
+
+    Shard               shards_[PNG_CACHE_SHARDS];
+    size_t              shard_bytes_;
+    std::atomic<size_t> hits_;
+    std::atomic<size_t> misses_;
+    std::atomic<size_t> evictions_;
+};
+
+/// \brief A thread-safe, memory-bounded LRU cache of parsed SVG images.
+///
+/// Images are keyed by sourceKey(...) (path and modification time) and 
+/// shared through reference-counted SVGImagePtr: nsvgRasterize only reads
+/// the image, so runners at different sizes can use the same one at the 
+/// same time. Evicting an image only drops the cache's reference, it stays
+/// alive until the runners using it are done.
+///
+/// When several threads ask for an image that is not cached yet, only the 
+/// first one parses it, the others wait for its result.
+///
+class SVGCache
+{
+public:
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t bytes;
+    };
+
+    SVGCache(size_t max_bytes = SVG_CACHE_BYTES):
+        shard_bytes_(max_bytes / SVG_CACHE_SHARDS),
+        hits_(0),
+        misses_(0),
+        evictions_(0)
+    {
+    }
+
+    /// \brief Returns the parsed image of fname, parsing it if needed. 
+    ///        Returns nullptr if it cannot be parsed, or if parsing it threw
+    ///        (reported on stderr), for the parsing thread and the ones 
+    ///        waiting for it alike.
+    SVGImagePtr get(const std::string& fname)
+    {
+        std::string key;
+        if (!sourceKey(fname, key)) {
+            return parse(fname);
+        }
+
+        Shard& shard = shardFor(key);
+        std::promise<SVGImagePtr> promise;
+        {
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            auto it = shard.index.find(key);
+            if (it != shard.index.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                ++hits_;
+                std::shared_future<SVGImagePtr> image = it->second->image;
+                lock.unlock();
+                try {
+                    return image.get(); // Waits if still being parsed.
+                } catch (const std::exception& e) {
+                    std::cerr << "Error while waiting for the parsing of '"
+                              << fname << "': " << e.what() << std::endl;
+                    return nullptr;
+                }
+            }
+            ++misses_;
+            shard.lru.push_front({key, promise.get_future().share(), 0});
+            shard.index[key] = shard.lru.begin();
+        }
+
+        SVGImagePtr image = nullptr;
+        try {
+            image = parse(fname);
+        } catch (const std::exception& e) {
+            std::cerr << "Error while parsing '" << fname << "': " 
+                      << e.what() << std::endl;
+        }
+        // Always set, so that the waiters never get a broken promise; the 
+        // failure is then dropped from the cache below.
+        promise.set_value(image);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            return image;   // Already evicted.
+        }
+        size_t bytes = image ? imageBytes(image.get()) : 0;
+        if (!image || bytes > shard_bytes_) {
+            // Do not keep failures (the file may be fixed later) nor images
+            // bigger than the shard.
+            shard.lru.erase(it->second);
+            shard.index.erase(it);
+            return image;
+        }
+        it->second->bytes = bytes;
+        shard.bytes += bytes;
+
+        while (shard.bytes > shard_bytes_) {
+            Entry& last = shard.lru.back();
+            shard.bytes -= last.bytes;
+            shard.index.erase(last.key);
+            shard.lru.pop_back();
+            ++evictions_;
+        }
+        return image;
+    }
+
+    Stats stats()
+    {
+        size_t bytes = 0;
+        for (auto& shard: shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            bytes += shard.bytes;
+        }
+        return {hits_, misses_, evictions_, bytes};
+    }
+
+    /// \brief Parses fname without caching it. Returns nullptr on failure.
+    ///
+    /// The file is memory mapped and parsed in place with nsvgParseView: no
+    /// copy of its content, which stays shared in the page cache. Files 
+    /// that cannot be mapped (e.g. pipes) are read with nsvgParseFromFile.
+    static SVGImagePtr parse(const std::string& fname)
+    {
+        StageTimer timer(Stage::PARSE);
+        NSVGimage* image = nullptr;
+        int fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        void* view = MAP_FAILED;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            view = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (view != MAP_FAILED) {
+            ::madvise(view, st.st_size, MADV_SEQUENTIAL);
+            image = nsvgParseView(static_cast<const char*>(view), st.st_size,
+                                  "px", 0);
+            ::munmap(view, st.st_size);
+        } else {
+            image = nsvgParseFromFile(fname.c_str(), "px", 0);
+        }
+        ::close(fd);
+        if (image == nullptr) {
+            return nullptr;
+        }
+        return SVGImagePtr(image, nsvgDelete);
+    }
+
+    /// \brief Returns the memory used by a parsed image: the blocks of its 
+    ///        arena (see nsvgImageBytes), or an estimate if it has none.
+    static size_t imageBytes(const NSVGimage* image)
+    {
+        if (size_t bytes = nsvgImageBytes(image)) {
+            return bytes;
+        }
+        size_t bytes = sizeof(NSVGimage);
+        for (NSVGshape* shape = image->shapes; shape; shape = shape->next) {
+            bytes += sizeof(NSVGshape);
+            for (NSVGpath* path = shape->paths; path; path = path->next) {
+                bytes += sizeof(NSVGpath) + path->npts * 2 * sizeof(float);
+            }
+            for (const NSVGpaint* paint: {&shape->fill, &shape->stroke}) {
+                if (paint->type == NSVG_PAINT_LINEAR_GRADIENT ||
+                    paint->type == NSVG_PAINT_RADIAL_GRADIENT) {
+                    bytes += sizeof(NSVGgradient) 
+                           + paint->gradient->nstops * sizeof(NSVGgradientStop);
+                }
+            }
+        }
+        return bytes;
+    }
+
+private:
+    struct Entry
+    {
+        std::string                     key;
+        std::shared_future<SVGImagePtr> image;
+        size_t                          bytes;  // 0 while being parsed.
+    };
+    using EntryList = std::list<Entry>;
+
+    struct Shard
+    {
+        std::mutex  mutex;
+        EntryList   lru;    // Most recently used first.
+        std::unordered_map<std::string, EntryList::iterator> index;
+        size_t      bytes = 0;
+    };
+
+    Shard& shardFor(const std::string& key)
+    {
+        return shards_[std::hash<std::string>()(key) % SVG_CACHE_SHARDS];
+    }
+
+    Shard               shards_[SVG_CACHE_SHARDS];
+    size_t              shard_bytes_;
+    std::atomic<size_t> hits_;
+    std::atomic<size_t> misses_;
+    std::atomic<size_t> evictions_;
+};
+
+/// \brief The set of tasks already done, persisted in a folder's cache.txt.
+///
+/// The file is read once at construction into a sharded hash set keyed on 
+/// the full task (input, output and size), each shard with its own lock. 
+/// claim(...) is an O(1) lookup that never touches the disk: newly done 
+/// tasks are buffered and appended to the file in batches of 
+/// INDEX_FLUSH_BATCH by whichever thread finds the file free, or at 
+/// destruction.
+///
+/// If the folder does not exist, the index is only kept in memory.
+///
+/// With SharedClaims, tasks are also claimed there, so that the processes 
+/// sharing them never do the same task at the same time.
+///
+class TaskIndex
+{
+public:
+    TaskIndex(const fs::path& folder, SharedClaims* shared = nullptr):
+        index_file_(folder / "cache.txt"),
+        persist_(true),
+        shared_(shared),
+        pending_(0)
+    {
+        std::error_code err;
+        if (!fs::is_directory(folder, err)) {
+            std::cerr << "Subfolder does not exist: " << folder << "\n";
+            persist_ = false;
+            return;
+        }
+
+        std::ifstream infile(index_file_);
+        std::string line;
+        size_t count = 0;
+        while (std::getline(infile, line)) {
+            if (!line.empty()) {
+                shardFor(line).keys.insert(line);
+                ++count;
+            }
+        }
+        std::cerr << "Loaded " << count << " done tasks from " 
+                  << index_file_ << "." << std::endl;
+    }
+
+    ~TaskIndex()
+    {
+        flush();
+    }
+
+    /// \brief Returns the index key of a task.
+    ///
+    /// The PNG settings are only part of it if not the default ones, which
+    /// keeps the keys of older index files valid. Downsampled images add a 
+    /// ";d<master size>" part (as in PNGCache), and the sizes rendered from
+    /// the edges of a larger one (see sharedFlattenSize) a ";g<size>" one, 
+    /// their PNG being different from a direct render: a run that renders
+    /// them directly does not take them as done.
+    static std::string makeKey(const TaskDef& def)
+    {
+        std::string key = def.fname_in + ';' + def.fname_out + ';' 
+                        + std::to_string(def.size);
+        if (!(def.png == PNGSettings())) {
+            key += ';' + def.png.spec();
+        }
+        if (!(def.raster == RasterSettings())) {
+            key += ";aa:" + def.raster.spec();
+        }
+        if (def.master) {
+            key += ";d" + std::to_string(def.master);
+        }
+        if (int flatten_size = sharedFlattenSize(def)) {
+            key += ";g" + std::to_string(flatten_size);
+        }
+        return key;
+    }
+
+    /// \brief Marks the task as being done. Returns false if it already was
+    ///        (or is being done by another thread), true if the caller should
+    ///        process it.
+    ///
+    /// A claimed task has to be either commit(...)ed or release(...)d.
+    bool claim(const std::string& key)
+    {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.keys.count(key) || 
+            (shared_ && !shared_->claim(contentHash(key.data(), key.size())))) {
+            return false;
+        }
+        shard.keys.insert(key);
+        return true;
+    }
+
+    /// \brief Records a claimed task as successfully done, to be written to 
+    ///        the index file with the next batch.
+    void commit(const std::string& key)
+    {
+        if (shared_) {
+            shared_->commit(contentHash(key.data(), key.size()));
+        }
+        if (!persist_) {
+            return;
+        }
+        {
+            Shard& shard = shardFor(key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.to_write.push_back(key);
+        }
+        if (++pending_ >= INDEX_FLUSH_BATCH) {
+            // Whoever is already writing will not necessarily take our 
+            // entries, but the next batch (or the destructor) will.
+            std::unique_lock<std::mutex> lock(file_mutex_, std::try_to_lock);
+            if (lock.owns_lock()) {
+                write();
+            }
+        }
+    }
+
+    /// \brief Forgets a claimed task that failed, so it can be retried.
+    void release(const std::string& key)
+    {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.keys.erase(key);
+        if (shared_) {
+            shared_->release(contentHash(key.data(), key.size()));
+        }
+    }
+
+    /// \brief Appends every committed task to the index file.
+    void flush()
+    {
+        if (persist_) {
+            std::lock_guard<std::mutex> lock(file_mutex_);
+            write();
+        }
+    }
+
+private:
+    struct Shard
+    {
+        std::mutex                      mutex;
+        std::unordered_set<std::string> keys;
+        std::vector<std::string>        to_write;
+    };
+
+    Shard& shardFor(const std::string& key)
+    {
+        return shards_[std::hash<std::string>()(key) % INDEX_SHARDS];
+    }
+
+    /// \brief Takes the buffered entries of every shard and appends them.
+    ///        file_mutex_ has to be held.
+    void write()
+    {
+        std::vector<std::string> batch;
+        for (auto& shard: shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            batch.insert(batch.end(),
+                         std::make_move_iterator(shard.to_write.begin()),
+                         std::make_move_iterator(shard.to_write.end()));
+            shard.to_write.clear();
+        }
+        if (batch.empty()) {
+            return;
+        }
+        pending_ -= batch.size();
+
+        std::string buffer;
+        for (const auto& key: batch) {
+            buffer += key;
+            buffer += '\n';
+        }
+
+        std::ofstream outfile(index_file_, std::ios::app | std::ios::binary);
+        outfile.write(buffer.data(), buffer.size());
+        if (!outfile) {
+            std::cerr << "Failed to append to index file: " 
+                      << index_file_ << "\n";
+        }
+    }
+
+    fs::path            index_file_;
+    bool                persist_;
+    SharedClaims*       shared_;
+    Shard               shards_[INDEX_SHARDS];
+    std::atomic<size_t> pending_;   // Committed entries not written yet.
+    std::mutex          file_mutex_;
+};
+
+/// \brief Priority of StealingQueue items keeping them in FIFO order.
+template <typename T>
+struct FifoPriority
+{
+    uint64_t operator()(const T&) const
+    {
+        return 0;
+    }
+};
+
+/// \brief A bounded, blocking work-stealing priority queue shared by a pool 
+///        of workers.
+///
+/// Each worker owns a heap of items protected by its own mutex. A worker 
+/// takes the item of highest priority (given by Priority, and then the 
+/// oldest) from its own heap and, when it is empty, steals the one of 
+/// highest priority of the other workers' heaps. push(...) spreads new 
+/// items over the heaps in round-robin, so no single lock serializes every 
+/// dequeue.
+///
+/// push(...) blocks while the queue holds capacity items and pop(...) blocks
+/// while there is nothing to take anywhere. Once close() is called, 
+/// push(...) is refused and pop(...) keeps returning the remaining items, 
+/// then returns false when everything is taken.
+///
+template <typename T, typename Priority = FifoPriority<T>>
+class StealingQueue
+{
+private:
+    struct Entry
+    {
+        uint64_t    priority;
+        uint64_t    order;      // Submit order, between equal priorities.
+        T           item;
+
+        // Heap order: the top is the highest priority, then lowest order.
+        bool operator<(const Entry& other) const
+        {
+            return priority < other.priority || 
+                   (priority == other.priority && order > other.order);
+        }
+    };
+
+    struct WorkerDeque
+    {
+        std::vector<Entry>  items;      // A heap.
+        std::mutex          mutex;
+    };
+
+    std::vector<std::unique_ptr<WorkerDeque>> deques_;
+    size_t                  capacity_;
+    Priority                priority_;
+
+    std::atomic<size_t>     size_;      // Items in all the deques.
+    std::atomic<size_t>     used_;      // Them and the room taken to add 
+                                        // more, checked against capacity_.
+    std::atomic<size_t>     next_;      // Round-robin submit index.
+    std::atomic<uint64_t>   order_;     // Submit order of the next item.
+    std::atomic<size_t>     sleeping_;  // Workers waiting in pop(...).
+    std::atomic<bool>       closed_;
+
+    // Only used to sleep when there is nothing to take, or no room left.
+    std::mutex              sleep_mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+
+public:
+    /// \param n_workers: Number of deques, one per worker (at least 1).
+    /// \param capacity:  Max. number of items before push(...) blocks.
+    StealingQueue(size_t n_workers, size_t capacity = QUEUE_CAPACITY):
+        capacity_(capacity),
+        size_(0),
+        used_(0),
+        next_(0),
+        order_(0),
+        sleeping_(0),
+        closed_(false)
+    {
+        for (size_t i = 0; i < std::max<size_t>(n_workers, 1); ++i) {
+            deques_.push_back(std::make_unique<WorkerDeque>());
+        }
+    }
+
+    /// \brief Add an item to the next deque in round-robin, waiting for room
+    ///        if the queue is full. Returns false if the queue was closed.
+    bool push(T item)
+    {
+        if (reserve(1) == 0) {
+            return false;
+        }
+        pushTo(next_++ % deques_.size(), std::move(item));
+        return true;
+    }
+
+    /// \brief Add items in bulk, in runs that fit the room left (waiting for
+    ///        room between them), each spread over the deques with a single
+    ///        lock per deque. Returns false if the queue was closed, with 
+    ///        only the items not added left in items.
+    bool pushBatch(std::vector<T>& items)
+    {
+        const size_t n = deques_.size();
+        size_t start = 0;
+        while (start < items.size()) {
+            const size_t count = reserve(items.size() - start);
+            if (count == 0) {
+                items.erase(items.begin(), items.begin() + start);
+                return false;
+            }
+
+            const size_t   run   = (count + n - 1) / n;
+            const size_t   first = next_.fetch_add(n);
+            const uint64_t order = order_.fetch_add(count);
+            const size_t   last  = start + count;
+            for (size_t i = 0, begin = start; begin < last; ++i) {
+                const size_t end = std::min(last, begin + run);
+                WorkerDeque& deque = *deques_[(first + i) % n];
+                {
+                    std::lock_guard<std::mutex> lock(deque.mutex);
+                    for (size_t j = begin; j < end; ++j) {
+                        uint64_t priority = priority_(items[j]);
+                        deque.items.push_back({priority, 
+                                               order + (j - start), 
+                                               std::move(items[j])});
+                        std::push_heap(deque.items.begin(), 
+                                       deque.items.end());
+                    }
+                }
+                size_ += end - begin;
+                begin = end;
+            }
+            start = last;
+
+            if (sleeping_ > 0) {
+                std::lock_guard<std::mutex> lock(sleep_mutex_);
+                not_empty_.notify_all();
+            }
+        }
+        return true;
+    }
+
+    /// \brief Add an item to the given worker's own deque.
+    ///
+    /// Meant for workers queueing follow-up items: never blocks on capacity,
+    /// since a worker waiting for room could be the one that has to make it,
+    /// and still accepts items once closed, so they are part of the drain.
+    void pushLocal(size_t worker, T item)
+    {
+        ++used_;
+        pushTo(worker % deques_.size(), std::move(item));
+    }
+
+    /// \brief Take an item for the given worker: the top of its own deque
+    ///        first, otherwise the top of another worker's deque.
+    ///
+    /// Waits for an item if there is none. Returns false if the queue is 
+    /// closed and there is nothing left to take.
+    bool pop(size_t worker, T& item)
+    {
+        while (true) {
+            if (tryPop(worker, item)) {
+                return true;
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            ++sleeping_;
+            not_empty_.wait(lock, [this] { return closed_ || size_ > 0; });
+            --sleeping_;
+            if (closed_ && size_ == 0) {
+                return false;
+            }
+        }
+    }
+
+    /// \brief Refuse further items and wake up every waiting thread.
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    size_t size()
+    {
+        return size_;
+    }
+
+    size_t workers() const
+    {
+        return deques_.size();
+    }
+
+private:
+    /// \brief Takes room for up to wanted items (at least one), waiting for
+    ///        some if the queue is full, and returns how many. Returns 0 if
+    ///        the queue is closed.
+    size_t reserve(size_t wanted)
+    {
+        size_t used = used_;
+        while (!closed_) {
+            if (used < capacity_) {
+                const size_t count = std::min(wanted, capacity_ - used);
+                if (used_.compare_exchange_weak(used, used + count)) {
+                    return count;
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            not_full_.wait(lock, [this] { 
+                return closed_ || used_ < capacity_; 
+            });
+            used = used_;
+        }
+        return 0;
+    }
+
+    /// \brief Adds an item whose room is taken in used_.
+    void pushTo(size_t index, T item)
+    {
+        WorkerDeque& deque = *deques_[index];
+        uint64_t priority = priority_(item);
+        uint64_t order = order_++;
+        {
+            std::lock_guard<std::mutex> lock(deque.mutex);
+            deque.items.push_back({priority, order, std::move(item)});
+            std::push_heap(deque.items.begin(), deque.items.end());
+        }
+        ++size_;
+
+        // sleeping_ is incremented under sleep_mutex_ before waiting, so
+        // either we see the sleeper here or it sees the new size_.
+        if (sleeping_ > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            not_empty_.notify_one();
+        }
+    }
+
+    bool tryPop(size_t worker, T& item)
+    {
+        const size_t n = deques_.size();
+        for (size_t i = 0; i < n; ++i) {
+            WorkerDeque& deque = *deques_[(worker + i) % n];
+            std::unique_lock<std::mutex> lock(deque.mutex);
+            if (deque.items.empty()) {
+                continue;
+            }
+            std::pop_heap(deque.items.begin(), deque.items.end());
+            item = std::move(deque.items.back().item);
+            deque.items.pop_back();
+            lock.unlock();
+
+            --size_;
+            if (used_-- >= capacity_) {
+                std::lock_guard<std::mutex> sleep_lock(sleep_mutex_);
+                not_full_.notify_one();
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+/// \brief Rasterization resources of a thread, reused from one task to the
+///        next.
+///
+/// Keeps a NSVGrasterizer (and so its edge, point and memory page pools) and
+/// a growable pixel buffer, so the hot path of a task does not allocate. 
+/// Use RasterContext::local() to get the instance of the calling thread.
+///
+class RasterContext
+{
+private:
+    NSVGrasterizer*                     rast_;
+    std::unique_ptr<unsigned char[]>    pixels_;
+    size_t                              capacity_;
+
+    RasterContext():
+        rast_(nsvgCreateRasterizer()),
+        capacity_(0)
+    {
+    }
+
+public:
+    ~RasterContext()
+    {
+        nsvgDeleteRasterizer(rast_);
+    }
+
+    RasterContext(const RasterContext&) = delete;
+    RasterContext& operator=(const RasterContext&) = delete;
+
+    static RasterContext& local()
+    {
+        thread_local RasterContext context;
+        return context;
+    }
+
+    NSVGrasterizer* rasterizer()
+    {
+        return rast_;
+    }
+
+    /// \brief Returns a buffer of at least size bytes, valid until the next
+    ///        call from this thread. Not initialized: nsvgRasterize clears 
+    ///        what it renders to.
+    ///
+    /// \param temp: Receives the allocation if size is above 
+    ///              PIXEL_ARENA_MAX, so a single huge task does not stay 
+    ///              pinned in every thread.
+    unsigned char* pixels(size_t size, std::unique_ptr<unsigned char[]>& temp)
+    {
+        if (size > PIXEL_ARENA_MAX) {
+            temp.reset(new unsigned char[size]);
+            return temp.get();
+        }
+        if (size > capacity_) {
+            pixels_.reset(new unsigned char[size]);
+            capacity_ = size;
+        }
+        return pixels_.get();
+    }
+};
+
+/// \brief Helper threads shared by every rasterization split in bands, 
+///        started once (hardware_concurrency - 1 of them) and kept for the 
+///        whole run, with their RasterContext.
+///
+/// run(job, helpers) calls job on the calling thread and on up to helpers 
+/// idle pool threads, which join it as they become free. A job must take 
+/// its work from shared counters and never wait for the other callers: by
+/// the time the calling thread is done with it, a helper may not even have
+/// started. So however many workers rasterize large images at once, at 
+/// most hardware_concurrency - 1 helpers are added to them.
+class BandPool
+{
+public:
+    using Job = std::function<void(NSVGrasterizer*)>;
+
+    static BandPool& global()
+    {
+        static BandPool pool;
+        return pool;
+    }
+
+    /// \brief Helper threads of the pool.
+    int threads() const
+    {
+        return int(threads_.size());
+    }
+
+    /// \brief Calls job with the rasterizer of the calling thread and of up 
+    ///        to helpers pool threads, and returns once they all returned.
+    void run(const Job& job, int helpers)
+    {
+        Pending pending{&job, std::min(helpers, threads()), 0};
+        if (pending.slots > 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(&pending);
+            wake_.notify_all();
+        }
+        job(RasterContext::local().rasterizer());
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = std::find(jobs_.begin(), jobs_.end(), &pending);
+        if (it != jobs_.end()) {
+            jobs_.erase(it);    // No more helpers can join.
+        }
+        done_.wait(lock, [&] { return pending.active == 0; });
+    }
+
+private:
+    struct Pending
+    {
+        const Job*  job;
+        int         slots;      // Helpers that can still join.
+        int         active;     // Helpers running it.
+    };
+
+    std::mutex                  mutex_;
+    std::condition_variable     wake_;
+    std::condition_variable     done_;
+    std::deque<Pending*>        jobs_;
+    std::vector<std::thread>    threads_;
+    bool                        stopping_ = false;
+
+    BandPool()
+    {
+        const unsigned n = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 1; i < n; ++i) {
+            threads_.emplace_back([this] { loop(); });
+        }
+    }
+
+    ~BandPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            wake_.notify_all();
+        }
+        for (auto& thread: threads_) {
+            thread.join();
+        }
+    }
+
+    void loop()
+    {
+        NSVGrasterizer* rast = RasterContext::local().rasterizer();
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [&] { return stopping_ || !jobs_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            Pending* pending = jobs_.front();
+            if (--pending->slots == 0) {
+                jobs_.pop_front();
+            }
+            ++pending->active;
+            lock.unlock();
+            (*pending->job)(rast);
+            lock.lock();
+            if (--pending->active == 0) {
+                done_.notify_all();
+            }
+        }
+    }
+};
+
+/// \brief Rasterizes an image like nsvgRasterize, but split in horizontal 
+///        bands rendered by several threads.
+///
+/// Bands of BAND_ROWS rows are taken in turn by the calling thread and the
+/// BandPool helpers free to join, each with its own rasterizer, and 
+/// un-premultiplied. Once every band is rendered, they are defringed (which
+/// reads the neighbour rows) the same way. The result is identical to 
+/// nsvgRasterize.
+///
+/// \param geometry: If not null, the edges of image to use (see 
+///                  nsvgSetFlattened).
+/// \param coverage: Renders the coverage only, one byte per pixel (see 
+///                  nsvgSetCoverage), which is not post-processed.
+void rasterizeBands(NSVGimage* image, 
+                    float scale,
+                    unsigned char* dst, 
+                    int w, 
+                    int h, 
+                    int stride,
+                    const RasterSettings& raster,
+                    const NSVGflattened* geometry = nullptr,
+                    bool coverage = false)
+{
+    const int n_bands = (h + BAND_ROWS - 1) / BAND_ROWS;
+    BandPool& pool = BandPool::global();
+
+    std::atomic<int> next_band(0);
+    pool.run([&](NSVGrasterizer* rast) {
+        raster.apply(rast);
+        nsvgSetFlattened(rast, geometry);
+        nsvgSetCoverage(rast, coverage);
+        int band;
+        while ((band = next_band++) < n_bands) {
+            int y0 = band * BAND_ROWS;
+            int y1 = std::min(h, y0 + BAND_ROWS);
+            nsvgRasterizeRows(rast, image, 0, 0, scale, dst, w, h, stride, 
+                              y0, y1);
+            if (!coverage) {
+                nsvgUnpremultiplyRows(dst, w, h, stride, y0, y1);
+            }
+        }
+    }, n_bands - 1);
+    if (coverage) {
+        return;
+    }
+
+    std::atomic<int> next_defringe(0);
+    pool.run([&](NSVGrasterizer*) {
+        int band;
+        while ((band = next_defringe++) < n_bands) {
+            int y0 = band * BAND_ROWS;
+            nsvgDefringeRows(dst, w, h, stride, y0, y0 + BAND_ROWS);
+        }
+    }, n_bands - 1);
+}
+
+/// \brief Rasterizes an image like nsvgRasterize, with the calling thread's 
+///        rasterizer, or with rasterizeBands if at least BAND_RASTER_SIZE 
+///        wide.
+///
+/// \param geometry, coverage: See rasterizeBands.
+void rasterize(NSVGimage* image, 
+               float scale, 
+               unsigned char* dst, 
+               int w, 
+               int h, 
+               int stride,
+               const RasterSettings& raster,
+               const NSVGflattened* geometry = nullptr,
+               bool coverage = false)
+{
+    StageTimer timer(Stage::RASTERIZE);
+    if (size_t(w) >= BAND_RASTER_SIZE) {
+        rasterizeBands(image, scale, dst, w, h, stride, raster, geometry,
+                       coverage);
+    } else {
+        NSVGrasterizer* rast = RasterContext::local().rasterizer();
+        raster.apply(rast);
+        nsvgSetFlattened(rast, geometry);
+        nsvgSetCoverage(rast, coverage);
+        nsvgRasterize(rast, image, 0, 0, scale, dst, w, h, stride);
+    }
+}
+
+/// \brief Compresses the coverage of an image painted with color to PNG 
+///        (see SingleColor). Throws on errors.
+///
+/// pixels holds h rows of w * color.channels() bytes, with the coverage in
+/// the first w bytes of each, and is encoded in place.
+PNGDataPtr encodeCoverage(unsigned char* pixels,
+                          int w,
+                          int h,
+                          const SingleColor& color,
+                          const PNGSettings& settings)
+{
+    const size_t stride = size_t(w) * color.channels();
+
+    StageTimer timer(Stage::ENCODE);
+    SingleColor::Palette palette{};
+    if (!color.gray()) {
+        palette = color.palette(pixels, w, h, stride);
+    }
+    for (int y = 0; y < h; ++y) {
+        color.encodeRow(pixels + y * stride, w, palette);
+    }
+    int len = 0;
+    unsigned char* png = nullptr;
+    if (color.gray()) {
+        png = stbi_write_png_to_mem_ex(pixels, stride, w, h, 
+                                       color.channels(), &len, 
+                                       settings.level, settings.filter);
+    } else {
+        png = stbi_write_png_indexed_to_mem(pixels, stride, w, h, 
+                                            palette.colors, palette.count, 
+                                            &len, settings.level, 
+                                            settings.filter);
+    }
+    if (png == nullptr) {
+        throw std::runtime_error("Error in write_png_to_mem");
+    }
+    return std::make_shared<const PNGData>(png, len);
+}
+
+/// \brief Rasterizes an image painted with color to its coverage only, 
+///        and compresses it to PNG (see SingleColor). Throws on errors.
+///
+/// The coverage is rendered in the rows of the encoded image, which are 
+/// then encoded in place. geometry is as for rasterize.
+PNGDataPtr coveragePNG(NSVGimage* image,
+                       float scale,
+                       int w,
+                       int h,
+                       const SingleColor& color,
+                       const PNGSettings& settings,
+                       const RasterSettings& raster,
+                       const NSVGflattened* geometry = nullptr)
+{
+    const size_t stride = size_t(w) * color.channels();
+
+    std::unique_ptr<unsigned char[]> temp_data;
+    unsigned char* pixels = RasterContext::local().pixels(h * stride, 
+                                                          temp_data);
+    rasterize(image, scale, pixels, w, h, stride, raster, geometry, true);
+    return encodeCoverage(pixels, w, h, color, settings);
+}
+
+/// \brief Rasterizes an image and compresses it to PNG a few bands of 
+///        BAND_ROWS rows at a time, without ever holding the whole frame.
+///
+/// Up to STREAM_BANDS bands are rendered, un-premultiplied, then defringed 
+/// by the calling thread and the BandPool helpers free to join (one band
+/// each), then filtered and given to a DeflateStream in order before the 
+/// next ones. The buffer holds them and two more rows: defringing reads the
+/// last row of the previous bands (final) and the first of the next ones 
+/// (rendered ahead). The image is flattened once for all the bands, unless 
+/// geometry is given. The PNG decodes to the same image as with 
+/// nsvgRasterize and PNGWriter over the whole frame, and is the same file 
+/// except with stb deflate, which compresses each band as its own block
+/// (see deflate_backend.h). Throws on errors.
+///
+/// The time spent on the bands is recorded as the RASTERIZE and ENCODE 
+/// stages, as if they were done one after the other. geometry is as for
+/// rasterize.
+///
+/// \param color: If not null, the color image is painted with: only its 
+///               coverage is rendered, without post-processing, and 
+///               encoded as by coveragePNG (with every coverage in the 
+///               palette of an indexed image).
+PNGDataPtr streamPNG(NSVGimage* image,
+                     float scale,
+                     int w,
+                     int h,
+                     const PNGSettings& settings,
+                     const RasterSettings& raster,
+                     const NSVGflattened* geometry = nullptr,
+                     const SingleColor* color = nullptr)
+{
+    const size_t channels    = color ? color->channels() : BPP;
+    const size_t stride      = size_t(w) * channels;
+    const size_t filt_stride = stride + 1;  // Filter type, then the row.
+
+    BandPool& pool = BandPool::global();
+    const int n_bands     = (h + BAND_ROWS - 1) / BAND_ROWS;
+    const int window      = std::min({n_bands, pool.threads() + 1, 
+                                      STREAM_BANDS});
+    const int window_rows = window * BAND_ROWS;
+
+    SingleColor::Palette palette{};
+    if (color && !color->gray()) {
+        palette = color->palette(nullptr, w, h, stride);
+    }
+
+    RasterContext& context = RasterContext::local();
+    std::unique_ptr<NSVGflattened, void (*)(NSVGflattened*)> flattened(
+        nullptr, nsvgDeleteFlattened);
+    if (geometry == nullptr) {
+        StageTimer timer(Stage::FLATTEN);
+        raster.apply(context.rasterizer());
+        flattened.reset(nsvgFlattenImage(context.rasterizer(), image, scale));
+        geometry = flattened.get();     // Flattened by each band if null.
+    }
+    std::unique_ptr<unsigned char[]> temp_data;
+    unsigned char* rows = context.pixels((window_rows + 2) * stride 
+                                         + BAND_ROWS * filt_stride,
+                                         temp_data);
+    unsigned char* filtered = rows + (window_rows + 2) * stride;
+
+    // Row y of the image is rows[(y - y0 + 1) * stride] while processing the 
+    // bands starting at y0.
+    std::unique_ptr<DeflateStream, void (*)(DeflateStream*)> stream(
+        deflateStreamBegin(settings.level, filt_stride * h), 
+        deflateStreamAbort);
+    if (!stream) {
+        throw std::runtime_error("Cannot start PNG compression");
+    }
+
+    Clock::duration raster_time{};
+    Clock::time_point start = Clock::now();
+    int rendered = 0;   // Rows rendered and un-premultiplied so far.
+    for (int y0 = 0; y0 < h; y0 += window_rows) {
+        const int y1  = std::min(h, y0 + window_rows);
+        const int end = std::min(h, y1 + 1);
+        unsigned char* bands = rows + stride;
+        const Clock::time_point bands_start = Clock::now();
+
+        // The rows from rendered to end, in parts of at most BAND_ROWS.
+        const int first = rendered;
+        const int n_parts = (end - first + BAND_ROWS - 1) / BAND_ROWS;
+        std::atomic<int> next_part(0);
+        pool.run([&](NSVGrasterizer* rast) {
+            raster.apply(rast);
+            nsvgSetFlattened(rast, geometry);
+            nsvgSetCoverage(rast, color != nullptr);
+            int part;
+            while ((part = next_part++) < n_parts) {
+                const int r0 = first + part * BAND_ROWS;
+                const int r1 = std::min(end, r0 + BAND_ROWS);
+                unsigned char* dst = bands + (r0 - y0) * stride;
+                nsvgRasterizeBand(rast, image, 0, 0, scale, 
+                                  dst, w, h, stride, r0, r1);
+                if (!color) {
+                    nsvgUnpremultiplyBand(dst, w, h, stride, r0, r1);
+                }
+            }
+        }, n_parts - 1);
+        rendered = end;
+
+        if (color) {
+            for (int y = y0; y < y1; ++y) {
+                color->encodeRow(bands + (y - y0) * stride, w, palette);
+            }
+        } else {
+            const int n_defringe = (y1 - y0 + BAND_ROWS - 1) / BAND_ROWS;
+            std::atomic<int> next_defringe(0);
+            pool.run([&](NSVGrasterizer*) {
+                int band;
+                while ((band = next_defringe++) < n_defringe) {
+                    const int b0 = y0 + band * BAND_ROWS;
+                    const int b1 = std::min(y1, b0 + BAND_ROWS);
+                    nsvgDefringeBand(bands + (b0 - y0) * stride, w, h, 
+                                     stride, b0, b1);
+                }
+            }, n_defringe - 1);
+        }
+        raster_time += Clock::now() - bands_start;
+
+        for (int b0 = y0; b0 < y1; b0 += BAND_ROWS) {
+            const int b1 = std::min(y1, b0 + BAND_ROWS);
+            if (!stbi_write_png_filter_rows(bands + (b0 - y0) * stride, 
+                                            stride, w, b0, b1 - b0, 
+                                            channels, settings.filter, 
+                                            filtered) ||
+                !deflateStreamWrite(stream.get(), filtered, 
+                                    (b1 - b0) * filt_stride)) {
+                throw std::runtime_error("Error in PNG compression");
+            }
+        }
+
+        // Keep the last row of the bands and the one rendered ahead.
+        std::memmove(rows, bands + (y1 - 1 - y0) * stride, 
+                     (rendered - y1 + 1) * stride);
+    }
+
+    int zlen = 0;
+    std::unique_ptr<unsigned char, void (*)(void*)> zlib(
+        deflateStreamEnd(stream.release(), &zlen), std::free);
+    if (!zlib) {
+        throw std::runtime_error("Error in PNG compression");
+    }
+    int len = 0;
+    unsigned char* png = nullptr;
+    if (color && !color->gray()) {
+        png = stbi_write_png_indexed_from_zlib(zlib.get(), zlen, w, h, 
+                                               palette.colors, palette.count,
+                                               &len);
+    } else {
+        png = stbi_write_png_from_zlib(zlib.get(), zlen, w, h, channels,
+                                       &len);
+    }
+    if (png == nullptr) {
+        throw std::runtime_error("Error in write_png_from_zlib");
+    }
+    Metrics::global().record(Stage::RASTERIZE, raster_time);
+    Metrics::global().record(Stage::ENCODE, 
+                             Clock::now() - start - raster_time);
+    return std::make_shared<const PNGData>(png, len);
+}
+
+/// \brief A class representing the processing of one SVG file to a PNG stream.
+///
+/// Not thread safe ! The optional PNGCache is, and can be shared by many 
+/// runners.
+///
+class TaskRunner
+{
+private:
+    TaskDef     task_def_;
+    PNGCache*   png_cache_;
+    SVGCache*   svg_cache_;
+
+public:
+    /// \param png_cache: If not null, the result is looked up in it first (the
+    ///                   SVG is not processed on a hit) and stored in it after.
+    /// \param svg_cache: If not null, the parsed SVG is taken from it.
+    TaskRunner(const TaskDef& task_def, 
+               PNGCache* png_cache = nullptr,
+               SVGCache* svg_cache = nullptr):
+        task_def_(task_def),
+        png_cache_(png_cache),
+        svg_cache_(svg_cache)
+    {
+    }
+
+    /// \brief Processes the task. Returns false if an error occured (the 
+    ///        error is reported on stderr).
+    bool operator()()
+    {
+        PNGDataPtr data = render();
+        return data && writePNG(task_def_.fname_out, *data);
+    }
+
+    /// \brief Produces the PNG data of the task, without writing it out. 
+    ///        Returns nullptr if an error occured (the error is reported on 
+    ///        stderr).
+    PNGDataPtr render()
+    {
+        const std::string&  fname_in    = task_def_.fname_in;
+        const size_t&       width       = task_def_.size; 
+        const size_t&       height      = task_def_.size; 
+        const size_t        stride      = width * BPP;
+        const size_t        image_size  = height * stride;
+        const float&        scale       = float(width) / ORG_WIDTH;
+
+        std::string cache_key;
+        bool use_cache = png_cache_ && PNGCache::makeKey(task_def_, cache_key);
+        if (use_cache) {
+            PNGDataPtr data = png_cache_->get(cache_key);
+            if (data) {
+                TaskLog::write(std::cerr, "Cache hit for ", fname_in, ".");
+                return data;
+            }
+        }
+
+        TaskLog::write(std::cerr, "Running for ", fname_in, "...");
+
+        SVGImagePtr         image_in        = nullptr;
+        RasterContext&      context         = RasterContext::local();
+        PNGDataPtr          data            = nullptr;
+
+        try {
+
+            // Read the file ...
+            image_in = loadImage();
+            if (image_in == nullptr) {
+                std::string msg = "Cannot parse '" + fname_in + "'.";
+                throw std::runtime_error(msg.c_str());
+            }
+            const NSVGflattened* geometry = this->geometry(image_in);
+            SingleColor color;
+            const bool single = !task_def_.png.rgba &&
+                                SingleColor::of(image_in.get(), color);
+            if (width >= STREAM_RASTER_SIZE) {
+                // Raster and compress it a band at a time ...
+                data = streamPNG(image_in.get(), 
+                                 scale, 
+                                 width, 
+                                 height, 
+                                 task_def_.png,
+                                 task_def_.raster,
+                                 geometry,
+                                 single ? &color : nullptr);
+            } else if (single) {
+                // Raster its coverage only and compress it ...
+                data = coveragePNG(image_in.get(), 
+                                   scale, 
+                                   width, 
+                                   height, 
+                                   color,
+                                   task_def_.png,
+                                   task_def_.raster,
+                                   geometry);
+            } else {
+                // Raster it ...
+                std::unique_ptr<unsigned char[]> temp_data;
+                unsigned char* image_data = context.pixels(image_size, 
+                                                           temp_data);
+                rasterize(image_in.get(), 
+                          scale, 
+                          image_data, 
+                          width, 
+                          height, 
+                          stride,
+                          task_def_.raster,
+                          geometry);
+
+                // Compress it ...
+                PNGWriter writer;
+                writer(width, height, BPP, image_data, stride, task_def_.png);
+                data = writer.getData();
+            }
+            if (use_cache) {
+                png_cache_->put(cache_key, data);
+            }
+            
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Exception while processing "
+                      << fname_in
+                      << ": "
+                      << e.what()
+                      << std::endl;
+        }
+        
+        TaskLog::write(std::cerr, "\nDone for ", fname_in, ".");
+
+        return data;
+    }
+
+    /// \brief Rasterizes the task in dst (size * size * BPP bytes), without 
+    ///        compressing it. Returns false if an error occured (the error is
+    ///        reported on stderr).
+    bool renderPixels(unsigned char* dst)
+    {
+        const std::string&  fname_in    = task_def_.fname_in;
+        const int           size        = task_def_.size;
+
+        TaskLog::write(std::cerr, "Running for ", fname_in, "...");
+        SVGImagePtr image_in = loadImage();
+        if (image_in == nullptr) {
+            std::cerr << "Exception while processing "
+                      << fname_in
+                      << ": Cannot parse '" << fname_in << "'."
+                      << std::endl;
+            return false;
+        }
+        rasterize(image_in.get(), 
+                  float(size) / ORG_WIDTH, 
+                  dst, 
+                  size, 
+                  size, 
+                  size * BPP,
+                  task_def_.raster,
+                  geometry(image_in));
+        TaskLog::write(std::cerr, "\nDone for ", fname_in, ".");
+        return true;
+    }
+
+private:
+    /// \brief Returns the parsed input, from the task, the SVG cache or the
+    ///        file, or nullptr if it cannot be parsed.
+    SVGImagePtr loadImage()
+    {
+        if (task_def_.image) {
+            return task_def_.image;
+        }
+        if (svg_cache_) {
+            return svg_cache_->get(task_def_.fname_in);
+        }
+        return SVGCache::parse(task_def_.fname_in);
+    }
+
+    /// \brief Returns the shared flattened edges of image for the task, if 
+    ///        any (built on first use).
+    const NSVGflattened* geometry(const SVGImagePtr& image)
+    {
+        if (!task_def_.geometry) {
+            return nullptr;
+        }
+        return task_def_.geometry->get(image, 
+                                       RasterContext::local().rasterizer());
+    }
+};
+
+/// \brief Writes PNG files on its own threads, so that the workers hand off
+///        their results and go on with the next task instead of waiting on 
+///        the file system.
+///
+/// At most max_bytes of PNG data wait or are being written at a time: submit
+/// blocks beyond that until writes complete (a larger buffer is taken once 
+/// nothing else is in flight). The destructor writes what is left.
+class OutputWriter
+{
+public:
+    /// \brief Called on a writer thread with the result of the write.
+    using Callback = std::function<void(bool)>;
+
+private:
+    struct Job
+    {
+        std::string fname;
+        PNGDataPtr  data;
+        Callback    done;
+    };
+
+    std::deque<Job>             jobs_;
+    size_t                      max_bytes_;
+    size_t                      bytes_;     // Submitted and not written yet.
+    bool                        closed_;
+    std::mutex                  mutex_;
+    std::condition_variable     job_signal_;
+    std::condition_variable     space_signal_;
+    std::vector<std::thread>    threads_;
+
+public:
+    OutputWriter(size_t n_threads, size_t max_bytes):
+        max_bytes_(max_bytes),
+        bytes_(0),
+        closed_(false)
+    {
+        for (size_t i = 0; i < n_threads; ++i) {
+            threads_.emplace_back(&OutputWriter::writeLoop, this);
+        }
+    }
+
+    ~OutputWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        job_signal_.notify_all();
+        for (auto& thread: threads_) {
+            thread.join();
+        }
+    }
+
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
+
+    /// \brief Queues data to be written to fname, then done to be called.
+    void submit(const std::string& fname, PNGDataPtr data, Callback done)
+    {
+        const size_t size = data->size();
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            space_signal_.wait(lock, [&] { 
+                return bytes_ == 0 || bytes_ + size <= max_bytes_; 
+            });
+            bytes_ += size;
+            jobs_.push_back({fname, std::move(data), std::move(done)});
+        }
+        job_signal_.notify_one();
+    }
+
+private:
+    void writeLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            job_signal_.wait(lock, [this] { 
+                return closed_ || !jobs_.empty(); 
+            });
+            if (jobs_.empty()) {
+                return;
+            }
+            Job job = std::move(jobs_.front());
+            jobs_.pop_front();
+            lock.unlock();
+
+            bool success = writePNG(job.fname, *job.data);
+            job.done(success);
+
+            lock.lock();
+            bytes_ -= job.data->size();
+            space_signal_.notify_all();
+        }
+    }
+};
+
+/// \brief A persistent, content-addressed cache of PNG files, shared by 
+///        successive runs (and processes).
+///
+/// Entries are keyed by the content hash of the SVG, the size and the PNG
+/// settings, so an edited input never hits a stale entry, whatever its 
+/// path or time. The hash must be computed from the input by this run 
+/// (fetch does it if unknown), never taken from a manifest, which may be
+/// older than the input (see Processor::queueManifestTasks). Entries are
+/// stored as
+///
+///   folder/v<DISK_CACHE_VERSION>-<deflate backend>/<hh>/<hash>_<size>_<settings>.png
+///
+/// <hh> being the first two digits of the hash, to keep directories small.
+/// Non-default anti-aliasing adds a _a<RasterSettings::spec> suffix, 
+/// downsampled images a _d<master size> one, PNGSettings::rgba a _rgba
+/// one and the sizes rendered from the edges of a larger one (see 
+/// sharedFlattenSize) a _g<its size> one.
+/// DISK_CACHE_VERSION has to be bumped when the rendering changes.
+///
+/// A hit hard links the entry to the output (or copies it if it can't), 
+/// without reading it. New entries are written to a temporary file, then 
+/// renamed: concurrent processes never see a partial entry. Nothing is 
+/// ever evicted: delete the folder to reclaim space.
+class DiskCache
+{
+public:
+    static constexpr int DISK_CACHE_VERSION = 2;
+
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t stores;
+    };
+
+private:
+    fs::path            root_;
+    std::atomic<size_t> hits_;
+    std::atomic<size_t> misses_;
+    std::atomic<size_t> stores_;
+
+    /// \brief Returns the path of the entry of def, whose hash is known.
+    fs::path entryPath(const TaskDef& def) const
+    {
+        std::string suffix;
+        if (!(def.raster == RasterSettings())) {
+            suffix += "_a" + def.raster.spec();
+        }
+        if (def.master) {
+            suffix += "_d" + std::to_string(def.master);
+        }
+        if (def.png.rgba) {
+            suffix += "_rgba";
+        }
+        if (int flatten_size = sharedFlattenSize(def)) {
+            suffix += "_g" + std::to_string(flatten_size);
+        }
+        char name[128];
+        std::snprintf(name, sizeof(name), "%016llx_%d_%d_%d%s.png",
+                      (unsigned long long)def.hash, def.size, 
+                      def.png.level, def.png.filter, suffix.c_str());
+        return root_ / std::string(name, 2) / name;
+    }
+
+public:
+    explicit DiskCache(const fs::path& folder):
+        root_(folder / ("v" + std::to_string(DISK_CACHE_VERSION) + "-" 
+                        + deflateBackendName())),
+        hits_(0),
+        misses_(0),
+        stores_(0)
+    {
+    }
+
+    /// \brief Produces def.fname_out from the cache if it has it. Returns 
+    ///        false on a miss.
+    ///
+    /// Computes def.hash if it is not known (and leaves it 0 if the input
+    /// cannot be read).
+    bool fetch(TaskDef& def)
+    {
+        if (!def.hash && !fileHash(def.fname_in, def.hash)) {
+            ++misses_;
+            return false;
+        }
+
+        const fs::path entry = entryPath(def);
+        ::unlink(def.fname_out.c_str());
+        if (::link(entry.c_str(), def.fname_out.c_str()) != 0) {
+            std::error_code err;
+            if (errno == ENOENT || 
+                !fs::copy_file(entry, def.fname_out, err)) {
+                ++misses_;
+                return false;
+            }
+        }
+        ++hits_;
+        return true;
+    }
+
+    /// \brief Adds data as the entry of def, whose hash must be known. 
+    ///        Failures only mean the entry is missing next time.
+    void store(const TaskDef& def, const PNGData& data)
+    {
+        if (!def.hash) {
+            return;
+        }
+        const fs::path entry = entryPath(def);
+        std::error_code err;
+        fs::create_directories(entry.parent_path(), err);
+
+        std::string temp = entry.string() + ".tmp";
+        temp += std::to_string(::getpid()) + '-' 
+              + std::to_string(std::hash<std::thread::id>()(
+                                   std::this_thread::get_id()));
+        if (!writeFile(temp, data.data(), data.size())) {
+            return;
+        }
+        if (::rename(temp.c_str(), entry.c_str()) != 0) {
+            ::unlink(temp.c_str());
+            return;
+        }
+        ++stores_;
+    }
+
+    Stats stats() const
+    {
+        return {hits_, misses_, stores_};
+    }
+};
+
+/// \brief A binary task manifest, written by scripts/gen_tasks.py 
+///        --manifest=FILE, read in place from a memory mapped file.
+///
+/// Layout, all little endian (see write_manifest in gen_tasks.py):
+///  - header:  MAGIC, then u32 string count, task count, size count and a
+///             reserved u32.
+///  - strings: per string, u32 offset in the string data and u32 length. 
+///             Paths used by several tasks are stored once.
+///  - tasks:   per task, u32 input and output string indices, u32 first 
+///             size index and size count, and the u64 content hash of the
+///             input (see contentHash).
+///  - sizes:   u32 each.
+///  - the string data.
+///
+/// open(...) checks every index and offset, so task(...) cannot read out of
+/// the file.
+class Manifest
+{
+public:
+    static constexpr char   MAGIC[8]    = {'A','C','M','A','N','I','F','1'};
+
+private:
+    static constexpr size_t HEADER_SIZE = 24;
+    static constexpr size_t STRING_SIZE = 8;
+    static constexpr size_t TASK_SIZE   = 24;
+
+    const unsigned char*    data_;
+    size_t                  size_;
+    uint32_t                n_strings_, n_tasks_, n_sizes_;
+    const unsigned char*    strings_;
+    const unsigned char*    tasks_;
+    const unsigned char*    sizes_;
+    const unsigned char*    string_data_;
+    size_t                  string_data_size_;
+
+    static uint32_t le32(const unsigned char* p)
+    {
+        return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 
+             | uint32_t(p[3]) << 24;
+    }
+
+    static uint64_t le64(const unsigned char* p)
+    {
+        return uint64_t(le32(p)) | uint64_t(le32(p + 4)) << 32;
+    }
+
+    std::string_view string(uint32_t index) const
+    {
+        const unsigned char* entry = strings_ + size_t(index) * STRING_SIZE;
+        return std::string_view(
+            reinterpret_cast<const char*>(string_data_) + le32(entry),
+            le32(entry + 4));
+    }
+
+    /// \brief Checks the layout and every index. Returns false if invalid.
+    bool validate()
+    {
+        if (size_ < HEADER_SIZE || 
+            std::memcmp(data_, MAGIC, sizeof(MAGIC)) != 0) {
+            return false;
+        }
+        n_strings_ = le32(data_ + 8);
+        n_tasks_   = le32(data_ + 12);
+        n_sizes_   = le32(data_ + 16);
+
+        size_t tables = HEADER_SIZE + size_t(n_strings_) * STRING_SIZE 
+                      + size_t(n_tasks_) * TASK_SIZE 
+                      + size_t(n_sizes_) * sizeof(uint32_t);
+        if (tables > size_) {
+            return false;
+        }
+        strings_          = data_ + HEADER_SIZE;
+        tasks_            = strings_ + size_t(n_strings_) * STRING_SIZE;
+        sizes_            = tasks_ + size_t(n_tasks_) * TASK_SIZE;
+        string_data_      = data_ + tables;
+        string_data_size_ = size_ - tables;
+
+        for (uint32_t i = 0; i < n_strings_; ++i) {
+            const unsigned char* entry = strings_ + size_t(i) * STRING_SIZE;
+            if (size_t(le32(entry)) + le32(entry + 4) > string_data_size_) {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < n_tasks_; ++i) {
+            const unsigned char* task = tasks_ + size_t(i) * TASK_SIZE;
+            if (le32(task) >= n_strings_ || le32(task + 4) >= n_strings_ ||
+                size_t(le32(task + 8)) + le32(task + 12) > n_sizes_ ||
+                le32(task + 12) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    Manifest():
+        data_(nullptr),
+        size_(0),
+        n_strings_(0),
+        n_tasks_(0),
+        n_sizes_(0)
+    {
+    }
+
+    ~Manifest()
+    {
+        if (data_) {
+            ::munmap(const_cast<unsigned char*>(data_), size_);
+        }
+    }
+
+    Manifest(const Manifest&) = delete;
+    Manifest& operator=(const Manifest&) = delete;
+
+    /// \brief Returns if the file at fd starts with MAGIC.
+    static bool isManifest(int fd)
+    {
+        char magic[sizeof(MAGIC)];
+        return ::pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+               std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+    }
+
+    /// \brief Maps and checks the manifest in fd. Returns false, with an 
+    ///        error on stderr, if it cannot be read or is invalid.
+    bool open(int fd)
+    {
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+            std::cerr << "Error: Cannot read the manifest." << std::endl;
+            return false;
+        }
+        void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, 
+                            fd, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "Error: Cannot map the manifest: " 
+                      << std::strerror(errno) << std::endl;
+            return false;
+        }
+        data_ = static_cast<const unsigned char*>(data);
+        size_ = st.st_size;
+        if (!validate()) {
+            std::cerr << "Error: Invalid manifest." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    size_t size() const
+    {
+        return n_tasks_;
+    }
+
+    /// \brief Fills def with task i, expanded as Processor::parse would. 
+    ///        Returns false, with an error on stderr, if one of its sizes is
+    ///        invalid (see checkSize).
+    bool task(size_t i, TaskDef& def) const
+    {
+        const unsigned char* task = tasks_ + i * TASK_SIZE;
+        const uint32_t first   = le32(task + 8);
+        const uint32_t n_sizes = le32(task + 12);
+
+        def.fname_in.assign(string(le32(task)));
+        def.fname_out.assign(string(le32(task + 4)));
+        def.image = nullptr;
+        def.png = PNGSettings();
+        def.raster = RasterSettings();
+        def.hash = le64(task + 16);
+        def.sizes.clear();
+        for (uint32_t j = 0; j < n_sizes; ++j) {
+            const uint32_t size = le32(sizes_ + (first + j) * 4);
+            if (!checkSize(size, def.fname_in + ';' + def.fname_out)) {
+                return false;
+            }
+            def.sizes.push_back(int(size));
+        }
+        if (n_sizes == 1) {
+            def.size = def.sizes[0];
+            def.sizes.clear();
+            replaceSize(def.fname_out, def.size);
+        } else {
+            def.size = 0;
+        }
+        return true;
+    }
+};
+
+/// \brief Scheduling priority of a task: its estimated cost, so that the 
+///        longest tasks are started first (LPT) and do not end up as the 
+///        tail of a batch.
+///
+/// The cost is the pixel count, which rasterization and compression are 
+/// proportional to. A multi-size task counts all its sizes: it is only 
+/// expanded in single-size tasks, but then early.
+struct TaskCost
+{
+    uint64_t operator()(const TaskDef& def) const
+    {
+        auto area = [](int size) -> uint64_t {
+            return size > 0 ? uint64_t(size) * size : 0;
+        };
+        uint64_t pixels = area(def.size);
+        for (int size: def.sizes) {
+            pixels += area(size);
+        }
+        return pixels;
+    }
+};
+
+/// \brief Settings of the downsample mode, where the sizes of a multi-size
+///        task are resized from a render at the largest one instead of being
+///        rendered each (see Processor::runDownsampled).
+///
+/// enabled:   If the mode is used at all.
+/// max_error: If not negative, the first multi-size task of each family (the
+///            inputs of a same folder) also renders its sizes directly, and
+///            the family only uses downsampling if no size differs from its
+///            direct render by more than this RMS error (see imageError).
+struct DownsampleSettings
+{
+    bool    enabled     = false;
+    double  max_error   = -1.0;
+};
+
+/// \brief Returns if size can be downsampled from a render at master:
+///        by a power of two factor, so that the pixels stay aligned.
+bool isDownsampleOf(int size, int master)
+{
+    if (size <= 0 || size >= master || master % size) {
+        return false;
+    }
+    const int factor = master / size;
+    return (factor & (factor - 1)) == 0;
+}
+
+/// \brief Returns the RMS difference of two RGBA images (BPP, contiguous),
+///        in 0-255 units, over premultiplied channels: colors of transparent
+///        pixels, which are never seen, do not count.
+double imageError(const unsigned char* a, const unsigned char* b, size_t pixels)
+{
+    if (pixels == 0) {
+        return 0.0;
+    }
+    double sum = 0.0;
+    for (size_t i = 0; i < pixels; ++i, a += BPP, b += BPP) {
+        for (size_t c = 0; c < 3; ++c) {
+            double d = (double(a[c]) * a[3] - double(b[c]) * b[3]) / 255.0;
+            sum += d * d;
+        }
+        double d = double(a[3]) - b[3];
+        sum += d * d;
+    }
+    return std::sqrt(sum / (pixels * BPP));
+}
+
+/// \brief A class that organizes the processing of SVG assets in PNG files.
+///
+/// Receives task definition as input and processes them, resulting in PNG 
+/// files being written on disk.
+///
+/// Two main methods are offered: 
+///  - parseAndRun(...): Parses a task definition string and immediately
+///    processes the request. Blocking call.
+///  - parseAndQueue(...): Parses a task definition string and put it at the
+///    back of a queue for future processing. Returns immediately. If the 
+///    definition is valid it will be processed in the future.
+///    parseAndQueueLines(...) does the same for a block of lines at once.
+///
+/// Queued tasks are processed by a pool of background threads. Use 
+/// waitIdle() to wait for every queued task to be done, or drain() to also
+/// stop the pool.
+///
+/// Results are kept in a PNGCache, so a request that arrives again for the
+/// same unchanged SVG and size is only written out.
+///
+class Processor
+{
 private:
-    // The tasks to run queue (FIFO).
-    std::queue<TaskDef> task_queue_;
+    // The tasks to run queue, one deque per thread (see StealingQueue), 
+    // longest tasks first.
+    StealingQueue<TaskDef, TaskCost> task_queue_;
+
+    // Compressed results and parsed inputs, shared by all threads.
+    PNGCache png_cache_;
+    SVGCache svg_cache_;
+
+    // Tasks already done in this run or a previous one.
+    TaskIndex task_index_;
+
+    // PNG and anti-aliasing settings of the tasks that do not give theirs.
+    PNGSettings     png_settings_;
+    RasterSettings  raster_settings_;
+
+    // Number of tasks queued or being processed, used by waitIdle() and 
+    // waitPending(), woken up from pending_wake_ tasks down.
+    size_t                  pending_tasks_;
+    size_t                  pending_wake_;
+    std::mutex              pending_mutex_;
+    std::condition_variable idle_signal_;
+
+    // Writes the results, and then marks the tasks as done. Declared after
+    // what the completions use, so that it is destroyed (and has written
+    // everything) first.
+    OutputWriter output_;
+
+    // Results kept across runs, if enabled.
+    std::unique_ptr<DiskCache> disk_cache_;
+
+    // Downsample mode, and the decision of each family once checked
+    // (FAMILY_CHECKING while its first task runs).
+    enum FamilyState { FAMILY_CHECKING, FAMILY_OK, FAMILY_BAD };
+    DownsampleSettings                           downsample_;
+    std::unordered_map<std::string, FamilyState> families_;
+    std::mutex                                   families_mutex_;
+
+    // Where results go instead of files, if set.
+    ResultRing* ring_;
+
+    // Where tasks are rendered instead of locally, if set.
+    RemotePool* remote_;
+
+    std::vector<std::thread> queue_threads_;
+
+public:
+    /// \brief Default constructor.
+    ///
+    /// Creates background threads that monitors and processes the task queue.
+    /// These threads are joined and stopped at the destruction of the instance.
+    /// 
+    /// \param n_threads: Number of threads (default: NUM_THREADS)
+    /// \param png:       Default PNG settings of the tasks.
+    /// \param raster:    Default anti-aliasing settings of the tasks.
+    /// \param disk_cache: Folder of the DiskCache, or empty to not use one.
+    /// \param downsample: Downsample mode of the multi-size tasks.
+    /// \param ring:       If not null, where the results go instead of the
+    ///                    output files (see runToRing).
+    /// \param claims:     If not null, the claims of the tasks shared with 
+    ///                    other processes (see SharedClaims).
+    /// \param remote:     If not null, where the single-size tasks are 
+    ///                    rendered (each thread then waits on one).
+    Processor(int n_threads = NUM_THREADS, 
+              const PNGSettings& png = PNGSettings(),
+              const RasterSettings& raster = RasterSettings(),
+              const std::string& disk_cache = "",
+              const DownsampleSettings& downsample = DownsampleSettings(),
+              ResultRing* ring = nullptr,
+              SharedClaims* claims = nullptr,
+              RemotePool* remote = nullptr):
+        task_queue_(validThreads(n_threads)),
+        task_index_("output", claims),
+        png_settings_(png),
+        raster_settings_(raster),
+        pending_tasks_(0),
+        pending_wake_(0),
+        output_(OUTPUT_THREADS, OUTPUT_MAX_BYTES),
+        downsample_(downsample),
+        ring_(ring),
+        remote_(remote)
+    {
+        if (!disk_cache.empty()) {
+            disk_cache_ = std::make_unique<DiskCache>(disk_cache);
+        }
+        n_threads = int(task_queue_.workers());
+
+        std::cout << "Number of active threads: "<< n_threads << std::endl;
+
+        for (int i = 0; i < n_threads; ++i) {
+            queue_threads_.push_back(
+                std::thread(&Processor::processQueue, this, i)
+            );
+        }
+    }
+
+    ~Processor()
+    {
+        drain();
+    }
+
+    /// \brief Blocks until every task queued so far has been processed.
+    ///
+    /// The processor stays usable: new tasks can be queued afterwards.
+    void waitIdle()
+    {
+        waitPending(0);
+    }
+
+    /// \brief Blocks until at most max tasks are queued or being processed.
+    void waitPending(size_t max)
+    {
+        std::unique_lock<std::mutex> lock(pending_mutex_);
+        pending_wake_ = std::max(pending_wake_, max);
+        idle_signal_.wait(lock, [&] { return pending_tasks_ <= max; });
+    }
+
+    /// \brief Stops accepting tasks, processes what is left in the queue and
+    ///        joins the background threads.
+    ///
+    /// Tasks queued after this call are ignored. Safe to call more than once.
+    void drain()
+    {
+        task_queue_.close();
+
+        for (auto& qthread: queue_threads_) {
+            if (qthread.joinable()) {
+                qthread.join();
+            }
+        }
+    }
+
+    /// \brief Parse a task definition string and fills the references TaskDef
+    ///        structure. Returns true if it's a success, false if a failure 
+    ///        occured and the structure is not valid.
+    ///
+    /// The format is "fname_in;fname_out;size[;png[;aa]]". size can also be
+    /// a comma separated list (e.g. "in.svg;out_{size}.png;48,96,192"), 
+    /// giving a multi-size task whose fname_out has to contain SIZE_PATTERN.
+    /// The optional png and aa fields override the processor's PNG and 
+    /// anti-aliasing settings (see PNGSettings::parse and 
+    /// RasterSettings::parse), empty meaning not overriden.
+    bool parse(std::string_view line, TaskDef& def)
+    {
+            // Single pass over the line: only the first five fields are used.
+            std::string_view tokens[5];
+            size_t n_tokens = 0;
+            for (size_t start = 0; n_tokens < 5; ) {
+                size_t end = line.find(';', start);
+                tokens[n_tokens++] = line.substr(start, end - start);
+                if (end == std::string_view::npos) {
+                    break;
+                }
+                start = end + 1;
+            }
+
+            if (n_tokens < 3) {
+                std::cerr << "Error: Wrong line format: "
+                        << line
+                        << " (size: " << line.size() << ")."
+                        << std::endl;
+                return false;
+            }
+
+            std::string_view fname_in     = tokens[0];
+            std::string_view fname_out    = tokens[1];
+            std::string_view width_str    = tokens[2]; 
+
+            PNGSettings png = png_settings_;
+            if (n_tokens >= 4 && !tokens[3].empty() &&
+                !PNGSettings::parse(std::string(tokens[3]), png)) {
+                return false;
+            }
+            RasterSettings raster = raster_settings_;
+            if (n_tokens >= 5 && !tokens[4].empty() &&
+                !RasterSettings::parse(std::string(tokens[4]), raster)) {
+                return false;
+            }
+
+            std::vector<int> sizes;
+            for (size_t start = 0; start <= width_str.size(); ) {
+                size_t end = std::min(width_str.find(',', start), 
+                                      width_str.size());
+                if (end > start) {
+                    int64_t size = 0;
+                    if (!parseSize(width_str.substr(start, end - start), 
+                                   size)) {
+                        std::cerr << "Error: Invalid size '" 
+                                  << width_str.substr(start, end - start)
+                                  << "' in task '" << line << "'." 
+                                  << std::endl;
+                        return false;
+                    }
+                    if (!checkSize(size, line)) {
+                        return false;
+                    }
+                    sizes.push_back(int(size));
+                }
+                start = end + 1;
+            }
+            if (sizes.empty()) {
+                std::cerr << "Error: No size in task '" << line << "'." 
+                          << std::endl;
+                return false;
+            }
+
+            if (sizes.size() > 1 && 
+                fname_out.find(SIZE_PATTERN) == std::string_view::npos) {
+                std::cerr << "Error: Multi-size task without "
+                          << SIZE_PATTERN
+                          << " in output name: "
+                          << line
+                          << std::endl;
+                return false;
+            }
+
+            def.fname_in.assign(fname_in);
+            def.fname_out.assign(fname_out);
+            def.image = nullptr;
+            def.png = png;
+            def.raster = raster;
+            if (sizes.size() == 1) {
+                def.size = sizes[0];
+                def.sizes.clear();
+                replaceSize(def.fname_out, def.size);
+            } else {
+                def.size = 0;
+                def.sizes = std::move(sizes);
+            }
+            return true;
+    }
+
+    /// \brief Tries to parse the given task definition and run it.
+    ///
+    /// The parsing method will output error messages if it is not valid. 
+    /// Nothing occurs if it's the case.
+    void parseAndRun(const std::string& line_org)
+    {
+        TaskDef def;
+        if (!parse(line_org, def)) {
+            return;
+        }
+        if (def.sizes.empty()) {
+            TaskRunner runner(def, &png_cache_, &svg_cache_);
+            runner();
+            return;
+        }
+        def.image = svg_cache_.get(def.fname_in);
+        for (int size: def.sizes) {
+            TaskRunner runner(taskForSize(def, size), &png_cache_, &svg_cache_);
+            runner();
+        }
+    }
+
+    /// \brief Parse the task definition and put it in the processing queue.
+    ///
+    /// If the definition is invalid, error messages are sent to stderr and 
+    /// nothing is queued. Blocks while the queue is full.
+    void parseAndQueue(const std::string& line_org)
+    {
+        TaskDef def;
+        if (parse(line_org, def)) {
+            TaskLog::write(std::cerr, "Queueing task '", line_org, "'.");
+            def.queued = Clock::now();
+            addPending(def, 1);
+            if (!task_queue_.push(def)) {
+                std::cerr << "Error: Processor is drained, dropping task '"
+                          << line_org
+                          << "'."
+                          << std::endl;
+                taskDone(def, false);
+            }
+        }
+    }
+
+    /// \brief Same as parseAndQueue for every non-empty line of lines (each
+    ///        ended by a new line character, except maybe the last one), 
+    ///        queued in bulk.
+    ///
+    /// \param group: If not null, the tasks are part of it, and the invalid
+    ///               lines are rejected from it.
+    void parseAndQueueLines(std::string_view lines, 
+                            const std::shared_ptr<TaskGroup>& group = nullptr)
+    {
+        std::vector<TaskDef> batch;
+        std::string log;
+        const bool logging = TaskLog::enabled();
+        TaskDef def;
+        while (!lines.empty()) {
+            size_t end = std::min(lines.find('\n'), lines.size());
+            std::string_view line = lines.substr(0, end);
+            lines.remove_prefix(std::min(end + 1, lines.size()));
+            if (line.empty()) {
+                continue;
+            }
+            if (!parse(line, def)) {
+                if (group) {
+                    group->reject();
+                }
+                continue;
+            }
+            if (logging) {
+                log.append("Queueing task '").append(line).append("'.\n");
+            }
+            def.group = group;
+            batch.push_back(std::move(def));
+        }
+        if (batch.empty()) {
+            return;
+        }
+        std::cerr << log << std::flush;
+        queueBatch(batch);
+    }
+
+    /// \brief Queues every task of a manifest, in order and in bulk. Tasks 
+    ///        use the processor's PNG and anti-aliasing settings.
+    void queueManifest(const Manifest& manifest)
+    {
+        const size_t queued = queueManifestTasks(manifest, 0, manifest.size());
+        std::cerr << "Queued " << queued << " tasks from manifest." 
+                  << std::endl;
+    }
+
+    /// \brief Same as queueManifest for the tasks from first to end 
+    ///        (excluded) only. Returns how many were valid and queued.
+    size_t queueManifestTasks(const Manifest& manifest, 
+                              size_t first, 
+                              size_t end)
+    {
+        const size_t batch_tasks = 1024;
+        std::vector<TaskDef> batch;
+        size_t queued = 0;
+        for (size_t i = first; i < end; ++i) {
+            batch.emplace_back();
+            if (!manifest.task(i, batch.back())) {
+                batch.pop_back();
+                continue;
+            }
+            ++queued;
+            batch.back().png = png_settings_;
+            batch.back().raster = raster_settings_;
+            if (disk_cache_) {
+                // The inputs may have been edited since the manifest was 
+                // written: the disk cache, which outlives both, hashes 
+                // them itself.
+                batch.back().hash = 0;
+            }
+            if (batch.size() == batch_tasks) {
+                queueBatch(batch);
+                batch.clear();
+            }
+        }
+        if (!batch.empty()) {
+            queueBatch(batch);
+        }
+        return queued;
+    }
+
+    /// \brief Queues a batch of parsed tasks at once, as room is made for 
+    ///        them in the queue.
+    void queueBatch(std::vector<TaskDef>& batch)
+    {
+        const Clock::time_point now = Clock::now();
+        for (TaskDef& def: batch) {
+            def.queued = now;
+            addPending(def, 1);
+        }
+        if (!task_queue_.pushBatch(batch)) {
+            std::cerr << "Error: Processor is drained, dropping " 
+                      << batch.size() << " tasks." << std::endl;
+            for (const TaskDef& def: batch) {
+                taskDone(def, false);
+            }
+        }
+    }
+
+    PNGCache::Stats cacheStats()
+    {
+        return png_cache_.stats();
+    }
+
+    SVGCache::Stats svgCacheStats()
+    {
+        return svg_cache_.stats();
+    }
+
+    /// \brief Returns if a DiskCache is used, and then its statistics.
+    bool diskCacheStats(DiskCache::Stats& stats)
+    {
+        if (!disk_cache_) {
+            return false;
+        }
+        stats = disk_cache_->stats();
+        return true;
+    }
+
+    /// \brief Returns if the internal queue is empty (true) or not.
+    ///
+    /// NOTE: Tasks being processed are not in the queue anymore, use 
+    /// waitIdle() to wait for them.
+    bool queueEmpty()
+    {
+        return task_queue_.size() == 0;
+    }
+
+    /// \brief Returns the number of processing threads.
+    size_t workers() const
+    {
+        return queue_threads_.size();
+    }
+
+    /// \brief Returns the number of tasks waiting in the queue.
+    size_t queueDepth()
+    {
+        return task_queue_.size();
+    }
 
-    // The cache hash map (TODO). Note that we use the string definition as the // key.
-    using PNGHashMap = std::unordered_map<std::string, PNGDataPtr>;
-    PNGHashMap png_cache_;
+    /// \brief Returns the number of tasks queued or being processed.
+    size_t pendingTasks()
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        return pending_tasks_;
+    }
 
-    std::atomic<bool> should_run_;           // Used to signal the end of the processor to
-                                // threads.
+    /// \brief Returns a table of the stage latencies (see Metrics), the 
+    ///        cache hit rates and the queue state, for --stats.
+    std::string statsText()
+    {
+        const Metrics::Snapshots stages = Metrics::global().snapshot();
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3)
+            << "Stage         count    mean ms     p50 ms     p90 ms"
+               "     p99 ms     max ms\n";
+        for (size_t i = 0; i < size_t(Stage::COUNT); ++i) {
+            const Histogram::Snapshot& stage = stages[i];
+            const double mean = stage.count ? double(stage.sum_ns) / stage.count
+                                            : 0.0;
+            out << std::left << std::setw(11) << stageName(Stage(i)) 
+                << std::right << std::setw(8) << stage.count;
+            for (double ns: {mean, 
+                             stage.percentile(0.50), 
+                             stage.percentile(0.90),
+                             stage.percentile(0.99),
+                             double(stage.max_ns)}) {
+                out << std::setw(11) << ns / 1e6;
+            }
+            out << '\n';
+        }
 
-    std::vector<std::thread> queue_threads_;
+        auto rate = [](size_t hits, size_t misses) {
+            return hits + misses ? 100.0 * hits / (hits + misses) : 0.0;
+        };
+        const PNGCache::Stats png = cacheStats();
+        const SVGCache::Stats svg = svgCacheStats();
+        out << std::setprecision(1) 
+            << "Cache hit rates: PNG " << rate(png.hits, png.misses) 
+            << "%, SVG " << rate(svg.hits, svg.misses) << '%';
+        DiskCache::Stats disk;
+        if (diskCacheStats(disk)) {
+            out << ", disk " << rate(disk.hits, disk.misses) << '%';
+        }
+        out << ".\nQueue: " << queueDepth() << " waiting, " 
+            << pendingTasks() << " pending.\n";
+        return out.str();
+    }
 
-public:
-    /// \brief Default constructor.
+    /// \brief Returns the metrics in the Prometheus text format, for 
+    ///        MetricsServer.
     ///
-    /// Creates background threads that monitors and processes the task queue.
-    /// These threads are joined and stopped at the destruction of the instance.
-    /// 
-    /// \param n_threads: Number of threads (default: NUM_THREADS)
-    Processor(int n_threads = NUM_THREADS):
-        should_run_(true)
+    /// Stage latencies are a histogram with buckets of 4 times the previous 
+    /// one, from 1us to about 68s.
+    std::string metricsText()
+    {
+        const Metrics::Snapshots stages = Metrics::global().snapshot();
+        std::ostringstream out;
+        out << "# HELP asset_conv_stage_seconds Latency of the processing "
+               "stages.\n"
+               "# TYPE asset_conv_stage_seconds histogram\n";
+        for (size_t i = 0; i < size_t(Stage::COUNT); ++i) {
+            const Histogram::Snapshot& stage = stages[i];
+            const std::string name = "asset_conv_stage_seconds";
+            const std::string label = std::string("stage=\"") 
+                                    + stageName(Stage(i)) + '"';
+            for (uint64_t le = 1 << 10; le <= (1ull << 36); le <<= 2) {
+                out << name << "_bucket{" << label << ",le=\"" 
+                    << le / 1e9 << "\"} " << stage.countBelow(le) << '\n';
+            }
+            out << name << "_bucket{" << label << ",le=\"+Inf\"} " 
+                << stage.count << '\n'
+                << name << "_sum{" << label << "} " << stage.sum_ns / 1e9 
+                << '\n'
+                << name << "_count{" << label << "} " << stage.count << '\n';
+        }
+
+        const PNGCache::Stats png = cacheStats();
+        const SVGCache::Stats svg = svgCacheStats();
+        out << "# HELP asset_conv_cache_requests_total Cache lookups.\n"
+               "# TYPE asset_conv_cache_requests_total counter\n";
+        auto cache = [&out](const char* cache, size_t hits, size_t misses) {
+            out << "asset_conv_cache_requests_total{cache=\"" << cache 
+                << "\",result=\"hit\"} " << hits << '\n'
+                << "asset_conv_cache_requests_total{cache=\"" << cache 
+                << "\",result=\"miss\"} " << misses << '\n';
+        };
+        cache("png", png.hits, png.misses);
+        cache("svg", svg.hits, svg.misses);
+        DiskCache::Stats disk;
+        if (diskCacheStats(disk)) {
+            cache("disk", disk.hits, disk.misses);
+        }
+
+        out << "# HELP asset_conv_queue_depth Tasks waiting in the queue.\n"
+               "# TYPE asset_conv_queue_depth gauge\n"
+               "asset_conv_queue_depth " << queueDepth() << '\n'
+            << "# HELP asset_conv_pending_tasks Tasks queued or being "
+               "processed.\n"
+               "# TYPE asset_conv_pending_tasks gauge\n"
+               "asset_conv_pending_tasks " << pendingTasks() << '\n';
+        return out.str();
+    }
+
+private:
+    /// \brief Returns n_threads if valid, NUM_THREADS otherwise (with a 
+    ///        warning).
+    static int validThreads(int n_threads)
     {
         if (n_threads <= 0) {
             std::cerr << "Warning, incorrect number of threads ("
@@ -246,198 +3409,873 @@ public:
                       << "), setting to "
                       << NUM_THREADS
                       << std::endl;
-            n_threads = NUM_THREADS;
+            return NUM_THREADS;
         }
+        return n_threads;
+    }
 
-        std::cout << "Number of active threads: "<< n_threads << std::endl;
+    /// \brief Parses a decimal integer, maybe signed and surrounded by white
+    ///        space. Returns false if str is anything else, or out of range.
+    static bool parseSize(std::string_view str, int64_t& value)
+    {
+        size_t start = 0;
+        size_t end = str.size();
+        while (start < end && std::isspace((unsigned char)str[start])) {
+            ++start;
+        }
+        while (end > start && std::isspace((unsigned char)str[end - 1])) {
+            --end;
+        }
+        if (start < end && str[start] == '+') {
+            ++start;
+        }
+        auto [ptr, err] = std::from_chars(str.data() + start, 
+                                          str.data() + end, value);
+        return start < end && err == std::errc() && ptr == str.data() + end;
+    }
 
-        for (int i = 0; i < n_threads; ++i) {
-            queue_threads_.push_back(
-                std::thread(&Processor::processQueue, this)
-            );
+    /// \brief Adds count pending tasks, of def's group if any.
+    void addPending(const TaskDef& def, size_t count)
+    {
+        if (def.group) {
+            def.group->add(count);
         }
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        pending_tasks_ += count;
     }
 
-    ~Processor()
+    /// \brief Marks one pending task as done (or failed) and wakes up 
+    ///        waitIdle() if it was the last one (or waitPending() if few 
+    ///        enough are left).
+    ///
+    /// A multi-size task successfully split in its sizes does not count in 
+    /// its group, its sizes do.
+    void taskDone(const TaskDef& def, bool success = true)
     {
-        should_run_ = false;
-        
-        for (auto& qthread: queue_threads_) {
-            qthread.join();
+        if (def.group) {
+            def.group->finish(success, def.sizes.empty() || !success);
+        }
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            wake = (--pending_tasks_ <= pending_wake_);
+        }
+        if (wake) {
+            idle_signal_.notify_all();
         }
     }
 
-    bool fileExistsInSubfolder(const std::string base_name, const fs::path& subfolder) {
-        
-        std::string stem = fs::path(base_name).stem().string();
-        fs::path cache_file = subfolder / "cache.txt";
+    /// \brief Parses the input of a multi-size task once and queues one task
+    ///        per size on the worker's own deque, sharing the parsed image.
+    ///
+    /// The other workers then steal the sizes to rasterize and compress them
+    /// in parallel. In downsample mode, the task may rather be produced at 
+    /// once by runDownsampled. Returns false if the input cannot be parsed.
+    bool queueSizes(size_t worker, TaskDef& def)
+    {
+        // With a disk cache, most sizes may not need the image at all: they
+        // only share it through svg_cache_ if rendered.
+        // The content hash of the input is then computed once for all.
+        // Remote tasks are routed by it and parsed by the workers.
+        const bool lazy = disk_cache_ || remote_;
+        if (lazy && !def.hash) {
+            fileHash(def.fname_in, def.hash);
+        }
+        if (downsample_.enabled && !ring_ && !remote_ && 
+            runDownsampled(worker, def)) {
+            return true;
+        }
+        def.image = lazy ? nullptr : svg_cache_.get(def.fname_in);
+        if (def.image == nullptr && !lazy) {
+            std::cerr << "Exception while processing "
+                      << def.fname_in
+                      << ": Cannot parse '" << def.fname_in << "'."
+                      << std::endl;
+            return false;
+        }
 
-        std::lock_guard<std::mutex> cache_lock(cache_mutex_);
+        // The sizes share the flattened image, built at the largest one.
+        // Remote workers flatten each size themselves.
+        const int largest = *std::max_element(def.sizes.begin(), 
+                                              def.sizes.end());
+        if (def.sizes.size() > 1 && !remote_) {
+            def.geometry = std::make_shared<SharedGeometry>(largest);
+        }
+        addPending(def, def.sizes.size());
+        def.queued = Clock::now();
+        for (int size: def.sizes) {
+            task_queue_.pushLocal(worker, taskForSize(def, size));
+        }
+        return true;
+    }
 
-        // Subfolder must be a valid directory.
-        if (!fs::exists(subfolder) || !fs::is_directory(subfolder)) {
-            std::cerr << "Subfolder does not exist: " << subfolder << "\n";
+    /// \brief Produces a multi-size task in downsample mode: the largest size
+    ///        is rendered once and the sizes a power of two smaller (see 
+    ///        isDownsampleOf) are resized from it with 
+    ///        stbir_resize_uint8_srgb. The other sizes are queued as usual.
+    ///
+    /// With a max error, the first task of a family also renders the resized
+    /// sizes directly to compare them, and writes those instead if the family
+    /// fails. Returns false, without doing anything, if the task has no size
+    /// to resize or its family is not (yet) known to pass.
+    ///
+    /// The images painted with a single color are written from their alpha
+    /// (see encodeCoverage), unless PNGSettings::rgba: the cache keys are 
+    /// those of such images, whose master size is the same as rendered 
+    /// directly.
+    bool runDownsampled(size_t worker, const TaskDef& def)
+    {
+        const int master = *std::max_element(def.sizes.begin(), 
+                                             def.sizes.end());
+        if (std::none_of(def.sizes.begin(), def.sizes.end(), 
+                         [master](int size) { 
+                             return isDownsampleOf(size, master); 
+                         })) {
             return false;
         }
 
-        // Create the file if it does not exist
-        if (!fs::exists(cache_file)) {
-            std::ofstream create_file(cache_file);
-            if (!create_file) {
-                std::cerr << "Failed to create cache file: " << cache_file << "\n";
+        bool check = false;
+        std::string family;
+        if (downsample_.max_error >= 0.0) {
+            family = fs::path(def.fname_in).parent_path().string();
+            std::lock_guard<std::mutex> lock(families_mutex_);
+            auto it = families_.find(family);
+            if (it == families_.end()) {
+                families_.emplace(family, FAMILY_CHECKING);
+                check = true;
+            } else if (it->second != FAMILY_OK) {
                 return false;
             }
-            create_file.close();
         }
+        auto uncheck = [&]() {
+            if (check) {
+                std::lock_guard<std::mutex> lock(families_mutex_);
+                families_.erase(family);
+            }
+        };
 
-        // Read the file line by line to find a match
-        std::ifstream infile(cache_file);
-        if (!infile) {
-            std::cerr << "Failed to open file: " << cache_file << "\n";
-            return false;
+        // The master size (not resized) and the resized ones to produce.
+        struct Output
+        {
+            TaskDef                     task;
+            std::string                 key;
+            std::vector<unsigned char>  pixels;
+            std::vector<unsigned char>  direct;     // Only when checking.
+        };
+        std::vector<Output> outputs;
+
+        addPending(def, def.sizes.size());
+        for (int size: def.sizes) {
+            Output out;
+            out.task = taskForSize(def, size);
+            if (size != master && !isDownsampleOf(size, master)) {
+                out.task.queued = Clock::now();
+                task_queue_.pushLocal(worker, out.task);
+                continue;
+            }
+            out.task.master = (size == master) ? 0 : master;
+            if (startTask(out.task, out.key)) {
+                outputs.push_back(std::move(out));
+            }
+        }
+        if (outputs.empty()) {
+            uncheck();
+            return true;
         }
 
-        std::string line;
-        while (std::getline(infile, line)) {
-            if (line == stem) {
-                std::cout << "Match found for \"" << stem << "\" in cache file.\n";
-                return true;
+        TaskLog::write(std::cerr, "Running for ", def.fname_in, 
+                       " (downsampled from ", master, ")...");
+
+        SVGImagePtr image = svg_cache_.get(def.fname_in);
+        if (image == nullptr) {
+            std::cerr << "Exception while processing "
+                      << def.fname_in
+                      << ": Cannot parse '" << def.fname_in << "'."
+                      << std::endl;
+            for (const Output& out: outputs) {
+                finishTask(out.task, out.key, nullptr);
+            }
+            uncheck();
+            return true;
+        }
+        // Rendered and resized in RGBA all the same, but then written from
+        // their alpha alone, as any other render of such an image.
+        SingleColor color;
+        const bool single = !def.png.rgba && 
+                            SingleColor::of(image.get(), color);
+        auto render = [&image, &def](int size) {
+            std::vector<unsigned char> pixels(size_t(size) * size * BPP);
+            rasterize(image.get(), 
+                      float(size) / ORG_WIDTH, 
+                      pixels.data(), 
+                      size, 
+                      size, 
+                      size * BPP,
+                      def.raster);
+            return pixels;
+        };
+
+        const std::vector<unsigned char> master_pixels = render(master);
+        double error = 0.0;
+        for (Output& out: outputs) {
+            if (!out.task.master) {
+                continue;
+            }
+            const int size = out.task.size;
+            out.pixels.resize(size_t(size) * size * BPP);
+            stbir_resize_uint8_srgb(master_pixels.data(), master, master, 0,
+                                    out.pixels.data(), size, size, 0,
+                                    BPP, 3, 0);
+            if (check) {
+                out.direct = render(size);
+                error = std::max(error, imageError(out.pixels.data(), 
+                                                   out.direct.data(), 
+                                                   size_t(size) * size));
             }
         }
-        infile.close();
 
-        // Not found, append fname_in to file
-        std::ofstream outfile(cache_file, std::ios::app);
-        if (!outfile) {
-            std::cerr << "Failed to open file for appending: " << cache_file << "\n";
+        bool use_resized = true;
+        if (check) {
+            use_resized = (error <= downsample_.max_error);
+            {
+                std::lock_guard<std::mutex> lock(families_mutex_);
+                families_[family] = use_resized ? FAMILY_OK : FAMILY_BAD;
+            }
+            TaskLog::write(std::cerr, "Downsampling ", 
+                           use_resized ? "enabled" : "disabled",
+                           " for '", family, "' (error ", error, 
+                           ", max ", downsample_.max_error, ").");
+        }
+
+        for (Output& out: outputs) {
+            const unsigned char* pixels = master_pixels.data();
+            if (out.task.master) {
+                pixels = use_resized ? out.pixels.data() : out.direct.data();
+                if (!use_resized) {
+                    // Claimed as resized: done as a direct render instead.
+                    out.task.master = 0;
+                    task_index_.release(out.key);
+                    out.key = TaskIndex::makeKey(out.task);
+                    if (!task_index_.claim(out.key)) {
+                        TaskLog::write(std::cout, "Already done: \"", 
+                                       out.key, "\".");
+                        taskDone(out.task);
+                        continue;
+                    }
+                }
+            }
+            const int size = out.task.size;
+            PNGDataPtr data = nullptr;
+            try {
+                if (single) {
+                    const size_t stride = size_t(size) * color.channels();
+                    std::vector<unsigned char> coverage(size * stride);
+                    for (size_t y = 0; y < size_t(size); ++y) {
+                        for (size_t x = 0; x < size_t(size); ++x) {
+                            coverage[y * stride + x] = 
+                                pixels[(y * size + x) * BPP + 3];
+                        }
+                    }
+                    data = encodeCoverage(coverage.data(), size, size, color,
+                                          out.task.png);
+                } else {
+                    PNGWriter writer;
+                    writer(size, size, BPP, pixels, size * BPP, 
+                           out.task.png);
+                    data = writer.getData();
+                }
+            } catch (const std::runtime_error& e) {
+                std::cerr << "Exception while processing "
+                          << out.task.fname_in
+                          << ": "
+                          << e.what()
+                          << std::endl;
+            }
+            std::string cache_key;
+            if (data && PNGCache::makeKey(out.task, cache_key)) {
+                png_cache_.put(cache_key, data);
+            }
+            finishTask(out.task, out.key, data);
+        }
+
+        TaskLog::write(std::cerr, "\nDone for ", def.fname_in, ".");
+        return true;
+    }
+
+    /// \brief Claims a single-size task in the index and looks it up in the
+    ///        disk cache. Returns true if it is then still to produce, with 
+    ///        its index key in key. Otherwise the task is done.
+    bool startTask(TaskDef& task_def, std::string& key)
+    {
+        key = TaskIndex::makeKey(task_def);
+        if (!task_index_.claim(key)) {
+            TaskLog::write(std::cout, "Already done: \"", key, "\".");
+            taskDone(task_def);
             return false;
         }
 
-        outfile << stem << '\n';
-        std::cout << "Appended \"" << stem << "\" to cache file.\n";
-        return false;
+        if (disk_cache_ && disk_cache_->fetch(task_def)) {
+            TaskLog::write(std::cerr, "Disk cache hit for ", 
+                           task_def.fname_in, ".");
+            task_index_.commit(key);
+            taskDone(task_def);
+            return false;
+        }
+        return true;
     }
 
-    /// \brief Parse a task definition string and fills the references TaskDef
-    ///        structure. Returns true if it's a success, false if a failure 
-    ///        occured and the structure is not valid.
-    bool parse(const std::string& line_org, TaskDef& def)
+    /// \brief Ends a task started with startTask with its PNG data, or null 
+    ///        if it failed.
+    ///
+    /// The task is done once written, on an output thread, which then also
+    /// stores it in the disk cache.
+    void finishTask(const TaskDef& task_def, 
+                    const std::string& key, 
+                    PNGDataPtr data)
     {
-        std::string line = line_org;
-        std::vector<std::string> tokens;
-            size_t pos;
-            while ((pos = line.find(";")) != std::string::npos) {
-                tokens.push_back(line.substr(0, pos));
-                line.erase(0, pos + 1);
+        if (!data) {
+            task_index_.release(key);
+            taskDone(task_def, false);
+            return;
+        }
+        output_.submit(task_def.fname_out, data, 
+                       [this, key, task_def, data](bool ok) {
+            if (ok) {
+                task_index_.commit(key);
+                if (disk_cache_) {
+                    disk_cache_->store(task_def, *data);
+                }
+            } else {
+                task_index_.release(key);
             }
-            tokens.push_back(line);
+            taskDone(task_def, ok);
+        });
+    }
 
-            if (tokens.size() < 3) {
-                std::cerr << "Error: Wrong line format: "
-                        << line_org
-                        << " (size: " << line_org.size() << ")."
-                        << std::endl;
-                return false;
+    /// \brief Queue processing thread function.
+    ///
+    /// Sleeps until a task is available and returns once the queue is closed
+    /// and empty.
+    /// \param worker: Index of the thread, i.e. of its own deque.
+    void processQueue(size_t worker)
+    {
+        TaskDef task_def;
+        while (task_queue_.pop(worker, task_def)) {
+            if (task_def.queued != Clock::time_point()) {
+                Metrics::global().record(Stage::QUEUE_WAIT, 
+                                         Clock::now() - task_def.queued);
+            }
+            if (!task_def.sizes.empty()) {
+                taskDone(task_def, queueSizes(worker, task_def));
+                continue;
             }
 
-            const std::string& fname_in     = tokens[0];
-            const std::string& fname_out    = tokens[1];
-            const std::string& width_str    = tokens[2]; 
+            if (task_def.deliver) {
+                TaskRunner runner(task_def, &png_cache_, &svg_cache_);
+                PNGDataPtr data = runner.render();
+                task_def.deliver(data);
+                taskDone(task_def, data != nullptr);
+                continue;
+            }
 
-            int width = std::atoi(width_str.c_str());
+            if (ring_) {
+                runToRing(task_def);
+                continue;
+            }
 
-            def = {
-                fname_in,
-                fname_out,
-                width
-            };
+            std::string key;
+            if (!startTask(task_def, key)) {
+                continue;
+            }
 
-            return true;
+            if (remote_) {
+                finishTask(task_def, key, renderRemote(task_def));
+                continue;
+            }
+            TaskRunner runner(task_def, &png_cache_, &svg_cache_);
+            finishTask(task_def, key, runner.render());
+        }
     }
 
-    /// \brief Tries to parse the given task definition and run it.
-    ///
-    /// The parsing method will output error messages if it is not valid. 
-    /// Nothing occurs if it's the case.
-    void parseAndRun(const std::string& line_org)
+    /// \brief Renders a single-size task on the workers of remote_ (see 
+    ///        RemotePool::render). Returns null, with an error on stderr, on
+    ///        failure.
+    PNGDataPtr renderRemote(const TaskDef& def)
     {
-        TaskDef def;
-        if (parse(line_org, def)) {
-            TaskRunner runner(def);
-            runner();
+        uint64_t hash = def.hash;
+        if (!hash && !fileHash(def.fname_in, hash)) {
+            std::cerr << "Exception while processing " << def.fname_in 
+                      << ": Cannot read '" << def.fname_in << "'." 
+                      << std::endl;
+            return nullptr;
         }
+        return remote_->render({hash, def.fname_in, def.size, 
+                                def.png.spec(), def.raster.spec()});
     }
 
-    /// \brief Parse the task definition and put it in the processing queue.
+    /// \brief Produces a single-size task in a slot of the ring: rasterized
+    ///        straight in it (RGBA), or compressed and copied (PNG). 
     ///
-    /// If the definition is invalid, error messages are sent to stderr and 
-    /// nothing is queued.
-    void parseAndQueue(const std::string& line_org)
+    /// The index and the disk cache are not used: files are not written, 
+    /// and the consumer gets a slot, maybe failed, for every task.
+    void runToRing(const TaskDef& task_def)
     {
-        std::queue<TaskDef> queue;
-        TaskDef def;
-        if (parse(line_org, def)) {
-            std::cerr << "Queueing task '" << line_org << "'." << std::endl;
-            {
-                std::lock_guard<std::mutex> lock(queu_mutex);// Lock the queue mutex to ensure thread safety
-                task_queue_.push(def);
-                queu_updated_signal.release(); // Notify the processing thread that a new task is available
+        const uint64_t slot = ring_->reserve();
+        const int size = task_def.size;
+        TaskRunner runner(task_def, &png_cache_, &svg_cache_);
+        bool success = false;
+        size_t bytes = size_t(size) * size * BPP;
+        if (ring_->format() == ResultRing::RGBA) {
+            success = bytes <= ring_->slotBytes() &&
+                      runner.renderPixels(ring_->data(slot));
+        } else {
+            PNGDataPtr data = runner.render();
+            bytes = data ? data->size() : 0;
+            success = data && bytes <= ring_->slotBytes();
+            if (success) {
+                std::memcpy(ring_->data(slot), data->data(), bytes);
             }
         }
+        if (bytes > ring_->slotBytes()) {
+            std::cerr << "Error: The result for " << task_def.fname_in
+                      << " (" << bytes << " bytes) does not fit in a ring "
+                      << "slot (" << ring_->slotBytes() << " bytes)." 
+                      << std::endl;
+        }
+        ring_->publish(slot, task_def.fname_out, success, size, size, bytes);
+        taskDone(task_def, success);
     }
+};
 
-    /// \brief Returns if the internal queue is empty (true) or not.
-    bool queueEmpty()
-    {
-        return task_queue_.empty();
+/// \brief Reads fd by blocks until its end, giving the complete lines of 
+///        each one at once to queue, then the last partial line.
+///
+/// read(2) returns what is available, so lines coming slowly through a pipe
+/// are still given as they arrive.
+void readLines(int fd, const std::function<void(std::string_view)>& queue)
+{
+    std::string block;
+    size_t kept = 0;
+    while (true) {
+        block.resize(kept + INGEST_BLOCK);
+        ssize_t n = ::read(fd, &block[kept], INGEST_BLOCK);
+        if (n < 0 && errno == EINTR) {
+            block.resize(kept);
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        block.resize(kept + n);
+        size_t end = block.rfind('\n');
+        if (end == std::string::npos) {
+            kept = block.size();
+            continue;
+        }
+        queue(std::string_view(block).substr(0, end + 1));
+        block.erase(0, end + 1);
+        kept = block.size();
     }
+    block.resize(kept);
+    queue(block);
+}
 
-private:
-    /// \brief Queue processing thread function.
-    void processQueue()
-    {
-        while (should_run_) {
+/// \brief Queues the tasks read from fd, a binary manifest (see Manifest,
+///        queued from its mapping) or task lines (see readLines).
+void queueInput(Processor& proc, int fd)
+{
+    Manifest manifest;
+    if (Manifest::isManifest(fd)) {
+        if (manifest.open(fd)) {
+            proc.queueManifest(manifest);
+        }
+        return;
+    }
+    readLines(fd, [&proc](std::string_view lines) { 
+        proc.parseAndQueueLines(lines); 
+    });
+}
+
+/// \brief Returns the CPUs of each NUMA node, from sysfs, or a single node 
+///        with the CPUs this process can use if unknown.
+std::vector<std::vector<int>> numaNodes()
+{
+    std::vector<std::vector<int>> nodes;
+    for (int node = 0; ; ++node) {
+        std::ifstream file("/sys/devices/system/node/node" 
+                           + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!std::getline(file, list)) {
+            break;
+        }
+        // A list of ranges, e.g. "0-3,8-11".
+        std::vector<int> cpus;
+        std::stringstream ranges(list);
+        std::string range;
+        while (std::getline(ranges, range, ',')) {
+            int first = 0;
+            int last = -1;
+            int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (n == 1) {
+                last = first;
+            }
+            for (int cpu = first; n >= 1 && cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            nodes.push_back(std::move(cpus));
+        }
+    }
+    if (nodes.empty()) {
+        cpu_set_t set;
+        nodes.emplace_back();
+        if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    nodes.back().push_back(cpu);
+                }
+            }
+        }
+    }
+    return nodes;
+}
+
+/// \brief Restricts the calling process to the CPUs of a node. Its memory 
+///        is then allocated on the node too, as Linux places pages on the 
+///        node of the CPU that first touches them.
+void bindToNode(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus) {
+        CPU_SET(cpu, &set);
+    }
+    if (!cpus.empty() && ::sched_setaffinity(0, sizeof(set), &set) != 0) {
+        std::cerr << "Warning: Cannot bind to the CPUs of a NUMA node: " 
+                  << std::strerror(errno) << std::endl;
+    }
+}
 
-            queu_updated_signal.try_acquire_for(std::chrono::milliseconds(100)); // Wait for a task to be queued, or timeout after 100ms.
+/// \brief Pushes the tasks read from fd (as queueInput does) in a shard
+///        queue, for the processes of a sharded run. The tasks of manifest,
+///        if not null, are given by index instead: the processes share its
+///        mapping.
+void feedShards(ShardQueue& queue, int fd, const Manifest* manifest)
+{
+    if (manifest) {
+        for (size_t i = 0; i < manifest->size(); ++i) {
+            queue.pushManifestTask(i);
+        }
+        return;
+    }
+    readLines(fd, [&queue](std::string_view lines) {
+        while (!lines.empty()) {
+            size_t end = std::min(lines.find('\n'), lines.size());
+            if (end > 0) {
+                queue.pushLine(lines.substr(0, end));
+            }
+            lines.remove_prefix(std::min(end + 1, lines.size()));
+        }
+    });
+}
 
-            if (!task_queue_.empty()) {
+/// \brief Queues the tasks of a shard queue in a process of a sharded run.
+///
+/// A task is only taken when the processor is down to SHARD_TASKS_PER_THREAD
+/// pending tasks per thread, so that the tasks go to whichever process has 
+/// threads free instead of being split up front.
+void queueShard(Processor& proc, ShardQueue& queue, const Manifest& manifest)
+{
+    const size_t max_pending = SHARD_TASKS_PER_THREAD * proc.workers() - 1;
+    int64_t manifest_task;
+    std::string line;
+    while (true) {
+        proc.waitPending(max_pending);
+        if (!queue.pop(manifest_task, line)) {
+            break;
+        }
+        if (manifest_task < 0) {
+            proc.parseAndQueue(line);
+        } else {
+            proc.queueManifestTasks(manifest, manifest_task, manifest_task + 1);
+        }
+    }
+}
 
-                take_from_queu_signal.acquire(); // binary semaphore to ensure only one thread takes from the queue at a time
-                TaskDef task_def = task_queue_.front();
-                task_queue_.pop();
-                take_from_queu_signal.release(); // release the semaphore
+/// \brief Returns the session of a TaskServer connection: its lines are 
+///        queued in proc, in a TaskGroup of their own. Tasks already done 
+///        (see TaskIndex) count as done, as in successive runs.
+TaskServer::Session taskSession(Processor& proc)
+{
+    auto group = std::make_shared<TaskGroup>();
+    TaskServer::Session session;
+    session.queue = [&proc, group](std::string_view lines) {
+        proc.parseAndQueueLines(lines, group);
+    };
+    session.wait = [group](size_t& done, size_t& failed) {
+        group->wait(done, failed);
+    };
+    return session;
+}
 
-                fs::path subfolder = "output";
-                if ( !fileExistsInSubfolder(task_def.fname_in, subfolder)) { // Check if the file exists in the cache
-                    TaskRunner runner(task_def);
-                    runner();
-                }
+/// \brief Returns the session of a WorkerServer connection: its tasks are 
+///        queued in proc, in a TaskGroup of their own, with the inputs sent 
+///        on it kept parsed by content hash until it ends.
+///
+/// A task whose input was neither sent nor sent before (or cannot be 
+/// parsed) fails: this node never reads its own files, the name being the 
+/// coordinator's.
+WorkerServer::Session workerSession(Processor& proc)
+{
+    auto group = std::make_shared<TaskGroup>();
+    auto images = std::make_shared<std::unordered_map<uint64_t, SVGImagePtr>>();
+    WorkerServer::Session session;
+    session.render = [&proc, group, images](const RemoteRequest& task, 
+                                            std::string_view svg,
+                                            WorkerServer::Reply reply) {
+        TaskDef def;
+        if (!PNGSettings::parse(task.png, def.png) ||
+            !RasterSettings::parse(task.raster, def.raster)) {
+            return false;
+        }
+        def.fname_in = task.name;
+        def.fname_out = def.fname_in;
+        def.size = task.size;
+        def.hash = task.hash;
+        def.group = group;
+        def.deliver = std::move(reply);
 
+        if (!svg.empty()) {
+            NSVGimage* image = nsvgParseView(svg.data(), svg.size(), "px", 0);
+            if (image) {
+                (*images)[task.hash] = SVGImagePtr(image, nsvgDelete);
+            } else {
+                std::cerr << "Exception while processing " << def.fname_in
+                          << ": Cannot parse the SVG sent." << std::endl;
             }
         }
-    }
-};
+        auto it = images->find(task.hash);
+        if (it != images->end()) {
+            def.image = it->second;
+        }
 
+        if (!checkSize(def.size, def.fname_in)) {
+            def.deliver(nullptr);
+            return true;
+        }
+        if (def.image == nullptr) {
+            std::cerr << "Exception while processing " << def.fname_in
+                      << ": No SVG sent for it." << std::endl;
+            def.deliver(nullptr);
+            return true;
+        }
+        std::vector<TaskDef> batch;
+        batch.push_back(std::move(def));
+        proc.queueBatch(batch);
+        return true;
+    };
+    session.wait = [group](size_t& done, size_t& failed) {
+        group->wait(done, failed);
+    };
+    return session;
+}
+
+}
+
+// bench_asset_conv includes this file with ASSET_CONV_NO_MAIN to reuse the
+// processing code.
+#ifndef ASSET_CONV_NO_MAIN
+
+// Set by SIGINT and SIGTERM in server mode.
+static std::atomic<bool> stop_serving(false);
+
+static void stopServing(int)
+{
+    stop_serving = true;
 }
 
 int main(int argc, char** argv)
 {
     using namespace gif643;
 
-    std::ifstream file_in;
+    // Usage: asset_conv [threads] [tasks file|-] [options]
+    //
+    // Options:
+    //   --png=<settings>     Default PNG settings (see PNGSettings::parse).
+    //   --aa=<settings>      Default anti-aliasing settings (see 
+    //                        RasterSettings::parse).
+    //   --disk-cache=<dir>   Keep the results in a DiskCache in dir.
+    //   --downsample         Resize the sizes of multi-size tasks from the 
+    //                        largest one (see Processor::runDownsampled).
+    //   --downsample-check=<max error>
+    //                        Same, for the folders whose first task passes.
+    //   --quiet              No per-task logs (see TaskLog).
+    //   --stats              Print the stage latencies and cache hit rates
+    //                        at the end (see Processor::statsText).
+    //   --stats-interval=<s> Also print them every s seconds.
+    //   --metrics=[<address>:]<port>
+    //                        Serve the metrics over HTTP (see 
+    //                        MetricsServer), on 127.0.0.1 by default.
+    //   --serve=<socket>     Take the tasks from the clients of a Unix 
+    //                        socket (see TaskServer) instead of the input,
+    //                        until stopped by SIGINT or SIGTERM.
+    //   --ring=<file>        Hand the results in a ResultRing in file 
+    //                        instead of writing them.
+    //   --ring-events=<ready fd>,<free fd>
+    //                        The ring's inherited eventfds (required).
+    //   --ring-slots=<count>[:<bytes>]
+    //                        Number and size of the ring's slots.
+    //   --ring-png           Hand PNG files instead of RGBA pixels.
+    //   --processes=<count>|numa
+    //                        Run the tasks in count processes (or one per
+    //                        NUMA node) taking them from a ShardQueue, each
+    //                        with [threads] threads.
+    //   --worker=[<address>:]<port>
+    //                        Render the tasks of coordinators (see 
+    //                        WorkerServer) instead of the input, until 
+    //                        stopped by SIGINT or SIGTERM.
+    //   --coordinator=<host>:<port>[,<host>:<port>...]
+    //                        Render the tasks on these workers (see 
+    //                        RemotePool), [threads] at a time.
+    //   --remote-timeout=<s> Seconds before a task of a slow worker is 
+    //                        dispatched again (REMOTE_TIMEOUT by default).
+    std::vector<std::string> args;
+    PNGSettings png;
+    RasterSettings raster;
+    std::string disk_cache;
+    DownsampleSettings downsample;
+    bool stats_at_end = false;
+    double stats_interval = 0.0;
+    std::string metrics;
+    std::string serve;
+    std::string ring_file;
+    int ring_ready = -1;
+    int ring_free = -1;
+    size_t ring_slots = RING_SLOTS;
+    size_t ring_slot_bytes = RING_SLOT_BYTES;
+    ResultRing::Format ring_format = ResultRing::RGBA;
+    int processes = 0;  // -1 for one per NUMA node.
+    std::string worker;
+    std::string coordinator;
+    double remote_timeout = REMOTE_TIMEOUT;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--png=", 0) == 0) {
+            if (!PNGSettings::parse(arg.substr(6), png)) {
+                return 1;
+            }
+        } else if (arg.rfind("--aa=", 0) == 0) {
+            if (!RasterSettings::parse(arg.substr(5), raster)) {
+                return 1;
+            }
+        } else if (arg.rfind("--disk-cache=", 0) == 0) {
+            disk_cache = arg.substr(13);
+        } else if (arg == "--downsample") {
+            downsample.enabled = true;
+        } else if (arg.rfind("--downsample-check=", 0) == 0) {
+            char* end = nullptr;
+            downsample.max_error = std::strtod(arg.c_str() + 19, &end);
+            if (end == arg.c_str() + 19 || *end || downsample.max_error < 0.0) {
+                std::cerr << "Error: Invalid downsample max error '" 
+                          << arg.substr(19) << "'." << std::endl;
+                return 1;
+            }
+            downsample.enabled = true;
+        } else if (arg == "--quiet") {
+            TaskLog::setQuiet(true);
+        } else if (arg == "--stats") {
+            stats_at_end = true;
+        } else if (arg.rfind("--stats-interval=", 0) == 0) {
+            char* end = nullptr;
+            stats_interval = std::strtod(arg.c_str() + 17, &end);
+            if (end == arg.c_str() + 17 || *end || !(stats_interval > 0.0)) {
+                std::cerr << "Error: Invalid stats interval '" 
+                          << arg.substr(17) << "'." << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--metrics=", 0) == 0) {
+            metrics = arg.substr(10);
+        } else if (arg.rfind("--serve=", 0) == 0) {
+            serve = arg.substr(8);
+        } else if (arg.rfind("--ring=", 0) == 0) {
+            ring_file = arg.substr(7);
+        } else if (arg.rfind("--ring-events=", 0) == 0) {
+            if (std::sscanf(arg.c_str() + 14, "%d,%d", 
+                            &ring_ready, &ring_free) != 2) {
+                std::cerr << "Error: Invalid ring events '" 
+                          << arg.substr(14) << "'." << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--ring-slots=", 0) == 0) {
+            unsigned long long count = 0;
+            unsigned long long bytes = ring_slot_bytes;
+            if (std::sscanf(arg.c_str() + 13, "%llu:%llu", 
+                            &count, &bytes) < 1 || count == 0 || bytes == 0) {
+                std::cerr << "Error: Invalid ring slots '" 
+                          << arg.substr(13) << "'." << std::endl;
+                return 1;
+            }
+            ring_slots = count;
+            ring_slot_bytes = bytes;
+        } else if (arg == "--ring-png") {
+            ring_format = ResultRing::PNG;
+        } else if (arg.rfind("--processes=", 0) == 0) {
+            processes = (arg == "--processes=numa") ? -1 
+                                                    : atoi(arg.c_str() + 12);
+            if (processes == 0 || processes < -1) {
+                std::cerr << "Error: Invalid number of processes '" 
+                          << arg.substr(12) << "'." << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--worker=", 0) == 0) {
+            worker = arg.substr(9);
+        } else if (arg.rfind("--coordinator=", 0) == 0) {
+            coordinator = arg.substr(14);
+        } else if (arg.rfind("--remote-timeout=", 0) == 0) {
+            char* end = nullptr;
+            remote_timeout = std::strtod(arg.c_str() + 17, &end);
+            if (end == arg.c_str() + 17 || *end || !(remote_timeout > 0.0)) {
+                std::cerr << "Error: Invalid remote timeout '" 
+                          << arg.substr(17) << "'." << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "Error: Unknown option '" << arg << "'." << std::endl;
+            return 1;
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    int file_in = STDIN_FILENO;
     int threads = NUM_THREADS;
-    if (argc >= 2){
-        threads = atoi(argv[1]);
+    if (args.size() >= 1){
+        threads = atoi(args[0].c_str());
     }
     
-    if (argc >= 3 && (strcmp(argv[2], "-") != 0)) {
-        file_in.open(argv[2]);
-        if (file_in.is_open()) {
-            std::cin.rdbuf(file_in.rdbuf());
-            std::cerr << "Using " << argv[2] << "..." << std::endl;
+    if (!worker.empty() && 
+        (!serve.empty() || !coordinator.empty() || !ring_file.empty())) {
+        std::cerr << "Error: --worker cannot be used with --serve, "
+                  << "--coordinator or --ring." << std::endl;
+        return 1;
+    }
+    if (!coordinator.empty() && !ring_file.empty()) {
+        std::cerr << "Error: --coordinator cannot be used with --ring." 
+                  << std::endl;
+        return 1;
+    }
+
+    if (!serve.empty() || !worker.empty()) {
+        file_in = -1;
+    } else if (args.size() >= 2 && args[1] != "-") {
+        int fd = ::open(args[1].c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            file_in = fd;
+            std::cerr << "Using " << args[1] << "..." << std::endl;
         } else {
             std::cerr   << "Error: Cannot open '"
-                        << argv[2] 
+                        << args[1] 
                         << "', using stdin (press CTRL-D for EOF)." 
                         << std::endl;
         }
@@ -445,23 +4283,189 @@ int main(int argc, char** argv)
         std::cerr << "Using stdin (press CTRL-D for EOF)." << std::endl;
     }
 
+    std::cerr << "PNG encoder: " << deflateBackendName() 
+              << ", settings " << png.spec() << "." << std::endl;
+    std::cerr << "Anti-aliasing: " << raster.spec() << "." << std::endl;
 
-    Processor proc(threads);
-    
-    while (!std::cin.eof()) {
+    // In a sharded run, this process feeds the tasks to child processes 
+    // that each run a processor on them, and waits for them.
+    ShardQueue      shard_queue;
+    SharedClaims    shared_claims;
+    Manifest        shard_manifest;
+    bool            sharded = false;
+    if (processes != 0) {
+        if (!serve.empty() || !ring_file.empty() || !metrics.empty() || 
+            stats_interval > 0.0 || !worker.empty() || !coordinator.empty()) {
+            std::cerr << "Error: --processes cannot be used with --serve, "
+                      << "--ring, --metrics, --stats-interval, --worker or "
+                      << "--coordinator." << std::endl;
+            return 1;
+        }
+        const std::vector<std::vector<int>> nodes = numaNodes();
+        const int count = processes < 0 ? int(nodes.size()) : processes;
+        const bool use_manifest = Manifest::isManifest(file_in);
+        if ((use_manifest && !shard_manifest.open(file_in)) ||
+            !shard_queue.create() || 
+            !shared_claims.create(SHARED_CLAIMS)) {
+            return 1;
+        }
+
+        std::cout << std::flush;
+        std::vector<pid_t> children;
+        int shard = -1;
+        for (int i = 0; i < count && shard < 0; ++i) {
+            pid_t pid = ::fork();
+            if (pid < 0) {
+                std::cerr << "Error: Cannot fork: " << std::strerror(errno) 
+                          << std::endl;
+                break;
+            }
+            if (pid == 0) {
+                shard = i;
+            } else {
+                children.push_back(pid);
+            }
+        }
+        if (shard < 0) {
+            std::cerr << "Sharding the tasks over " << children.size() 
+                      << " processes (" << nodes.size() << " NUMA nodes)." 
+                      << std::endl;
+            feedShards(shard_queue, file_in, 
+                       use_manifest ? &shard_manifest : nullptr);
+            shard_queue.close();
+            size_t failed = 0;
+            for (pid_t pid: children) {
+                int status = 0;
+                if (::waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || 
+                    WEXITSTATUS(status) != 0) {
+                    ++failed;
+                }
+            }
+            if (failed) {
+                std::cerr << "Error: " << failed << " processes failed." 
+                          << std::endl;
+            }
+            return (failed || int(children.size()) < count) ? 1 : 0;
+        }
+        bindToNode(nodes[shard % nodes.size()]);
+        sharded = true;
+    }
 
-        std::string line, line_org;
+    ResultRing ring;
+    if (!ring_file.empty()) {
+        if (ring_ready < 0 || ring_free < 0) {
+            std::cerr << "Error: --ring needs --ring-events." << std::endl;
+            return 1;
+        }
+        if (!ring.open(ring_file, ring_slots, ring_slot_bytes, 
+                       ring_ready, ring_free, ring_format)) {
+            return 1;
+        }
+        std::cerr << "Results in the ring " << ring_file << "." << std::endl;
+    }
 
-        std::getline(std::cin, line);
-        if (!line.empty()) {
-            proc.parseAndQueue(line);
+    RemotePool remote(remote_timeout);
+    if (!coordinator.empty() && !remote.connect(coordinator)) {
+        return 1;
+    }
+
+    Processor proc(threads, png, raster, disk_cache, downsample, 
+                   ring_file.empty() ? nullptr : &ring,
+                   sharded ? &shared_claims : nullptr,
+                   coordinator.empty() ? nullptr : &remote);
+
+    // Declared after proc, which they use, to be stopped before it.
+    MetricsServer metrics_server([&proc] { return proc.metricsText(); });
+    if (!metrics.empty()) {
+        if (!metrics_server.start(metrics)) {
+            return 1;
+        }
+        std::cerr << "Serving metrics on " << metrics << "." << std::endl;
+    }
+
+    std::mutex              stats_mutex;
+    std::condition_variable stats_signal;
+    bool                    stats_stop = false;
+    std::thread             stats_thread;
+    if (stats_interval > 0.0) {
+        stats_thread = std::thread([&] {
+            const auto period = std::chrono::duration<double>(stats_interval);
+            std::unique_lock<std::mutex> lock(stats_mutex);
+            while (!stats_signal.wait_for(lock, period, 
+                                          [&] { return stats_stop; })) {
+                std::cerr << proc.statsText() << std::flush;
+            }
+        });
+    }
+    
+    if (sharded) {
+        queueShard(proc, shard_queue, shard_manifest);
+    } else if (!worker.empty()) {
+        WorkerServer server([&proc] { return workerSession(proc); });
+        if (!server.start(worker)) {
+            return 1;
+        }
+        std::signal(SIGINT, stopServing);
+        std::signal(SIGTERM, stopServing);
+        server.run(stop_serving);
+    } else if (serve.empty()) {
+        queueInput(proc, file_in);
+        if (file_in != STDIN_FILENO) {
+            ::close(file_in);
+        }
+    } else {
+        TaskServer server([&proc] { return taskSession(proc); });
+        if (!server.start(serve)) {
+            return 1;
         }
+        std::signal(SIGINT, stopServing);
+        std::signal(SIGTERM, stopServing);
+        std::cerr << "Serving tasks on " << serve 
+                  << " (SIGINT or SIGTERM to stop)." << std::endl;
+        server.run(stop_serving);
     }
 
-    if (file_in.is_open()) {
-        file_in.close();
+    // Wait until every queued task is written out.
+    proc.waitIdle();
+    if (!ring_file.empty()) {
+        ring.close();
     }
 
-    // Wait until the processor queue's has tasks to do.
-    while (!proc.queueEmpty()) {};
+    if (stats_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            stats_stop = true;
+        }
+        stats_signal.notify_all();
+        stats_thread.join();
+    }
+    if (stats_at_end) {
+        std::cerr << proc.statsText();
+    }
+
+    PNGCache::Stats stats = proc.cacheStats();
+    std::cerr << "PNG cache: "
+              << stats.hits << " hits, "
+              << stats.misses << " misses, "
+              << stats.evictions << " evictions, "
+              << stats.bytes << " bytes."
+              << std::endl;
+
+    SVGCache::Stats svg_stats = proc.svgCacheStats();
+    std::cerr << "SVG cache: "
+              << svg_stats.hits << " hits, "
+              << svg_stats.misses << " misses, "
+              << svg_stats.evictions << " evictions, "
+              << svg_stats.bytes << " bytes."
+              << std::endl;
+
+    DiskCache::Stats disk_stats;
+    if (proc.diskCacheStats(disk_stats)) {
+        std::cerr << "Disk cache: "
+                  << disk_stats.hits << " hits, "
+                  << disk_stats.misses << " misses, "
+                  << disk_stats.stores << " stores."
+                  << std::endl;
+    }
 }
+#endif
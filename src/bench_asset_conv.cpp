@@ -0,0 +1,416 @@
+// Benchmarks of asset_conv: each processing stage on its own over a folder
+// of SVG files at several sizes, then the whole pipeline at several thread
+// counts. Results are written as JSON.
+//
+// Usage: bench_asset_conv [data folder] [options]
+//
+// Options:
+//   --sizes=<list>       Output sizes, comma separated (default: 48,480,1000).
+//   --threads=<list>     Thread counts of the pipeline runs (default: 1, 2,
+//                        4, ... up to the hardware concurrency).
+//   --iterations=<n>     Runs of each benchmark (default: 3).
+//   --json=<file>        Where to write the results (default: stdout).
+//
+// The data folder defaults to ../data, as the scripts expect to run from
+// build/. Use a Release build for meaningful numbers: the build type is
+// part of the results.
+
+#define ASSET_CONV_NO_MAIN
+#include "asset_conv.cpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+
+#ifndef ASSET_CONV_BUILD_TYPE
+#define ASSET_CONV_BUILD_TYPE "unknown"
+#endif
+
+namespace gif643 {
+namespace bench {
+
+/// \brief Measures of one benchmark.
+///
+/// times:  Latency of each measured call (a single image for the stages, a
+///         whole batch for the pipeline runs), in seconds.
+/// images: Images processed by all the calls.
+/// bytes:  Bytes processed by all the calls: SVG input for parse and
+///         flatten, RGBA pixels for rasterize, PNG output otherwise.
+/// wall:   Total time of the calls, for the throughputs.
+///
+/// rasterize and encode are the RGBA path (PNGSettings::rgba); coverage is
+/// both for the inputs painted with a single color (see coveragePNG).
+struct Series
+{
+    std::string         name;
+    int                 size    = 0;    // 0 if it does not depend on it.
+    int                 threads = 1;
+    std::vector<double> times{};
+    uint64_t            images  = 0;
+    uint64_t            bytes   = 0;
+    double              wall    = 0.0;
+
+    void add(double seconds, uint64_t n_images, uint64_t n_bytes)
+    {
+        times.push_back(seconds);
+        images += n_images;
+        bytes  += n_bytes;
+        wall   += seconds;
+    }
+};
+
+/// \brief Returns the p-th percentile (0 to 1) of times, by nearest rank.
+double percentile(std::vector<double> times, double p)
+{
+    if (times.empty()) {
+        return 0.0;
+    }
+    std::sort(times.begin(), times.end());
+    size_t rank = size_t(std::ceil(p * times.size()));
+    return times[std::clamp<size_t>(rank, 1, times.size()) - 1];
+}
+
+/// \brief Returns the time taken by f(), in seconds.
+template <typename F>
+double timed(F&& f)
+{
+    Clock::time_point start = Clock::now();
+    f();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/// \brief Discards everything written to std::cout and std::cerr while it
+///        exists, and turns the task logs off (see TaskLog), so that the 
+///        pipeline logs do not weigh on its times.
+class Silence
+{
+private:
+    struct NullBuffer: std::streambuf
+    {
+        int overflow(int c) override { return c; }
+    };
+
+    NullBuffer      null_;
+    std::streambuf* out_;
+    std::streambuf* err_;
+
+public:
+    Silence():
+        out_(std::cout.rdbuf(&null_)),
+        err_(std::cerr.rdbuf(&null_))
+    {
+        TaskLog::setQuiet(true);
+    }
+
+    ~Silence()
+    {
+        TaskLog::setQuiet(false);
+        std::cout.rdbuf(out_);
+        std::cerr.rdbuf(err_);
+    }
+};
+
+/// \brief Parses a comma separated list of positive integers. Returns false
+///        if invalid.
+bool parseList(const std::string& spec, std::vector<int>& values)
+{
+    values.clear();
+    std::stringstream stream(spec);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        char* end = nullptr;
+        long value = std::strtol(item.c_str(), &end, 10);
+        if (end == item.c_str() || *end != '\0' || value <= 0) {
+            return false;
+        }
+        values.push_back(int(value));
+    }
+    return !values.empty();
+}
+
+std::string jsonString(const std::string& str)
+{
+    std::string out = "\"";
+    for (char c: str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char hex[8];
+            std::snprintf(hex, sizeof(hex), "\\u%04x", c);
+            out += hex;
+        } else {
+            out += c;
+        }
+    }
+    return out + '"';
+}
+
+/// \brief Writes a series as a JSON object.
+void writeSeries(std::ostream& out, const Series& series)
+{
+    const double wall = series.wall > 0.0 ? series.wall : 1e-12;
+    out << "{\"name\": " << jsonString(series.name)
+        << ", \"size\": " << series.size
+        << ", \"threads\": " << series.threads
+        << ", \"count\": " << series.times.size()
+        << ", \"images\": " << series.images
+        << ", \"images_per_s\": " << series.images / wall
+        << ", \"p50_ms\": " << percentile(series.times, 0.50) * 1e3
+        << ", \"p99_ms\": " << percentile(series.times, 0.99) * 1e3
+        << ", \"bytes_per_s\": " << series.bytes / wall
+        << "}";
+}
+
+/// \brief An input of the benchmarks.
+struct Input
+{
+    std::string fname;      // Absolute.
+    uint64_t    bytes;
+    SVGImagePtr image;
+};
+
+/// \brief Times each stage of the processing of every input at size,
+///        iterations times, adding them to series (one per stage).
+void benchStages(const std::vector<Input>& inputs,
+                 int size,
+                 int iterations,
+                 const fs::path& out_dir,
+                 std::vector<Series>& series)
+{
+    Series flatten   {.name = "flatten",   .size = size};
+    Series raster    {.name = "rasterize", .size = size};
+    Series encode    {.name = "encode",    .size = size};
+    Series write     {.name = "write",     .size = size};
+    Series coverage  {.name = "coverage",  .size = size};
+
+    const size_t stride = size_t(size) * BPP;
+    const float  scale  = float(size) / ORG_WIDTH;
+    std::vector<unsigned char> pixels(stride * size);
+    const std::string fname_out = (out_dir / "stage.png").string();
+    NSVGrasterizer* rast = RasterContext::local().rasterizer();
+
+    for (int i = 0; i < iterations; ++i) {
+        for (const Input& input: inputs) {
+            flatten.add(timed([&] {
+                nsvgFlatten(rast, input.image.get(), scale);
+            }), 1, input.bytes);
+
+            raster.add(timed([&] {
+                rasterize(input.image.get(), scale, pixels.data(),
+                          size, size, stride, RasterSettings());
+            }), 1, pixels.size());
+
+            PNGWriter writer;
+            double seconds = timed([&] {
+                writer(size, size, BPP, pixels.data(), stride);
+            });
+            PNGDataPtr data = writer.getData();
+            encode.add(seconds, 1, data->size());
+
+            write.add(timed([&] {
+                writeFile(fname_out, data->data(), data->size());
+            }), 1, data->size());
+
+            SingleColor color;
+            if (SingleColor::of(input.image.get(), color)) {
+                seconds = timed([&] {
+                    data = coveragePNG(input.image.get(), scale, size, size,
+                                       color, PNGSettings(), 
+                                       RasterSettings());
+                });
+                coverage.add(seconds, 1, data->size());
+            }
+        }
+    }
+    series.push_back(std::move(flatten));
+    series.push_back(std::move(raster));
+    series.push_back(std::move(encode));
+    series.push_back(std::move(write));
+    if (!coverage.times.empty()) {
+        series.push_back(std::move(coverage));
+    }
+}
+
+/// \brief Times the whole pipeline, a Processor with n_threads queued with
+///        every input at size, iterations times. Each run starts from empty
+///        caches and output folder.
+Series benchPipeline(const std::vector<Input>& inputs,
+                     int size,
+                     int n_threads,
+                     int iterations,
+                     const fs::path& out_dir)
+{
+    Series series{.name = "pipeline", .size = size, .threads = n_threads};
+
+    std::string lines;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        lines += inputs[i].fname + ';'
+               + (out_dir / (std::to_string(i) + ".png")).string() + ';'
+               + std::to_string(size) + '\n';
+    }
+
+    for (int i = 0; i < iterations; ++i) {
+        std::error_code err;
+        fs::remove_all(out_dir, err);
+        fs::create_directories(out_dir);
+        double seconds;
+        {
+            Silence silence;
+            Processor proc(n_threads);
+            seconds = timed([&] {
+                proc.parseAndQueueLines(lines);
+                proc.waitIdle();
+            });
+        }
+        uint64_t bytes = 0;
+        for (const auto& entry: fs::directory_iterator(out_dir)) {
+            if (entry.path().extension() == ".png") {
+                bytes += entry.file_size(err);
+            }
+        }
+        series.add(seconds, inputs.size(), bytes);
+    }
+    return series;
+}
+
+}
+}
+
+int main(int argc, char** argv)
+{
+    using namespace gif643;
+    using namespace gif643::bench;
+
+    std::string data_dir = "../data";
+    std::string json_file;
+    std::vector<int> sizes = {48, 480, 1000};
+    std::vector<int> threads;
+    int iterations = 3;
+
+    const int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int n = 1; n < max_threads; n *= 2) {
+        threads.push_back(n);
+    }
+    threads.push_back(max_threads);
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--sizes=", 0) == 0) {
+            if (!parseList(arg.substr(8), sizes)) {
+                std::cerr << "Error: Invalid sizes '" << arg.substr(8) << "'."
+                          << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            if (!parseList(arg.substr(10), threads)) {
+                std::cerr << "Error: Invalid threads '" << arg.substr(10)
+                          << "'." << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--iterations=", 0) == 0) {
+            iterations = std::atoi(arg.c_str() + 13);
+            if (iterations <= 0) {
+                std::cerr << "Error: Invalid iterations '" << arg.substr(13)
+                          << "'." << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--json=", 0) == 0) {
+            json_file = arg.substr(7);
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "Error: Unknown option '" << arg << "'." << std::endl;
+            return 1;
+        } else {
+            data_dir = arg;
+        }
+    }
+
+    // Inputs, sorted for reproducible runs.
+    std::vector<Input> inputs;
+    std::error_code err;
+    for (const auto& entry: fs::directory_iterator(data_dir, err)) {
+        if (entry.path().extension() == ".svg") {
+            inputs.push_back({fs::absolute(entry.path()).string(),
+                              entry.file_size(err), nullptr});
+        }
+    }
+    if (inputs.empty()) {
+        std::cerr << "Error: No SVG file in '" << data_dir << "'." << std::endl;
+        return 1;
+    }
+    std::sort(inputs.begin(), inputs.end(),
+              [](const Input& a, const Input& b) { return a.fname < b.fname; });
+
+    // Everything is written in a temporary folder, removed at the end. The
+    // pipeline runs in it, so that their task index does not persist.
+    std::string tmp_template = (fs::temp_directory_path()
+                                / "bench_asset_conv.XXXXXX").string();
+    if (::mkdtemp(&tmp_template[0]) == nullptr) {
+        std::cerr << "Error: Cannot create a temporary folder." << std::endl;
+        return 1;
+    }
+    const fs::path tmp_dir = tmp_template;
+    const fs::path start_dir = fs::current_path();
+    fs::current_path(tmp_dir);
+
+    std::vector<Series> series;
+
+    std::cerr << "Benchmarking " << inputs.size() << " files..." << std::endl;
+    Series parse{.name = "parse", .size = 0};
+    for (int i = 0; i < iterations; ++i) {
+        for (Input& input: inputs) {
+            parse.add(timed([&] {
+                input.image = SVGCache::parse(input.fname);
+            }), 1, input.bytes);
+            if (!input.image) {
+                std::cerr << "Error: Cannot parse '" << input.fname << "'."
+                          << std::endl;
+                fs::current_path(start_dir);
+                fs::remove_all(tmp_dir, err);
+                return 1;
+            }
+        }
+    }
+    series.push_back(std::move(parse));
+
+    for (int size: sizes) {
+        std::cerr << "Stages at " << size << "..." << std::endl;
+        benchStages(inputs, size, iterations, tmp_dir, series);
+    }
+    for (int size: sizes) {
+        for (int n_threads: threads) {
+            std::cerr << "Pipeline at " << size << ", " << n_threads
+                      << " threads..." << std::endl;
+            series.push_back(benchPipeline(inputs, size, n_threads,
+                                           iterations, tmp_dir / "output"));
+        }
+    }
+
+    fs::current_path(start_dir);
+    fs::remove_all(tmp_dir, err);
+
+    std::ofstream json_stream;
+    if (!json_file.empty()) {
+        json_stream.open(json_file);
+        if (!json_stream) {
+            std::cerr << "Error: Cannot write '" << json_file << "'."
+                      << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = json_file.empty() ? std::cout : json_stream;
+    out << std::setprecision(6)
+        << "{\n  \"build_type\": " << jsonString(ASSET_CONV_BUILD_TYPE)
+        << ",\n  \"deflate\": " << jsonString(deflateBackendName())
+        << ",\n  \"files\": " << inputs.size()
+        << ",\n  \"iterations\": " << iterations
+        << ",\n  \"hardware_threads\": " << max_threads
+        << ",\n  \"results\": [";
+    for (size_t i = 0; i < series.size(); ++i) {
+        out << (i ? ",\n    " : "\n    ");
+        writeSeries(out, series[i]);
+    }
+    out << "\n  ]\n}\n";
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef DEFLATE_BACKEND_H
+#define DEFLATE_BACKEND_H
+
+// Deflate implementation used by stb_image_write for PNG compression,
+// selected at build time (see ASSET_CONV_DEFLATE in CMakeLists.txt) and
+// plugged in through STBIW_ZLIB_COMPRESS in stb_image.c.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Name of the backend: "stb", "zlib" or "libdeflate".
+const char* deflateBackendName(void);
+
+// Lowest compression level of the backend: 0, or 5 for stb, which treats
+// lower levels as 5.
+int deflateBackendMinLevel(void);
+
+// Highest compression level of the backend.
+int deflateBackendMaxLevel(void);
+
+// Compression of data given in several parts, for instance the PNG filtered
+// rows of a few scanlines at a time (see stbi_write_png_filter_rows). zlib
+// compresses each part as it comes, with the same result as a single
+// STBIW_ZLIB_COMPRESS call over the whole data. stb also compresses each
+// part as it comes, as its own deflate block, which compresses a little
+// less than a single call. libdeflate cannot, and keeps the parts until
+// deflateStreamEnd.
+typedef struct DeflateStream DeflateStream;
+
+// Returns a new stream, or NULL on error. size_hint is the expected total
+// size of the data (0 if unknown).
+DeflateStream* deflateStreamBegin(int level, size_t size_hint);
+
+// Adds len bytes of data to the stream. Returns 0 on error.
+int deflateStreamWrite(DeflateStream* stream, const unsigned char* data, 
+                       size_t len);
+
+// Returns the compressed data (zlib format), *out_len bytes long and to be
+// released with free, or NULL on error. The stream is deleted either way.
+unsigned char* deflateStreamEnd(DeflateStream* stream, int* out_len);
+
+// Deletes the stream without finishing it.
+void deflateStreamAbort(DeflateStream* stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEFLATE_BACKEND_H
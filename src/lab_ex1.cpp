@@ -15,7 +15,7 @@ void accum(int d, int f)
     }
 }
 
-int main(int argc, char** argv)
+int main()
 {
     // Ce programme tente d'obtenir la somme des entiers de 1 à 10000 en
     // divisant le travail en quatre fils indépendants.
@@ -0,0 +1,80 @@
+#include "metrics_server.h"
+#include "net_util.h"
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+namespace gif643 {
+
+MetricsServer::MetricsServer(TextCallback text):
+    fd_(-1),
+    text_(std::move(text)),
+    stop_(false)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+    stop_ = true;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+bool MetricsServer::start(const std::string& spec)
+{
+    fd_ = listenTCP(spec);
+    if (fd_ < 0) {
+        return false;
+    }
+    thread_ = std::thread(&MetricsServer::serve, this);
+    return true;
+}
+
+void MetricsServer::serve()
+{
+    while (!stop_) {
+        pollfd pfd = {fd_, POLLIN, 0};
+        if (::poll(&pfd, 1, SERVER_POLL_MS) <= 0) {
+            continue;
+        }
+        int client = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+        respond(client);
+        ::close(client);
+    }
+}
+
+void MetricsServer::respond(int client)
+{
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && 
+           request.size() < 16 * sizeof(buffer)) {
+        pollfd pfd = {client, POLLIN, 0};
+        if (::poll(&pfd, 1, SERVER_POLL_MS) <= 0) {
+            return;
+        }
+        ssize_t n = ::recv(client, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            return;
+        }
+        request.append(buffer, n);
+    }
+
+    const std::string body = text_();
+    std::string response = 
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+    sendAll(client, response);
+}
+
+}
@@ -0,0 +1,49 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace gif643 {
+
+/// \brief Serves the text of a callback over HTTP on its own thread, for a 
+///        Prometheus scraper (see Processor::metricsText).
+///
+/// Minimal on purpose: one request per connection, answered in order, and 
+/// any path gives the metrics. Stops within SERVER_POLL_MS when destroyed.
+class MetricsServer
+{
+public:
+    using TextCallback = std::function<std::string()>;
+
+private:
+    int                 fd_;
+    TextCallback        text_;
+    std::atomic<bool>   stop_;
+    std::thread         thread_;
+
+public:
+    explicit MetricsServer(TextCallback text);
+
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    /// \brief Listens on spec (see listenTCP) and starts serving. Returns 
+    ///        false, with an error on stderr, on failure.
+    bool start(const std::string& spec);
+
+private:
+    void serve();
+
+    /// \brief Reads the request headers (or gives up after 
+    ///        SERVER_POLL_MS), then sends the text.
+    void respond(int client);
+};
+
+}
+
+#endif // METRICS_SERVER_H
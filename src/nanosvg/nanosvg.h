@@ -29,6 +29,8 @@
 #ifndef NANOSVG_H
 #define NANOSVG_H
 
+#include <stddef.h>
+
 #ifndef NANOSVG_CPLUSPLUS
 #ifdef __cplusplus
 extern "C" {
@@ -160,6 +162,8 @@ typedef struct NSVGimage
 	float width;				// Width of the image.
 	float height;				// Height of the image.
 	NSVGshape* shapes;			// Linked list of shapes in the image.
+	struct NSVGarena* arena;	// Blocks holding the whole image (the image itself, its shapes,
+								// paths, points and gradients), or NULL if allocated piecewise.
 } NSVGimage;
 
 // Parses SVG file from a file, returns SVG image as paths.
@@ -169,12 +173,20 @@ NSVGimage* nsvgParseFromFile(const char* filename, const char* units, float dpi)
 // Important note: changes the string.
 NSVGimage* nsvgParse(char* input, const char* units, float dpi);
 
+// Parses SVG file from the len first bytes of input (or up to a null
+// character), returns SVG image as paths. Does not change input, which can
+// be read-only (e.g. a memory mapped file) and needs no null terminator.
+NSVGimage* nsvgParseView(const char* input, size_t len, const char* units, float dpi);
+
 // Duplicates a path.
 NSVGpath* nsvgDuplicatePath(NSVGpath* p);
 
 // Deletes an image.
 void nsvgDelete(NSVGimage* image);
 
+// Returns the bytes of memory held by an image parsed by nanosvg.
+size_t nsvgImageBytes(const NSVGimage* image);
+
 #ifndef NANOSVG_CPLUSPLUS
 #ifdef __cplusplus
 }
@@ -358,6 +370,65 @@ int nsvg__parseXML(char* input,
 	return 1;
 }
 
+// Copies s to e into the buffer *tmp of *ctmp chars, grown if needed, and
+// null terminates it. Returns NULL if out of memory.
+static char* nsvg__viewCopy(const char* s, const char* e, char** tmp, size_t* ctmp)
+{
+	size_t n = (size_t)(e - s);
+	if (n + 1 > *ctmp) {
+		size_t c = *ctmp > 0 ? *ctmp : 256;
+		char* t;
+		while (c < n + 1) c *= 2;
+		t = (char*)realloc(*tmp, c);
+		if (t == NULL) return NULL;
+		*tmp = t;
+		*ctmp = c;
+	}
+	memcpy(*tmp, s, n);
+	(*tmp)[n] = '\0';
+	return *tmp;
+}
+
+// Same as nsvg__parseXML, but leaves input untouched: each tag (and content,
+// if there is a callback for it) is copied in a small buffer, reused by the
+// next one, to be null terminated there.
+int nsvg__parseXMLView(const char* input, size_t len,
+					   void (*startelCb)(void* ud, const char* el, const char** attr),
+					   void (*endelCb)(void* ud, const char* el),
+					   void (*contentCb)(void* ud, const char* s),
+					   void* ud)
+{
+	const char* s = input;
+	const char* end = input + len;
+	const char* mark = s;
+	char* tmp = NULL;
+	size_t ctmp = 0;
+	char* copy;
+	int state = NSVG_XML_CONTENT;
+	while (s < end && *s) {
+		if (*s == '<' && state == NSVG_XML_CONTENT) {
+			// Start of a tag
+			if (contentCb) {
+				if ((copy = nsvg__viewCopy(mark, s, &tmp, &ctmp)) == NULL) break;
+				nsvg__parseContent(copy, contentCb, ud);
+			}
+			mark = ++s;
+			state = NSVG_XML_TAG;
+		} else if (*s == '>' && state == NSVG_XML_TAG) {
+			// Start of a content or new tag.
+			if ((copy = nsvg__viewCopy(mark, s, &tmp, &ctmp)) == NULL) break;
+			nsvg__parseElement(copy, startelCb, endelCb, ud);
+			mark = ++s;
+			state = NSVG_XML_CONTENT;
+		} else {
+			s++;
+		}
+	}
+	free(tmp);
+
+	return 1;
+}
+
 
 /* Simple SVG parser. */
 
@@ -553,6 +624,109 @@ static void nsvg__xformVec(float* dx, float* dy, float x, float y, float* t)
 
 #define NSVG_EPSILON (1e-12)
 
+// Objects of an image are bump allocated in blocks of an arena, instead of
+// one malloc each: an image is a few contiguous blocks, walked in order by
+// the rasterizer and freed at once, with no per-object malloc contention
+// between parsing threads. Blocks double in size from NSVG_ARENA_BLOCK.
+#define NSVG_ARENA_BLOCK 4096
+#define NSVG_ARENA_MAX_BLOCK (1 << 20)
+#define NSVG_ARENA_ALIGN 16
+
+typedef struct NSVGarenaBlock
+{
+	struct NSVGarenaBlock* next;
+	size_t size;
+	size_t used;
+} NSVGarenaBlock;
+
+typedef struct NSVGarena
+{
+	NSVGarenaBlock* blocks;		// Current block first.
+	size_t bytes;				// Total size of the blocks.
+} NSVGarena;
+
+#define NSVG__ARENA_HEADER ((sizeof(NSVGarenaBlock) + NSVG_ARENA_ALIGN-1) & ~(size_t)(NSVG_ARENA_ALIGN-1))
+
+static NSVGarenaBlock* nsvg__arenaBlock(size_t size)
+{
+	NSVGarenaBlock* block = (NSVGarenaBlock*)malloc(NSVG__ARENA_HEADER + size);
+	if (block == NULL) return NULL;
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+// Returns size uninitialized bytes from the arena, or NULL if out of memory.
+static void* nsvg__arenaAlloc(NSVGarena* arena, size_t size)
+{
+	NSVGarenaBlock* block = arena->blocks;
+	size = (size + NSVG_ARENA_ALIGN-1) & ~(size_t)(NSVG_ARENA_ALIGN-1);
+	if (block->used + size > block->size) {
+		size_t bsize = block->size * 2;
+		if (bsize > NSVG_ARENA_MAX_BLOCK) bsize = NSVG_ARENA_MAX_BLOCK;
+		if (bsize < size) bsize = size;
+		block = nsvg__arenaBlock(bsize);
+		if (block == NULL) return NULL;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->bytes += bsize;
+	}
+	block->used += size;
+	return (char*)block + NSVG__ARENA_HEADER + block->used - size;
+}
+
+// Same as nsvg__arenaAlloc, zeroed.
+static void* nsvg__arenaCalloc(NSVGarena* arena, size_t size)
+{
+	void* ptr = nsvg__arenaAlloc(arena, size);
+	if (ptr != NULL) memset(ptr, 0, size);
+	return ptr;
+}
+
+// Grows ptr, of size bytes, to new_size bytes: in place if it is the last
+// allocation of its block and there is room left, or else moved to a new
+// allocation (the old one is only reclaimed with the arena).
+static void* nsvg__arenaRealloc(NSVGarena* arena, void* ptr, size_t size, size_t new_size)
+{
+	NSVGarenaBlock* block = arena->blocks;
+	char* data = (char*)block + NSVG__ARENA_HEADER;
+	size_t aligned = (size + NSVG_ARENA_ALIGN-1) & ~(size_t)(NSVG_ARENA_ALIGN-1);
+	size_t new_aligned = (new_size + NSVG_ARENA_ALIGN-1) & ~(size_t)(NSVG_ARENA_ALIGN-1);
+	void* res;
+	if (ptr != NULL && (char*)ptr + aligned == data + block->used &&
+		block->used - aligned + new_aligned <= block->size) {
+		block->used = block->used - aligned + new_aligned;
+		return ptr;
+	}
+	res = nsvg__arenaAlloc(arena, new_size);
+	if (res != NULL && ptr != NULL) memcpy(res, ptr, size);
+	return res;
+}
+
+// Creates an arena, itself allocated in its first block.
+static NSVGarena* nsvg__createArena()
+{
+	NSVGarena* arena;
+	NSVGarenaBlock* block = nsvg__arenaBlock(NSVG_ARENA_BLOCK);
+	if (block == NULL) return NULL;
+	arena = (NSVGarena*)((char*)block + NSVG__ARENA_HEADER);
+	block->used = (sizeof(NSVGarena) + NSVG_ARENA_ALIGN-1) & ~(size_t)(NSVG_ARENA_ALIGN-1);
+	arena->blocks = block;
+	arena->bytes = NSVG_ARENA_BLOCK;
+	return arena;
+}
+
+static void nsvg__deleteArena(NSVGarena* arena)
+{
+	NSVGarenaBlock* block = arena->blocks;
+	while (block != NULL) {
+		NSVGarenaBlock* next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
 static int nsvg__ptInBounds(float* pt, float* bounds)
 {
 	return pt[0] >= bounds[0] && pt[0] <= bounds[2] && pt[1] >= bounds[1] && pt[1] <= bounds[3];
@@ -619,13 +793,16 @@ static void nsvg__curveBounds(float* bounds, float* curve)
 static NSVGparser* nsvg__createParser()
 {
 	NSVGparser* p;
+	NSVGarena* arena = NULL;
 	p = (NSVGparser*)malloc(sizeof(NSVGparser));
 	if (p == NULL) goto error;
 	memset(p, 0, sizeof(NSVGparser));
 
-	p->image = (NSVGimage*)malloc(sizeof(NSVGimage));
+	arena = nsvg__createArena();
+	if (arena == NULL) goto error;
+	p->image = (NSVGimage*)nsvg__arenaCalloc(arena, sizeof(NSVGimage));
 	if (p->image == NULL) goto error;
-	memset(p->image, 0, sizeof(NSVGimage));
+	p->image->arena = arena;
 
 	// Init style
 	nsvg__xformIdentity(p->attr[0].xform);
@@ -647,10 +824,8 @@ static NSVGparser* nsvg__createParser()
 	return p;
 
 error:
-	if (p) {
-		if (p->image) free(p->image);
-		free(p);
-	}
+	if (arena) nsvg__deleteArena(arena);
+	if (p) free(p);
 	return NULL;
 }
 
@@ -671,22 +846,11 @@ static void nsvg__deletePaint(NSVGpaint* paint)
 		free(paint->gradient);
 }
 
-static void nsvg__deleteGradientData(NSVGgradientData* grad)
-{
-	NSVGgradientData* next;
-	while (grad != NULL) {
-		next = grad->next;
-		free(grad->stops);
-		free(grad);
-		grad = next;
-	}
-}
-
+// The paths not added to a shape yet (plist) and the gradient data are in
+// the image's arena too.
 static void nsvg__deleteParser(NSVGparser* p)
 {
 	if (p != NULL) {
-		nsvg__deletePaths(p->plist);
-		nsvg__deleteGradientData(p->gradients);
 		nsvgDelete(p->image);
 		free(p->pts);
 		free(p);
@@ -841,7 +1005,7 @@ static NSVGgradient* nsvg__createGradient(NSVGparser* p, const char* id, const f
 	}
 	if (stops == NULL) return NULL;
 
-	grad = (NSVGgradient*)malloc(sizeof(NSVGgradient) + sizeof(NSVGgradientStop)*(nstops-1));
+	grad = (NSVGgradient*)nsvg__arenaAlloc(p->image->arena, sizeof(NSVGgradient) + sizeof(NSVGgradientStop)*(nstops-1));
 	if (grad == NULL) return NULL;
 
 	// The shape width and height.
@@ -945,9 +1109,8 @@ static void nsvg__addShape(NSVGparser* p)
 	if (p->plist == NULL)
 		return;
 
-	shape = (NSVGshape*)malloc(sizeof(NSVGshape));
-	if (shape == NULL) goto error;
-	memset(shape, 0, sizeof(NSVGshape));
+	shape = (NSVGshape*)nsvg__arenaCalloc(p->image->arena, sizeof(NSVGshape));
+	if (shape == NULL) return;
 
 	memcpy(shape->id, attr->id, sizeof shape->id);
 	scale = nsvg__getAverageScale(attr->xform);
@@ -1019,11 +1182,6 @@ static void nsvg__addShape(NSVGparser* p)
 	else
 		p->shapesTail->next = shape;
 	p->shapesTail = shape;
-
-	return;
-
-error:
-	if (shape) free(shape);
 }
 
 static void nsvg__addPath(NSVGparser* p, char closed)
@@ -1040,12 +1198,11 @@ static void nsvg__addPath(NSVGparser* p, char closed)
 	if (closed)
 		nsvg__lineTo(p, p->pts[0], p->pts[1]);
 
-	path = (NSVGpath*)malloc(sizeof(NSVGpath));
-	if (path == NULL) goto error;
-	memset(path, 0, sizeof(NSVGpath));
+	path = (NSVGpath*)nsvg__arenaCalloc(p->image->arena, sizeof(NSVGpath));
+	if (path == NULL) return;
 
-	path->pts = (float*)malloc(p->npts*2*sizeof(float));
-	if (path->pts == NULL) goto error;
+	path->pts = (float*)nsvg__arenaAlloc(p->image->arena, p->npts*2*sizeof(float));
+	if (path->pts == NULL) return;
 	path->closed = closed;
 	path->npts = p->npts;
 
@@ -1072,14 +1229,6 @@ static void nsvg__addPath(NSVGparser* p, char closed)
 
 	path->next = p->plist;
 	p->plist = path;
-
-	return;
-
-error:
-	if (path != NULL) {
-		if (path->pts != NULL) free(path->pts);
-		free(path);
-	}
 }
 
 // We roll our own string to float because the std library one uses locale and messes things up.
@@ -2551,9 +2700,8 @@ static void nsvg__parseSVG(NSVGparser* p, const char** attr)
 static void nsvg__parseGradient(NSVGparser* p, const char** attr, char type)
 {
 	int i;
-	NSVGgradientData* grad = (NSVGgradientData*)malloc(sizeof(NSVGgradientData));
+	NSVGgradientData* grad = (NSVGgradientData*)nsvg__arenaCalloc(p->image->arena, sizeof(NSVGgradientData));
 	if (grad == NULL) return;
-	memset(grad, 0, sizeof(NSVGgradientData));
 	grad->units = NSVG_OBJECT_SPACE;
 	grad->type = type;
 	if (grad->type == NSVG_PAINT_LINEAR_GRADIENT) {
@@ -2637,9 +2785,12 @@ static void nsvg__parseGradientStop(NSVGparser* p, const char** attr)
 	grad = p->gradients;
 	if (grad == NULL) return;
 
+	stop = (NSVGgradientStop*)nsvg__arenaRealloc(p->image->arena, grad->stops,
+												  sizeof(NSVGgradientStop)*grad->nstops,
+												  sizeof(NSVGgradientStop)*(grad->nstops+1));
+	if (stop == NULL) return;
+	grad->stops = stop;
 	grad->nstops++;
-	grad->stops = (NSVGgradientStop*)realloc(grad->stops, sizeof(NSVGgradientStop)*grad->nstops);
-	if (grad->stops == NULL) return;
 
 	// Insert
 	idx = grad->nstops-1;
@@ -2897,6 +3048,30 @@ NSVGimage* nsvgParse(char* input, const char* units, float dpi)
 	return ret;
 }
 
+NSVGimage* nsvgParseView(const char* input, size_t len, const char* units, float dpi)
+{
+	NSVGparser* p;
+	NSVGimage* ret = 0;
+
+	p = nsvg__createParser();
+	if (p == NULL) {
+		return NULL;
+	}
+	p->dpi = dpi;
+
+	nsvg__parseXMLView(input, len, nsvg__startElement, nsvg__endElement, NULL, p);
+
+	// Scale to viewBox
+	nsvg__scaleToViewbox(p, units);
+
+	ret = p->image;
+	p->image = NULL;
+
+	nsvg__deleteParser(p);
+
+	return ret;
+}
+
 NSVGimage* nsvgParseFromFile(const char* filename, const char* units, float dpi)
 {
 	FILE* fp = NULL;
@@ -2960,6 +3135,10 @@ void nsvgDelete(NSVGimage* image)
 {
 	NSVGshape *snext, *shape;
 	if (image == NULL) return;
+	if (image->arena != NULL) {
+		nsvg__deleteArena(image->arena);
+		return;
+	}
 	shape = image->shapes;
 	while (shape != NULL) {
 		snext = shape->next;
@@ -2972,4 +3151,9 @@ void nsvgDelete(NSVGimage* image)
 	free(image);
 }
 
+size_t nsvgImageBytes(const NSVGimage* image)
+{
+	return image != NULL && image->arena != NULL ? image->arena->bytes : 0;
+}
+
 #endif
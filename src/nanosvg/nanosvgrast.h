@@ -32,6 +32,7 @@ extern "C" {
 #endif
 
 typedef struct NSVGrasterizer NSVGrasterizer;
+typedef struct NSVGflattened NSVGflattened;
 
 /* Example Usage:
 	// Load SVG
@@ -62,6 +63,96 @@ void nsvgRasterize(NSVGrasterizer* r,
 				   NSVGimage* image, float tx, float ty, float scale,
 				   unsigned char* dst, int w, int h, int stride);
 
+// Rasterizes only the rows y0 to y1-1 of the image rendered by nsvgRasterize,
+// with the same result for these rows. Rows of the same image can be
+// rendered concurrently, as long as each call uses its own rasterizer.
+// The alpha of the rows is left premultiplied: once every row of the image
+// is rendered, call nsvgUnpremultiplyRows then nsvgDefringeRows.
+//   r, image, tx, ty, scale, dst, w, h, stride - see nsvgRasterize
+//   y0, y1 - range of rows to render
+void nsvgRasterizeRows(NSVGrasterizer* r,
+					   NSVGimage* image, float tx, float ty, float scale,
+					   unsigned char* dst, int w, int h, int stride,
+					   int y0, int y1);
+
+// First step of the alpha post-processing of nsvgRasterize, for rows y0 to
+// y1-1 only. Every row has to go through it before nsvgDefringeRows.
+void nsvgUnpremultiplyRows(unsigned char* dst, int w, int h, int stride,
+						   int y0, int y1);
+
+// Second step of the alpha post-processing of nsvgRasterize, for rows y0 to
+// y1-1 only. Reads the neighbour rows, which must be unpremultiplied.
+void nsvgDefringeRows(unsigned char* dst, int w, int h, int stride,
+					  int y0, int y1);
+
+// Same as nsvgRasterizeRows, nsvgUnpremultiplyRows and nsvgDefringeRows, but
+// dst points to row y0 instead of row 0, so that a few rows of a large
+// image can be processed in a small buffer. nsvgDefringeBand also reads the
+// rows y0-1 (if y0 > 0) and y1 (if y1 < h), before and after the band.
+void nsvgRasterizeBand(NSVGrasterizer* r,
+					   NSVGimage* image, float tx, float ty, float scale,
+					   unsigned char* dst, int w, int h, int stride,
+					   int y0, int y1);
+void nsvgUnpremultiplyBand(unsigned char* dst, int w, int h, int stride,
+						   int y0, int y1);
+void nsvgDefringeBand(unsigned char* dst, int w, int h, int stride,
+					  int y0, int y1);
+
+// Flattens the visible shapes of image to sorted edges as nsvgRasterize
+// does (fills, then expanded strokes), without rasterizing them, and
+// returns the number of edges. For benchmarks and statistics.
+//   r, image, scale - see nsvgRasterize
+int nsvgFlatten(NSVGrasterizer* r, NSVGimage* image, float scale);
+
+// Flattens every visible shape of image to edges (fills and expanded
+// strokes) once, at scale, so that rasterizations of the image at this or a
+// smaller scale reuse them, affinely rescaled, instead of flattening the
+// curves and expanding the strokes again (see nsvgSetFlattened). At smaller
+// scales the edges are more finely tessellated than nsvgRasterize would
+// make them; at scale itself the result is the same. Returns NULL if out
+// of memory. The image must outlive the result.
+//   r, image, scale - see nsvgRasterize
+NSVGflattened* nsvgFlattenImage(NSVGrasterizer* r, NSVGimage* image, float scale);
+
+// Sets the edges the next rasterizations with r use for the image flat was
+// built from (other images are flattened as usual), or NULL for none.
+void nsvgSetFlattened(NSVGrasterizer* r, const NSVGflattened* flat);
+
+// Deletes edges built by nsvgFlattenImage.
+void nsvgDeleteFlattened(NSVGflattened* flat);
+
+// Anti-aliasing modes of nsvgSetAntialias.
+enum NSVGantialias {
+	NSVG_AA_SAMPLED = 0,
+	NSVG_AA_ANALYTIC = 1
+};
+
+// Sets how the next rasterizations with r anti-alias the edges:
+//   NSVG_AA_SAMPLED - the coverage of each row of pixels is sampled on
+//                     subsamples scanlines (1 to 255, 5 by default); fewer
+//                     are faster but step the nearly horizontal edges.
+//                     The coverage of edge pixels is truncated on each
+//                     scanline, so more than 5 lose more than they gain.
+//   NSVG_AA_ANALYTIC - the exact area of each pixel inside the shape is
+//                     accumulated instead, subsamples is ignored.
+void nsvgSetAntialias(NSVGrasterizer* r, int mode, int subsamples);
+
+// Returns 1 if every visible fill and stroke of image is a solid color, all
+// with the same red, green and blue (their opacities may differ), and then
+// stores this color in *color (packed as in NSVGpaint, alpha 255). Returns
+// 0 otherwise: gradients, several colors or nothing painted. Fully
+// transparent fills and strokes are ignored. The coverage of such an image
+// (see nsvgSetCoverage) and the color are the whole image.
+int nsvgSingleColor(NSVGimage* image, unsigned int* color);
+
+// Sets whether the next rasterizations with r only write the coverage of
+// the image, one byte per pixel (the alpha nsvgRasterize would give it),
+// instead of RGBA. The row and band functions then write w bytes per row
+// (stride is still the distance between rows), which must not go through
+// the nsvgUnpremultiply and nsvgDefringe functions; nsvgRasterize skips
+// them.
+void nsvgSetCoverage(NSVGrasterizer* r, int coverage);
+
 // Deletes rasterizer context.
 void nsvgDeleteRasterizer(NSVGrasterizer*);
 
@@ -78,17 +169,11 @@ void nsvgDeleteRasterizer(NSVGrasterizer*);
 
 #include <math.h>
 
-#define NSVG__SUBSAMPLES	5
+#define NSVG__SUBSAMPLES	5		// Default of nsvgSetAntialias.
 #define NSVG__FIXSHIFT		10
 #define NSVG__FIX			(1 << NSVG__FIXSHIFT)
 #define NSVG__FIXMASK		(NSVG__FIX-1)
-#define NSVG__MEMPAGE_SIZE	1024
-
-typedef struct NSVGedge {
-	float x0,y0, x1,y1;
-	int dir;
-	struct NSVGedge* next;
-} NSVGedge;
+#define NSVG__SORT_SMALL	32		// Edges sorted by insertion up to this.
 
 typedef struct NSVGpoint {
 	float x, y;
@@ -102,15 +187,8 @@ typedef struct NSVGactiveEdge {
 	int x,dx;
 	float ey;
 	int dir;
-	struct NSVGactiveEdge *next;
 } NSVGactiveEdge;
 
-typedef struct NSVGmemPage {
-	unsigned char mem[NSVG__MEMPAGE_SIZE];
-	int size;
-	struct NSVGmemPage* next;
-} NSVGmemPage;
-
 typedef struct NSVGcachedPaint {
 	char type;
 	char spread;
@@ -125,10 +203,22 @@ struct NSVGrasterizer
 	float tessTol;
 	float distTol;
 
-	NSVGedge* edges;
+	// Edges of the current shape as a structure of arrays, from (x0,y0) to
+	// (x1,y1) with y0 < y1, dir being -1 if they were given the other way.
+	float* edgeX0;
+	float* edgeY0;
+	float* edgeX1;
+	float* edgeY1;
+	int* edgeDir;
 	int nedges;
 	int cedges;
 
+	// Scratch of nsvg__sortEdges, 2*cedges keys and indices, cedges temp.
+	unsigned int* sortKeys;
+	int* sortIndex;
+	void* sortTemp;
+	int csort;
+
 	NSVGpoint* points;
 	int npoints;
 	int cpoints;
@@ -137,15 +227,45 @@ struct NSVGrasterizer
 	int npoints2;
 	int cpoints2;
 
-	NSVGactiveEdge* freelist;
-	NSVGmemPage* pages;
-	NSVGmemPage* curpage;
+	NSVGactiveEdge* active;		// Sampled active edges, sorted by x.
+	int cactive;
 
 	unsigned char* scanline;
+	unsigned int* spanColors;	// Per pixel gradient colors, cscanline long.
+	float* coverage;			// Analytic coverage, cscanline+1 long.
 	int cscanline;
 
-	unsigned char* bitmap;
+	int* activeEdges;			// Analytic active edges, indices in edges.
+	int cactiveEdges;
+
+	int aaMode;
+	int subsamples;
+
+	unsigned char* bitmap;		// Row bitmapY of the destination.
+	int bitmapY;
 	int width, height, stride;
+	int bpp;					// Bytes per pixel of bitmap.
+
+	int coverageOnly;			// See nsvgSetCoverage.
+
+	const NSVGflattened* flat;	// See nsvgSetFlattened.
+};
+
+// Edges of the shapes of an image, as nsvg__addEdge stores them (y0 < y1),
+// at the scale they were flattened at. The fill edges of shape i are from
+// first[2*i] to first[2*i+1] (excluded), and its stroke edges, if stroked[i],
+// from first[2*i+1] to first[2*i+2].
+struct NSVGflattened
+{
+	const NSVGimage* image;
+	float scale;
+	int nshapes;
+	int* first;
+	unsigned char* stroked;
+	float* edges;				// x0, y0, x1, y1 of each edge.
+	int* dirs;
+	int nedges;
+	int cedges;
 };
 
 NSVGrasterizer* nsvgCreateRasterizer()
@@ -157,6 +277,9 @@ NSVGrasterizer* nsvgCreateRasterizer()
 	r->tessTol = 0.25f;
 	r->distTol = 0.01f;
 
+	r->aaMode = NSVG_AA_SAMPLED;
+	r->subsamples = NSVG__SUBSAMPLES;
+
 	return r;
 
 error:
@@ -166,68 +289,38 @@ error:
 
 void nsvgDeleteRasterizer(NSVGrasterizer* r)
 {
-	NSVGmemPage* p;
-
 	if (r == NULL) return;
 
-	p = r->pages;
-	while (p != NULL) {
-		NSVGmemPage* next = p->next;
-		free(p);
-		p = next;
-	}
-
-	if (r->edges) free(r->edges);
+	if (r->edgeX0) free(r->edgeX0);
+	if (r->edgeY0) free(r->edgeY0);
+	if (r->edgeX1) free(r->edgeX1);
+	if (r->edgeY1) free(r->edgeY1);
+	if (r->edgeDir) free(r->edgeDir);
+	if (r->sortKeys) free(r->sortKeys);
+	if (r->sortIndex) free(r->sortIndex);
+	if (r->sortTemp) free(r->sortTemp);
+	if (r->active) free(r->active);
 	if (r->points) free(r->points);
 	if (r->points2) free(r->points2);
 	if (r->scanline) free(r->scanline);
+	if (r->spanColors) free(r->spanColors);
+	if (r->coverage) free(r->coverage);
+	if (r->activeEdges) free(r->activeEdges);
 
 	free(r);
 }
 
-static NSVGmemPage* nsvg__nextPage(NSVGrasterizer* r, NSVGmemPage* cur)
-{
-	NSVGmemPage *newp;
-
-	// If using existing chain, return the next page in chain
-	if (cur != NULL && cur->next != NULL) {
-		return cur->next;
-	}
-
-	// Alloc new page
-	newp = (NSVGmemPage*)malloc(sizeof(NSVGmemPage));
-	if (newp == NULL) return NULL;
-	memset(newp, 0, sizeof(NSVGmemPage));
-
-	// Add to linked list
-	if (cur != NULL)
-		cur->next = newp;
-	else
-		r->pages = newp;
-
-	return newp;
-}
-
-static void nsvg__resetPool(NSVGrasterizer* r)
+void nsvgSetAntialias(NSVGrasterizer* r, int mode, int subsamples)
 {
-	NSVGmemPage* p = r->pages;
-	while (p != NULL) {
-		p->size = 0;
-		p = p->next;
-	}
-	r->curpage = r->pages;
+	if (subsamples < 1) subsamples = 1;
+	if (subsamples > 255) subsamples = 255;
+	r->aaMode = mode == NSVG_AA_ANALYTIC ? NSVG_AA_ANALYTIC : NSVG_AA_SAMPLED;
+	r->subsamples = subsamples;
 }
 
-static unsigned char* nsvg__alloc(NSVGrasterizer* r, int size)
+void nsvgSetCoverage(NSVGrasterizer* r, int coverage)
 {
-	unsigned char* buf;
-	if (size > NSVG__MEMPAGE_SIZE) return NULL;
-	if (r->curpage == NULL || r->curpage->size+size > NSVG__MEMPAGE_SIZE) {
-		r->curpage = nsvg__nextPage(r, r->curpage);
-	}
-	buf = &r->curpage->mem[r->curpage->size];
-	r->curpage->size += size;
-	return buf;
+	r->coverageOnly = coverage != 0;
 }
 
 static int nsvg__ptEquals(float x1, float y1, float x2, float y2, float tol)
@@ -287,33 +380,43 @@ static void nsvg__duplicatePoints(NSVGrasterizer* r)
 
 static void nsvg__addEdge(NSVGrasterizer* r, float x0, float y0, float x1, float y1)
 {
-	NSVGedge* e;
+	int e;
 
 	// Skip horizontal edges
 	if (y0 == y1)
 		return;
 
 	if (r->nedges+1 > r->cedges) {
-		r->cedges = r->cedges > 0 ? r->cedges * 2 : 64;
-		r->edges = (NSVGedge*)realloc(r->edges, sizeof(NSVGedge) * r->cedges);
-		if (r->edges == NULL) return;
+		int c = r->cedges > 0 ? r->cedges * 2 : 64;
+		float* ex0 = (float*)realloc(r->edgeX0, sizeof(float) * c);
+		if (ex0 != NULL) r->edgeX0 = ex0;
+		float* ey0 = (float*)realloc(r->edgeY0, sizeof(float) * c);
+		if (ey0 != NULL) r->edgeY0 = ey0;
+		float* ex1 = (float*)realloc(r->edgeX1, sizeof(float) * c);
+		if (ex1 != NULL) r->edgeX1 = ex1;
+		float* ey1 = (float*)realloc(r->edgeY1, sizeof(float) * c);
+		if (ey1 != NULL) r->edgeY1 = ey1;
+		int* edir = (int*)realloc(r->edgeDir, sizeof(int) * c);
+		if (edir != NULL) r->edgeDir = edir;
+		if (ex0 == NULL || ey0 == NULL || ex1 == NULL || ey1 == NULL || edir == NULL) return;
+		r->cedges = c;
 	}
 
-	e = &r->edges[r->nedges];
+	e = r->nedges;
 	r->nedges++;
 
 	if (y0 < y1) {
-		e->x0 = x0;
-		e->y0 = y0;
-		e->x1 = x1;
-		e->y1 = y1;
-		e->dir = 1;
+		r->edgeX0[e] = x0;
+		r->edgeY0[e] = y0;
+		r->edgeX1[e] = x1;
+		r->edgeY1[e] = y1;
+		r->edgeDir[e] = 1;
 	} else {
-		e->x0 = x1;
-		e->y0 = y1;
-		e->x1 = x0;
-		e->y1 = y0;
-		e->dir = -1;
+		r->edgeX0[e] = x1;
+		r->edgeY0[e] = y1;
+		r->edgeX1[e] = x0;
+		r->edgeY1[e] = y0;
+		r->edgeDir[e] = -1;
 	}
 }
 
@@ -841,53 +944,135 @@ static void nsvg__flattenShapeStroke(NSVGrasterizer* r, NSVGshape* shape, float
 	}
 }
 
-static int nsvg__cmpEdge(const void *p, const void *q)
+// Radix sort key of a float: ordered as the floats are (-0 as 0).
+static unsigned int nsvg__sortKey(float f)
 {
-	const NSVGedge* a = (const NSVGedge*)p;
-	const NSVGedge* b = (const NSVGedge*)q;
-
-	if (a->y0 < b->y0) return -1;
-	if (a->y0 > b->y0) return  1;
-	return 0;
+	unsigned int u;
+	f += 0.0f;
+	memcpy(&u, &f, sizeof(u));
+	return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
 }
 
+// Reorders the edges as order (indices of the old ones), using sortTemp.
+static void nsvg__permuteEdges(NSVGrasterizer* r, const int* order)
+{
+	float* tf = (float*)r->sortTemp;
+	int* ti = (int*)r->sortTemp;
+	float* arrays[4];
+	int i, k, n = r->nedges;
+
+	arrays[0] = r->edgeX0; arrays[1] = r->edgeY0;
+	arrays[2] = r->edgeX1; arrays[3] = r->edgeY1;
+	for (k = 0; k < 4; k++) {
+		for (i = 0; i < n; i++)
+			tf[i] = arrays[k][order[i]];
+		memcpy(arrays[k], tf, sizeof(float) * n);
+	}
+	for (i = 0; i < n; i++)
+		ti[i] = r->edgeDir[order[i]];
+	memcpy(r->edgeDir, ti, sizeof(int) * n);
+}
 
-static NSVGactiveEdge* nsvg__addActive(NSVGrasterizer* r, NSVGedge* e, float startPoint)
+// Sorts the edges by y0, keeping the order of equal ones (as a stable sort
+// of the edges): by insertion if few, otherwise with a LSD radix sort on the
+// float bits, one byte per pass, skipping the bytes all keys share.
+static void nsvg__sortEdges(NSVGrasterizer* r)
 {
-	 NSVGactiveEdge* z;
+	unsigned int *keys, *keys2;
+	int *index, *index2;
+	unsigned int counts[4][256];
+	int i, pass, n = r->nedges;
+
+	if (n < 2) return;
+
+	if (r->csort < r->cedges) {
+		unsigned int* k = (unsigned int*)realloc(r->sortKeys, sizeof(unsigned int) * 2 * r->cedges);
+		if (k != NULL) r->sortKeys = k;
+		int* ix = (int*)realloc(r->sortIndex, sizeof(int) * 2 * r->cedges);
+		if (ix != NULL) r->sortIndex = ix;
+		void* t = realloc(r->sortTemp, sizeof(float) * r->cedges);
+		if (t != NULL) r->sortTemp = t;
+		if (k == NULL || ix == NULL || t == NULL) return;
+		r->csort = r->cedges;
+	}
+	keys = r->sortKeys; keys2 = keys + n;
+	index = r->sortIndex; index2 = index + n;
 
-	if (r->freelist != NULL) {
-		// Restore from freelist.
-		z = r->freelist;
-		r->freelist = z->next;
-	} else {
-		// Alloc new edge.
-		z = (NSVGactiveEdge*)nsvg__alloc(r, sizeof(NSVGactiveEdge));
-		if (z == NULL) return NULL;
+	for (i = 0; i < n; i++) {
+		keys[i] = nsvg__sortKey(r->edgeY0[i]);
+		index[i] = i;
 	}
 
-	float dxdy = (e->x1 - e->x0) / (e->y1 - e->y0);
+	if (n <= NSVG__SORT_SMALL) {
+		for (i = 1; i < n; i++) {
+			unsigned int key = keys[i];
+			int j = i;
+			while (j > 0 && keys[j-1] > key) {
+				keys[j] = keys[j-1];
+				index[j] = index[j-1];
+				j--;
+			}
+			keys[j] = key;
+			index[j] = i;
+		}
+		nsvg__permuteEdges(r, index);
+		return;
+	}
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < n; i++) {
+		unsigned int key = keys[i];
+		counts[0][key & 0xff]++;
+		counts[1][(key >> 8) & 0xff]++;
+		counts[2][(key >> 16) & 0xff]++;
+		counts[3][key >> 24]++;
+	}
+
+	for (pass = 0; pass < 4; pass++) {
+		unsigned int* count = counts[pass];
+		unsigned int sum = 0, c;
+		int shift = pass * 8;
+		unsigned int* tk;
+		int* ti;
+		if (count[(keys[0] >> shift) & 0xff] == (unsigned int)n)
+			continue;	// Same byte everywhere: already in order.
+		for (i = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++) {
+			unsigned int d = count[(keys[i] >> shift) & 0xff]++;
+			keys2[d] = keys[i];
+			index2[d] = index[i];
+		}
+		tk = keys; keys = keys2; keys2 = tk;
+		ti = index; index = index2; index2 = ti;
+	}
+	nsvg__permuteEdges(r, index);
+}
+
+// Returns the active edge of edge e from the scanline startPoint.
+static NSVGactiveEdge nsvg__initActive(NSVGrasterizer* r, int e, float startPoint)
+{
+	NSVGactiveEdge z;
+	float x0 = r->edgeX0[e], y0 = r->edgeY0[e];
+
+	float dxdy = (r->edgeX1[e] - x0) / (r->edgeY1[e] - y0);
 //	STBTT_assert(e->y0 <= start_point);
 	// round dx down to avoid going too far
 	if (dxdy < 0)
-		z->dx = (int)(-floorf(NSVG__FIX * -dxdy));
+		z.dx = (int)(-floorf(NSVG__FIX * -dxdy));
 	else
-		z->dx = (int)floorf(NSVG__FIX * dxdy);
-	z->x = (int)floorf(NSVG__FIX * (e->x0 + dxdy * (startPoint - e->y0)));
+		z.dx = (int)floorf(NSVG__FIX * dxdy);
+	z.x = (int)floorf(NSVG__FIX * (x0 + dxdy * (startPoint - y0)));
 //	z->x -= off_x * FIX;
-	z->ey = e->y1;
-	z->next = 0;
-	z->dir = e->dir;
+	z.ey = r->edgeY1[e];
+	z.dir = r->edgeDir[e];
 
 	return z;
 }
 
-static void nsvg__freeActive(NSVGrasterizer* r, NSVGactiveEdge* z)
-{
-	z->next = r->freelist;
-	r->freelist = z;
-}
-
 static void nsvg__fillScanline(unsigned char* scanline, int len, int x0, int x1, int maxWeight, int* xmin, int* xmax)
 {
 	int i = x0 >> NSVG__FIXSHIFT;
@@ -918,36 +1103,34 @@ static void nsvg__fillScanline(unsigned char* scanline, int len, int x0, int x1,
 // note: this routine clips fills that extend off the edges... ideally this
 // wouldn't happen, but it could happen if the truetype glyph bounding boxes
 // are wrong, or if the user supplies a too-small bitmap
-static void nsvg__fillActiveEdges(unsigned char* scanline, int len, NSVGactiveEdge* e, int maxWeight, int* xmin, int* xmax, char fillRule)
+static void nsvg__fillActiveEdges(unsigned char* scanline, int len, const NSVGactiveEdge* e, int n, int maxWeight, int* xmin, int* xmax, char fillRule)
 {
 	// non-zero winding fill
-	int x0 = 0, w = 0;
+	int x0 = 0, w = 0, i;
 
 	if (fillRule == NSVG_FILLRULE_NONZERO) {
 		// Non-zero
-		while (e != NULL) {
+		for (i = 0; i < n; i++) {
 			if (w == 0) {
 				// if we're currently at zero, we need to record the edge start point
-				x0 = e->x; w += e->dir;
+				x0 = e[i].x; w += e[i].dir;
 			} else {
-				int x1 = e->x; w += e->dir;
+				int x1 = e[i].x; w += e[i].dir;
 				// if we went to zero, we need to draw
 				if (w == 0)
 					nsvg__fillScanline(scanline, len, x0, x1, maxWeight, xmin, xmax);
 			}
-			e = e->next;
 		}
 	} else if (fillRule == NSVG_FILLRULE_EVENODD) {
 		// Even-odd
-		while (e != NULL) {
+		for (i = 0; i < n; i++) {
 			if (w == 0) {
 				// if we're currently at zero, we need to record the edge start point
-				x0 = e->x; w = 1;
+				x0 = e[i].x; w = 1;
 			} else {
-				int x1 = e->x; w = 0;
+				int x1 = e[i].x; w = 0;
 				nsvg__fillScanline(scanline, len, x0, x1, maxWeight, xmin, xmax);
 			}
-			e = e->next;
 		}
 	}
 }
@@ -984,279 +1167,801 @@ static inline int nsvg__div255(int x)
     return ((x+1) * 257) >> 16;
 }
 
-static void nsvg__scanlineSolid(unsigned char* dst, int count, unsigned char* cover, int x, int y,
-								float tx, float ty, float scale, NSVGcachedPaint* cache)
+// Blends count pixels of colors (non-premultiplied RGBA) over dst with the
+// given coverage. step is 0 to use colors[0] for every pixel, 1 to use one
+// color per pixel. Reference implementation of the SIMD kernels below.
+static void nsvg__blendScalar(unsigned char* dst, int count, const unsigned char* cover,
+							  const unsigned int* colors, int step)
 {
+	int i;
+	for (i = 0; i < count; i++) {
+		int r,g,b,a,ia;
+		unsigned int c = colors[i*step];
+		int cr = (c) & 0xff;
+		int cg = (c >> 8) & 0xff;
+		int cb = (c >> 16) & 0xff;
+		int ca = (c >> 24) & 0xff;
+
+		a = nsvg__div255((int)cover[0] * ca);
+		ia = 255 - a;
+
+		// Premultiply
+		r = nsvg__div255(cr * a);
+		g = nsvg__div255(cg * a);
+		b = nsvg__div255(cb * a);
+
+		// Blend over
+		r += nsvg__div255(ia * (int)dst[0]);
+		g += nsvg__div255(ia * (int)dst[1]);
+		b += nsvg__div255(ia * (int)dst[2]);
+		a += nsvg__div255(ia * (int)dst[3]);
+
+		dst[0] = (unsigned char)r;
+		dst[1] = (unsigned char)g;
+		dst[2] = (unsigned char)b;
+		dst[3] = (unsigned char)a;
+
+		cover++;
+		dst += 4;
+	}
+}
 
-	if (cache->type == NSVG_PAINT_COLOR) {
-		int i, cr, cg, cb, ca;
-		cr = cache->colors[0] & 0xff;
-		cg = (cache->colors[0] >> 8) & 0xff;
-		cb = (cache->colors[0] >> 16) & 0xff;
-		ca = (cache->colors[0] >> 24) & 0xff;
-
-		for (i = 0; i < count; i++) {
-			int r,g,b;
-			int a = nsvg__div255((int)cover[0] * ca);
-			int ia = 255 - a;
-			// Premultiply
-			r = nsvg__div255(cr * a);
-			g = nsvg__div255(cg * a);
-			b = nsvg__div255(cb * a);
-
-			// Blend over
-			r += nsvg__div255(ia * (int)dst[0]);
-			g += nsvg__div255(ia * (int)dst[1]);
-			b += nsvg__div255(ia * (int)dst[2]);
-			a += nsvg__div255(ia * (int)dst[3]);
-
-			dst[0] = (unsigned char)r;
-			dst[1] = (unsigned char)g;
-			dst[2] = (unsigned char)b;
-			dst[3] = (unsigned char)a;
-
-			cover++;
-			dst += 4;
+// Un-premultiplies one row of w pixels. Reference implementation of the SIMD
+// kernels below.
+static void nsvg__unpremultiplyScalar(unsigned char* row, int w)
+{
+	int x;
+	for (x = 0; x < w; x++) {
+		int r = row[0], g = row[1], b = row[2], a = row[3];
+		if (a != 0) {
+			row[0] = (unsigned char)(r*255/a);
+			row[1] = (unsigned char)(g*255/a);
+			row[2] = (unsigned char)(b*255/a);
 		}
-	} else if (cache->type == NSVG_PAINT_LINEAR_GRADIENT) {
-		// TODO: spread modes.
-		// TODO: plenty of opportunities to optimize.
-		float fx, fy, dx, gy;
-		float* t = cache->xform;
-		int i, cr, cg, cb, ca;
-		unsigned int c;
+		row += 4;
+	}
+}
+
+// SIMD kernels, bit-exact with the scalar ones:
+//  - x86-64: SSE4.1 and AVX2, selected at runtime from the CPU features.
+//  - AArch64: NEON (always available).
+// Define NSVG_NO_SIMD to only use the scalar code.
+//
+// div255(x) = ((x+1)*257) >> 16 fits in 16 bits lanes for x <= 255*255, and
+// un-premultiplying uses a float division, whose rounding error (less than
+// half an ulp, below 2^-9 under 65536) can never cross the next integer 
+// (at least 1/255 away from a non-integer quotient), so truncating it gives
+// the same result as the integer division.
+#if !defined(NSVG_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define NSVG__SIMD_X86 1
+#include <immintrin.h>
+#elif !defined(NSVG_NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define NSVG__SIMD_NEON 1
+#include <arm_neon.h>
+#endif
 
-		fx = ((float)x - tx) / scale;
-		fy = ((float)y - ty) / scale;
-		dx = 1.0f / scale;
+#ifdef NSVG__SIMD_X86
 
-		for (i = 0; i < count; i++) {
-			int r,g,b,a,ia;
-			gy = fx*t[1] + fy*t[3] + t[5];
-			c = cache->colors[(int)nsvg__clampf(gy*255.0f, 0, 255.0f)];
-			cr = (c) & 0xff;
-			cg = (c >> 8) & 0xff;
-			cb = (c >> 16) & 0xff;
-			ca = (c >> 24) & 0xff;
-
-			a = nsvg__div255((int)cover[0] * ca);
-			ia = 255 - a;
-
-			// Premultiply
-			r = nsvg__div255(cr * a);
-			g = nsvg__div255(cg * a);
-			b = nsvg__div255(cb * a);
-
-			// Blend over
-			r += nsvg__div255(ia * (int)dst[0]);
-			g += nsvg__div255(ia * (int)dst[1]);
-			b += nsvg__div255(ia * (int)dst[2]);
-			a += nsvg__div255(ia * (int)dst[3]);
-
-			dst[0] = (unsigned char)r;
-			dst[1] = (unsigned char)g;
-			dst[2] = (unsigned char)b;
-			dst[3] = (unsigned char)a;
-
-			cover++;
-			dst += 4;
-			fx += dx;
-		}
-	} else if (cache->type == NSVG_PAINT_RADIAL_GRADIENT) {
-		// TODO: spread modes.
-		// TODO: plenty of opportunities to optimize.
-		// TODO: focus (fx,fy)
-		float fx, fy, dx, gx, gy, gd;
-		float* t = cache->xform;
-		int i, cr, cg, cb, ca;
-		unsigned int c;
-
-		fx = ((float)x - tx) / scale;
-		fy = ((float)y - ty) / scale;
-		dx = 1.0f / scale;
+#define NSVG__SIMD_NONE		0
+#define NSVG__SIMD_SSE41	1
+#define NSVG__SIMD_AVX2		2
+
+static int nsvg__simdLevel(void)
+{
+	// Cheap: reads the CPU model filled by libgcc at startup.
+	if (__builtin_cpu_supports("avx2")) return NSVG__SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.1")) return NSVG__SIMD_SSE41;
+	return NSVG__SIMD_NONE;
+}
+
+// Blends 2 pixels, unpacked in 16 bits lanes.
+__attribute__((target("sse4.1")))
+static inline __m128i nsvg__blend2SSE41(__m128i col, __m128i cov, __m128i d)
+{
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i k257 = _mm_set1_epi16(257);
+	const __m128i k255 = _mm_set1_epi16(255);
+	__m128i ca, a, ia, src;
+
+	ca = _mm_shufflehi_epi16(_mm_shufflelo_epi16(col, 0xff), 0xff);
+	a = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(cov, ca), one), k257);
+	ia = _mm_sub_epi16(k255, a);
+	// div255(255 * a) == a, so the alpha lane premultiplies to a.
+	col = _mm_blend_epi16(col, k255, 0x88);
+	src = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(col, a), one), k257);
+	d = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(d, ia), one), k257);
+	return _mm_add_epi16(src, d);
+}
 
+__attribute__((target("sse4.1")))
+static void nsvg__blendSSE41(unsigned char* dst, int count, const unsigned char* cover,
+							 const unsigned int* colors, int step)
+{
+	const __m128i cov01 = _mm_setr_epi8(0,-1,0,-1,0,-1,0,-1, 1,-1,1,-1,1,-1,1,-1);
+	const __m128i cov23 = _mm_setr_epi8(2,-1,2,-1,2,-1,2,-1, 3,-1,3,-1,3,-1,3,-1);
+	__m128i col = _mm_set1_epi32((int)colors[0]);
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		int c4;
+		__m128i cov, d, lo, hi;
+		if (step) col = _mm_loadu_si128((const __m128i*)(colors + i));
+		memcpy(&c4, cover + i, 4);
+		cov = _mm_cvtsi32_si128(c4);
+		d = _mm_loadu_si128((const __m128i*)(dst + i*4));
+		lo = nsvg__blend2SSE41(_mm_cvtepu8_epi16(col),
+							   _mm_shuffle_epi8(cov, cov01),
+							   _mm_cvtepu8_epi16(d));
+		hi = nsvg__blend2SSE41(_mm_cvtepu8_epi16(_mm_srli_si128(col, 8)),
+							   _mm_shuffle_epi8(cov, cov23),
+							   _mm_cvtepu8_epi16(_mm_srli_si128(d, 8)));
+		_mm_storeu_si128((__m128i*)(dst + i*4), _mm_packus_epi16(lo, hi));
+	}
+	nsvg__blendScalar(dst + i*4, count - i, cover + i, colors + i*step, step);
+}
+
+// Blends 4 pixels, unpacked in 16 bits lanes (2 per 128 bits lane).
+__attribute__((target("avx2")))
+static inline __m256i nsvg__blend4AVX2(__m256i col, __m256i cov, __m256i d)
+{
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i k257 = _mm256_set1_epi16(257);
+	const __m256i k255 = _mm256_set1_epi16(255);
+	__m256i ca, a, ia, src;
+
+	ca = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(col, 0xff), 0xff);
+	a = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_mullo_epi16(cov, ca), one), k257);
+	ia = _mm256_sub_epi16(k255, a);
+	col = _mm256_blend_epi16(col, k255, 0x88);
+	src = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_mullo_epi16(col, a), one), k257);
+	d = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_mullo_epi16(d, ia), one), k257);
+	return _mm256_add_epi16(src, d);
+}
+
+__attribute__((target("avx2")))
+static void nsvg__blendAVX2(unsigned char* dst, int count, const unsigned char* cover,
+							const unsigned int* colors, int step)
+{
+	// Both 128 bits lanes hold the 4 coverage bytes: pixels 0,1 are in the
+	// low lane and 2,3 in the high one.
+	const __m256i covMask = _mm256_setr_epi8(0,-1,0,-1,0,-1,0,-1, 1,-1,1,-1,1,-1,1,-1,
+											 2,-1,2,-1,2,-1,2,-1, 3,-1,3,-1,3,-1,3,-1);
+	__m256i col = _mm256_set1_epi32((int)colors[0]);
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		int c0, c1;
+		__m256i d, lo, hi, res;
+		if (step) col = _mm256_loadu_si256((const __m256i*)(colors + i));
+		memcpy(&c0, cover + i, 4);
+		memcpy(&c1, cover + i + 4, 4);
+		d = _mm256_loadu_si256((const __m256i*)(dst + i*4));
+		lo = nsvg__blend4AVX2(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(col)),
+							  _mm256_shuffle_epi8(_mm256_set1_epi32(c0), covMask),
+							  _mm256_cvtepu8_epi16(_mm256_castsi256_si128(d)));
+		hi = nsvg__blend4AVX2(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(col, 1)),
+							  _mm256_shuffle_epi8(_mm256_set1_epi32(c1), covMask),
+							  _mm256_cvtepu8_epi16(_mm256_extracti128_si256(d, 1)));
+		// Packing works per 128 bits lane: restore the pixel order.
+		res = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), _MM_SHUFFLE(3,1,2,0));
+		_mm256_storeu_si256((__m256i*)(dst + i*4), res);
+	}
+	nsvg__blendSSE41(dst + i*4, count - i, cover + i, colors + i*step, step);
+}
+
+__attribute__((target("sse4.1")))
+static void nsvg__unpremultiplySSE41(unsigned char* row, int w)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128 k255 = _mm_set1_ps(255.0f);
+	int x = 0;
+
+	for (; x + 4 <= w; x += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i*)(row + x*4));
+		__m128i a = _mm_srli_epi32(px, 24);
+		__m128 af = _mm_cvtepi32_ps(a);
+		__m128i r = _mm_and_si128(px, mask);
+		__m128i g = _mm_and_si128(_mm_srli_epi32(px, 8), mask);
+		__m128i b = _mm_and_si128(_mm_srli_epi32(px, 16), mask);
+		__m128i res;
+		r = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(r), k255), af));
+		g = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(g), k255), af));
+		b = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(b), k255), af));
+		res = _mm_or_si128(_mm_and_si128(r, mask),
+			  _mm_or_si128(_mm_slli_epi32(_mm_and_si128(g, mask), 8),
+			  _mm_or_si128(_mm_slli_epi32(_mm_and_si128(b, mask), 16),
+						   _mm_slli_epi32(a, 24))));
+		// Transparent pixels are left as is.
+		res = _mm_blendv_epi8(res, px, _mm_cmpeq_epi32(a, _mm_setzero_si128()));
+		_mm_storeu_si128((__m128i*)(row + x*4), res);
+	}
+	nsvg__unpremultiplyScalar(row + x*4, w - x);
+}
+
+__attribute__((target("avx2")))
+static void nsvg__unpremultiplyAVX2(unsigned char* row, int w)
+{
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	const __m256 k255 = _mm256_set1_ps(255.0f);
+	int x = 0;
+
+	for (; x + 8 <= w; x += 8) {
+		__m256i px = _mm256_loadu_si256((const __m256i*)(row + x*4));
+		__m256i a = _mm256_srli_epi32(px, 24);
+		__m256 af = _mm256_cvtepi32_ps(a);
+		__m256i r = _mm256_and_si256(px, mask);
+		__m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 8), mask);
+		__m256i b = _mm256_and_si256(_mm256_srli_epi32(px, 16), mask);
+		__m256i res;
+		r = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(r), k255), af));
+		g = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(g), k255), af));
+		b = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(b), k255), af));
+		res = _mm256_or_si256(_mm256_and_si256(r, mask),
+			  _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(g, mask), 8),
+			  _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(b, mask), 16),
+							  _mm256_slli_epi32(a, 24))));
+		res = _mm256_blendv_epi8(res, px, _mm256_cmpeq_epi32(a, _mm256_setzero_si256()));
+		_mm256_storeu_si256((__m256i*)(row + x*4), res);
+	}
+	nsvg__unpremultiplySSE41(row + x*4, w - x);
+}
+
+// Returns a bit per pixel (4 pixels from p) set if its alpha is zero. SSE2 is
+// part of x86-64, no need to check for it.
+static inline int nsvg__transparent4(const unsigned char* p)
+{
+	__m128i px = _mm_loadu_si128((const __m128i*)p);
+	__m128i a = _mm_and_si128(px, _mm_set1_epi32((int)0xff000000u));
+	return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, _mm_setzero_si128())));
+}
+
+#endif // NSVG__SIMD_X86
+
+#ifdef NSVG__SIMD_NEON
+
+static inline uint8x8_t nsvg__div255NEON(uint16x8_t x)
+{
+	// ((x+1)*257) >> 16 == (t + (t >> 8)) >> 8 with t = x+1.
+	uint16x8_t t = vaddq_u16(x, vdupq_n_u16(1));
+	return vmovn_u16(vshrq_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8));
+}
+
+static void nsvg__blendNEON(unsigned char* dst, int count, const unsigned char* cover,
+							const unsigned int* colors, int step)
+{
+	const uint8x8_t k255 = vdup_n_u8(255);
+	uint8x8x4_t col;
+	int i = 0;
+
+	col.val[0] = vdup_n_u8((unsigned char)(colors[0] & 0xff));
+	col.val[1] = vdup_n_u8((unsigned char)((colors[0] >> 8) & 0xff));
+	col.val[2] = vdup_n_u8((unsigned char)((colors[0] >> 16) & 0xff));
+	col.val[3] = vdup_n_u8((unsigned char)((colors[0] >> 24) & 0xff));
+
+	for (; i + 8 <= count; i += 8) {
+		uint8x8x4_t d = vld4_u8(dst + i*4);
+		uint8x8_t cov = vld1_u8(cover + i);
+		uint8x8_t a, ia;
+		if (step) col = vld4_u8((const unsigned char*)(colors + i));
+		a = nsvg__div255NEON(vmull_u8(cov, col.val[3]));
+		ia = vsub_u8(k255, a);
+		d.val[0] = vadd_u8(nsvg__div255NEON(vmull_u8(col.val[0], a)),
+						   nsvg__div255NEON(vmull_u8(ia, d.val[0])));
+		d.val[1] = vadd_u8(nsvg__div255NEON(vmull_u8(col.val[1], a)),
+						   nsvg__div255NEON(vmull_u8(ia, d.val[1])));
+		d.val[2] = vadd_u8(nsvg__div255NEON(vmull_u8(col.val[2], a)),
+						   nsvg__div255NEON(vmull_u8(ia, d.val[2])));
+		d.val[3] = vadd_u8(a, nsvg__div255NEON(vmull_u8(ia, d.val[3])));
+		vst4_u8(dst + i*4, d);
+	}
+	nsvg__blendScalar(dst + i*4, count - i, cover + i, colors + i*step, step);
+}
+
+static inline uint8x8_t nsvg__unpremultiply8NEON(uint8x8_t c, float32x4_t alo, float32x4_t ahi)
+{
+	const float32x4_t k255 = vdupq_n_f32(255.0f);
+	uint16x8_t c16 = vmovl_u8(c);
+	float32x4_t lo = vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(c16))), k255);
+	float32x4_t hi = vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(c16))), k255);
+	uint32x4_t qlo = vcvtq_u32_f32(vdivq_f32(lo, alo));
+	uint32x4_t qhi = vcvtq_u32_f32(vdivq_f32(hi, ahi));
+	// vmovn keeps the low bits, like the (unsigned char) cast.
+	return vmovn_u16(vcombine_u16(vmovn_u32(qlo), vmovn_u32(qhi)));
+}
+
+static void nsvg__unpremultiplyNEON(unsigned char* row, int w)
+{
+	int x = 0;
+
+	for (; x + 8 <= w; x += 8) {
+		uint8x8x4_t px = vld4_u8(row + x*4);
+		uint16x8_t a16 = vmovl_u8(px.val[3]);
+		float32x4_t alo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(a16)));
+		float32x4_t ahi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(a16)));
+		// Transparent pixels are left as is.
+		uint8x8_t zero = vceq_u8(px.val[3], vdup_n_u8(0));
+		px.val[0] = vbsl_u8(zero, px.val[0], nsvg__unpremultiply8NEON(px.val[0], alo, ahi));
+		px.val[1] = vbsl_u8(zero, px.val[1], nsvg__unpremultiply8NEON(px.val[1], alo, ahi));
+		px.val[2] = vbsl_u8(zero, px.val[2], nsvg__unpremultiply8NEON(px.val[2], alo, ahi));
+		vst4_u8(row + x*4, px);
+	}
+	nsvg__unpremultiplyScalar(row + x*4, w - x);
+}
+
+// Returns a bit per pixel (4 pixels from p) set if its alpha is zero.
+static inline int nsvg__transparent4(const unsigned char* p)
+{
+	uint32x4_t px = vld1q_u32((const uint32_t*)p);
+	uint32x4_t zero = vceqq_u32(vshrq_n_u32(px, 24), vdupq_n_u32(0));
+	uint32x4_t bits = vandq_u32(zero, (uint32x4_t){1, 2, 4, 8});
+	return (int)vaddvq_u32(bits);
+}
+
+#endif // NSVG__SIMD_NEON
+
+static void nsvg__blendColors(unsigned char* dst, int count, const unsigned char* cover,
+							  const unsigned int* colors, int step)
+{
+#if defined(NSVG__SIMD_X86)
+	switch (nsvg__simdLevel()) {
+	case NSVG__SIMD_AVX2:	nsvg__blendAVX2(dst, count, cover, colors, step); return;
+	case NSVG__SIMD_SSE41:	nsvg__blendSSE41(dst, count, cover, colors, step); return;
+	}
+#elif defined(NSVG__SIMD_NEON)
+	nsvg__blendNEON(dst, count, cover, colors, step);
+	return;
+#endif
+	nsvg__blendScalar(dst, count, cover, colors, step);
+}
+
+// Same as nsvg__blendScalar for the alpha only, dst having one byte per
+// pixel (see nsvgSetCoverage).
+static void nsvg__blendCoverage(unsigned char* dst, int count, const unsigned char* cover,
+								const unsigned int* colors, int step)
+{
+	int i;
+	if (step == 0) {
+		int ca = (colors[0] >> 24) & 0xff;
 		for (i = 0; i < count; i++) {
-			int r,g,b,a,ia;
-			gx = fx*t[0] + fy*t[2] + t[4];
-			gy = fx*t[1] + fy*t[3] + t[5];
-			gd = sqrtf(gx*gx + gy*gy);
-			c = cache->colors[(int)nsvg__clampf(gd*255.0f, 0, 255.0f)];
-			cr = (c) & 0xff;
-			cg = (c >> 8) & 0xff;
-			cb = (c >> 16) & 0xff;
-			ca = (c >> 24) & 0xff;
-
-			a = nsvg__div255((int)cover[0] * ca);
-			ia = 255 - a;
-
-			// Premultiply
-			r = nsvg__div255(cr * a);
-			g = nsvg__div255(cg * a);
-			b = nsvg__div255(cb * a);
-
-			// Blend over
-			r += nsvg__div255(ia * (int)dst[0]);
-			g += nsvg__div255(ia * (int)dst[1]);
-			b += nsvg__div255(ia * (int)dst[2]);
-			a += nsvg__div255(ia * (int)dst[3]);
-
-			dst[0] = (unsigned char)r;
-			dst[1] = (unsigned char)g;
-			dst[2] = (unsigned char)b;
-			dst[3] = (unsigned char)a;
-
-			cover++;
-			dst += 4;
-			fx += dx;
+			int a = nsvg__div255((int)cover[i] * ca);
+			dst[i] = (unsigned char)(a + nsvg__div255((255 - a) * (int)dst[i]));
 		}
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		int a = nsvg__div255((int)cover[i] * (int)((colors[i] >> 24) & 0xff));
+		dst[i] = (unsigned char)(a + nsvg__div255((255 - a) * (int)dst[i]));
 	}
 }
 
-static void nsvg__rasterizeSortedEdges(NSVGrasterizer *r, float tx, float ty, float scale, NSVGcachedPaint* cache, char fillRule)
+static void nsvg__unpremultiplyRow(unsigned char* row, int w)
 {
-	NSVGactiveEdge *active = NULL;
-	int y, s;
+#if defined(NSVG__SIMD_X86)
+	switch (nsvg__simdLevel()) {
+	case NSVG__SIMD_AVX2:	nsvg__unpremultiplyAVX2(row, w); return;
+	case NSVG__SIMD_SSE41:	nsvg__unpremultiplySSE41(row, w); return;
+	}
+#elif defined(NSVG__SIMD_NEON)
+	nsvg__unpremultiplyNEON(row, w);
+	return;
+#endif
+	nsvg__unpremultiplyScalar(row, w);
+}
+
+static void nsvg__linearColors(unsigned int* colors, int count, int x, int y,
+							   float tx, float ty, float scale, NSVGcachedPaint* cache)
+{
+	// TODO: spread modes.
+	float fx, fy, dx, gy;
+	float* t = cache->xform;
+	int i;
+
+	fx = ((float)x - tx) / scale;
+	fy = ((float)y - ty) / scale;
+	dx = 1.0f / scale;
+
+	for (i = 0; i < count; i++) {
+		gy = fx*t[1] + fy*t[3] + t[5];
+		colors[i] = cache->colors[(int)nsvg__clampf(gy*255.0f, 0, 255.0f)];
+		fx += dx;
+	}
+}
+
+static void nsvg__radialColors(unsigned int* colors, int count, int x, int y,
+							   float tx, float ty, float scale, NSVGcachedPaint* cache)
+{
+	// TODO: spread modes.
+	// TODO: focus (fx,fy)
+	float fx, fy, dx, gx, gy, gd;
+	float* t = cache->xform;
+	int i;
+
+	fx = ((float)x - tx) / scale;
+	fy = ((float)y - ty) / scale;
+	dx = 1.0f / scale;
+
+	for (i = 0; i < count; i++) {
+		gx = fx*t[0] + fy*t[2] + t[4];
+		gy = fx*t[1] + fy*t[3] + t[5];
+		gd = sqrtf(gx*gx + gy*gy);
+		colors[i] = cache->colors[(int)nsvg__clampf(gd*255.0f, 0, 255.0f)];
+		fx += dx;
+	}
+}
+
+// colors: scratch buffer of at least count entries, for gradients.
+// coverage: dst has one byte per pixel (see nsvgSetCoverage).
+static void nsvg__scanlineSolid(unsigned char* dst, int count, unsigned char* cover, int x, int y,
+								float tx, float ty, float scale, NSVGcachedPaint* cache,
+								unsigned int* colors, int coverage)
+{
+	void (*blend)(unsigned char*, int, const unsigned char*, const unsigned int*, int) =
+		coverage ? nsvg__blendCoverage : nsvg__blendColors;
+
+	if (cache->type == NSVG_PAINT_COLOR) {
+		blend(dst, count, cover, cache->colors, 0);
+	} else if (cache->type == NSVG_PAINT_LINEAR_GRADIENT) {
+		nsvg__linearColors(colors, count, x, y, tx, ty, scale, cache);
+		blend(dst, count, cover, colors, 1);
+	} else if (cache->type == NSVG_PAINT_RADIAL_GRADIENT) {
+		nsvg__radialColors(colors, count, x, y, tx, ty, scale, cache);
+		blend(dst, count, cover, colors, 1);
+	}
+}
+
+// Returns the center of the first scanline an edge starting at y0 is active
+// on, i.e. the scanline it would be inserted at when rasterizing from row 0.
+static float nsvg__firstScanline(float y0)
+{
+	int n = (int)ceilf(y0 - 0.5f);
+	if (n < 0) n = 0;
+	// Make sure to match the float comparison of nsvg__rasterizeSortedEdges.
+	while (n > 0 && y0 <= (float)(n-1) + 0.5f) n--;
+	while (y0 > (float)n + 0.5f) n++;
+	return (float)n + 0.5f;
+}
+
+static void nsvg__rasterizeSortedEdges(NSVGrasterizer *r, float tx, float ty, float scale, NSVGcachedPaint* cache, char fillRule, int ystart, int yend)
+{
+	NSVGactiveEdge *active;
+	int nactive = 0;
+	int y, s, i, n;
 	int e = 0;
-	int maxWeight = (255 / NSVG__SUBSAMPLES);  // weight per vertical scanline
+	int subsamples = r->subsamples;
+	int maxWeight = (255 / subsamples);  // weight per vertical scanline
+	int fullWeight = maxWeight * subsamples;	// 255 unless rounded down
 	int xmin, xmax;
+	float firsty = (float)(ystart*subsamples) + 0.5f;
+
+	// At most every edge is active at once.
+	if (r->nedges > r->cactive) {
+		active = (NSVGactiveEdge*)realloc(r->active, sizeof(NSVGactiveEdge) * r->nedges);
+		if (active == NULL) return;
+		r->active = active;
+		r->cactive = r->nedges;
+	}
+	active = r->active;
+
+	// Skip the rows above the first edge, and stop after the last one.
+	if (r->nedges > 0) {
+		int yfirst = (int)floorf(r->edgeY0[0] / (float)subsamples) - 1;
+		if (yfirst > ystart) ystart = yfirst;
+	}
 
-	for (y = 0; y < r->height; y++) {
+	for (y = ystart; y < yend; y++) {
+		if (e >= r->nedges && nactive == 0) break;
 		memset(r->scanline, 0, r->width);
 		xmin = r->width;
 		xmax = 0;
-		for (s = 0; s < NSVG__SUBSAMPLES; ++s) {
+		for (s = 0; s < subsamples; ++s) {
 			// find center of pixel for this scanline
-			float scany = (float)(y*NSVG__SUBSAMPLES + s) + 0.5f;
-			NSVGactiveEdge **step = &active;
+			float scany = (float)(y*subsamples + s) + 0.5f;
 
 			// update all active edges;
 			// remove all active edges that terminate before the center of this scanline
-			while (*step) {
-				NSVGactiveEdge *z = *step;
-				if (z->ey <= scany) {
-					*step = z->next; // delete from list
-//					NSVG__assert(z->valid);
-					nsvg__freeActive(r, z);
-				} else {
-					z->x += z->dx; // advance to position for current scanline
-					step = &((*step)->next); // advance through list
+			for (i = 0, n = 0; i < nactive; i++) {
+				if (active[i].ey > scany) {
+					active[n] = active[i];
+					active[n].x += active[n].dx; // advance to position for current scanline
+					n++;
 				}
 			}
-
-			// resort the list if needed
-			for (;;) {
-				int changed = 0;
-				step = &active;
-				while (*step && (*step)->next) {
-					if ((*step)->x > (*step)->next->x) {
-						NSVGactiveEdge* t = *step;
-						NSVGactiveEdge* q = t->next;
-						t->next = q->next;
-						q->next = t;
-						*step = q;
-						changed = 1;
+			nactive = n;
+
+			// resort the array if needed, by insertion as it is nearly sorted
+			for (i = 1; i < nactive; i++) {
+				if (active[i-1].x > active[i].x) {
+					NSVGactiveEdge t = active[i];
+					int j = i;
+					while (j > 0 && active[j-1].x > t.x) {
+						active[j] = active[j-1];
+						j--;
 					}
-					step = &(*step)->next;
+					active[j] = t;
 				}
-				if (!changed) break;
 			}
 
 			// insert all edges that start before the center of this scanline -- omit ones that also end on this scanline
-			while (e < r->nedges && r->edges[e].y0 <= scany) {
-				if (r->edges[e].y1 > scany) {
-					NSVGactiveEdge* z = nsvg__addActive(r, &r->edges[e], scany);
-					if (z == NULL) break;
-					// find insertion point
-					if (active == NULL) {
-						active = z;
-					} else if (z->x < active->x) {
-						// insert at front
-						z->next = active;
-						active = z;
+			while (e < r->nedges && r->edgeY0[e] <= scany) {
+				if (r->edgeY1[e] > scany) {
+					NSVGactiveEdge z;
+					int pos;
+					if (r->edgeY0[e] < firsty) {
+						// Started above ystart: replay the steps it would have
+						// taken since its first scanline, to get the same x.
+						float start = nsvg__firstScanline(r->edgeY0[e]);
+						unsigned int steps = (unsigned int)(scany - start);
+						z = nsvg__initActive(r, e, start);
+						z.x = (int)((unsigned int)z.x + steps * (unsigned int)z.dx);
+					} else {
+						z = nsvg__initActive(r, e, scany);
+					}
+					// find insertion point: in front if left of the first
+					// edge, otherwise after the ones left of it (and the first)
+					if (nactive == 0 || z.x < active[0].x) {
+						pos = 0;
 					} else {
-						// find thing to insert AFTER
-						NSVGactiveEdge* p = active;
-						while (p->next && p->next->x < z->x)
-							p = p->next;
-						// at this point, p->next->x is NOT < z->x
-						z->next = p->next;
-						p->next = z;
+						pos = 1;
+						while (pos < nactive && active[pos].x < z.x)
+							pos++;
 					}
+					memmove(&active[pos+1], &active[pos], sizeof(NSVGactiveEdge) * (nactive - pos));
+					active[pos] = z;
+					nactive++;
 				}
 				e++;
 			}
 
 			// now process all active edges in non-zero fashion
-			if (active != NULL)
-				nsvg__fillActiveEdges(r->scanline, r->width, active, maxWeight, &xmin, &xmax, fillRule);
+			if (nactive > 0)
+				nsvg__fillActiveEdges(r->scanline, r->width, active, nactive, maxWeight, &xmin, &xmax, fillRule);
 		}
 		// Blit
 		if (xmin < 0) xmin = 0;
 		if (xmax > r->width-1) xmax = r->width-1;
 		if (xmin <= xmax) {
-			nsvg__scanlineSolid(&r->bitmap[y * r->stride] + xmin*4, xmax-xmin+1, &r->scanline[xmin], xmin, y, tx,ty, scale, cache);
+			if (fullWeight != 255) {
+				int x;
+				for (x = xmin; x <= xmax; x++)
+					r->scanline[x] = (unsigned char)((r->scanline[x] * 255 + fullWeight / 2) / fullWeight);
+			}
+			nsvg__scanlineSolid(&r->bitmap[(y - r->bitmapY) * r->stride] + xmin*r->bpp, xmax-xmin+1, &r->scanline[xmin], xmin, y, tx,ty, scale, cache, r->spanColors, r->coverageOnly);
 		}
 	}
 
 }
 
-static void nsvg__unpremultiplyAlpha(unsigned char* image, int w, int h, int stride)
+// Adds the coverage of the part of e on row y, dy high and centered on xm,
+// to the coverage accumulator acc (w+1 long), like a step of height dy
+// spread on the pixel xm is in and the next one. The prefix sum of acc then
+// gives the winding of each pixel, anti-aliased by the exact covered area.
+static void nsvg__accumulateCell(float* acc, int w, float xm, float dy, int* xmin, int* xmax)
 {
-	int x,y;
+	int i = (int)floorf(xm);
+	float f;
+	if (i < 0) {
+		// Left of the image: only the full step matters.
+		acc[0] += dy;
+		i = 0;
+	} else if (i >= w) {
+		// Right of the image: no visible pixel is after it.
+		*xmax = w-1;
+		return;
+	} else {
+		f = xm - (float)i;
+		acc[i] += dy * (1.0f - f);
+		acc[i+1] += dy * f;
+	}
+	if (i < *xmin) *xmin = i;
+	if (i > *xmax) *xmax = i;
+}
 
-	// Unpremultiply
-	for (y = 0; y < h; y++) {
-		unsigned char *row = &image[y*stride];
-		for (x = 0; x < w; x++) {
-			int r = row[0], g = row[1], b = row[2], a = row[3];
-			if (a != 0) {
-				row[0] = (unsigned char)(r*255/a);
-				row[1] = (unsigned char)(g*255/a);
-				row[2] = (unsigned char)(b*255/a);
+// Accumulates the signed area coverage of edge e on row y (see
+// nsvg__accumulateCell), one pixel column at a time.
+static void nsvg__accumulateEdge(float* acc, int w, NSVGrasterizer* r, int e, int y, int* xmin, int* xmax)
+{
+	float ex0 = r->edgeX0[e], ey0 = r->edgeY0[e];
+	float ya = ey0 > (float)y ? ey0 : (float)y;
+	float yb = r->edgeY1[e] < (float)(y+1) ? r->edgeY1[e] : (float)(y+1);
+	float dir = (float)r->edgeDir[e];
+	float dxdy, xa, xb, x, x1, dydx;
+
+	if (ya >= yb) return;
+	dxdy = (r->edgeX1[e] - ex0) / (r->edgeY1[e] - ey0);
+	xa = ex0 + dxdy * (ya - ey0);
+	xb = ex0 + dxdy * (yb - ey0);
+	if (xa > xb) {
+		x = xa; xa = xb; xb = x;
+	}
+
+	if (xb - xa < 1e-6f) {
+		nsvg__accumulateCell(acc, w, (xa + xb) * 0.5f, (yb - ya) * dir, xmin, xmax);
+		return;
+	}
+
+	// Walk from left to right: the height of each piece is proportional to
+	// its width. Pieces out of the image are merged.
+	dydx = (yb - ya) / (xb - xa) * dir;
+	x = xa;
+	if (x < 0.0f) {
+		x1 = xb < 0.0f ? xb : 0.0f;
+		nsvg__accumulateCell(acc, w, -1.0f, (x1 - x) * dydx, xmin, xmax);
+		x = x1;
+	}
+	if (xb > (float)w) {
+		*xmax = w-1;
+		xb = (float)w;
+	}
+	while (x < xb) {
+		x1 = floorf(x) + 1.0f;
+		if (x1 > xb) x1 = xb;
+		nsvg__accumulateCell(acc, w, (x + x1) * 0.5f, (x1 - x) * dydx, xmin, xmax);
+		x = x1;
+	}
+}
+
+// Analytic anti-aliasing version of nsvg__rasterizeSortedEdges: the edges
+// are in pixels, sorted by y0, and each pixel gets the area of it inside the
+// shape instead of the average of several samples.
+static void nsvg__rasterizeAnalytic(NSVGrasterizer *r, float tx, float ty, float scale, NSVGcachedPaint* cache, char fillRule, int ystart, int yend)
+{
+	float* acc = r->coverage;
+	int* active;
+	int nactive = 0;
+	int e = 0;
+	int y, i, n, xmin, xmax;
+
+	if (r->nedges > r->cactiveEdges) {
+		r->cactiveEdges = r->nedges;
+		r->activeEdges = (int*)realloc(r->activeEdges, sizeof(int) * r->cactiveEdges);
+		if (r->activeEdges == NULL) return;
+	}
+	active = r->activeEdges;
+	memset(acc, 0, sizeof(float) * (r->width+1));
+
+	// Skip the rows above the first edge, and stop after the last one.
+	if (r->nedges > 0) {
+		int yfirst = (int)floorf(r->edgeY0[0]);
+		if (yfirst > ystart) ystart = yfirst;
+	}
+
+	for (y = ystart; y < yend; y++) {
+		if (e >= r->nedges && nactive == 0) break;
+		// Keep the edges still on this row, then add the ones starting on it.
+		for (i = 0, n = 0; i < nactive; i++) {
+			if (r->edgeY1[active[i]] > (float)y)
+				active[n++] = active[i];
+		}
+		nactive = n;
+		while (e < r->nedges && r->edgeY0[e] < (float)(y+1)) {
+			if (r->edgeY1[e] > (float)y)
+				active[nactive++] = e;
+			e++;
+		}
+
+		xmin = r->width;
+		xmax = -1;
+		for (i = 0; i < nactive; i++)
+			nsvg__accumulateEdge(acc, r->width, r, active[i], y, &xmin, &xmax);
+		if (xmin > xmax) continue;
+
+		// Coverage of each pixel from its winding, clearing acc on the way.
+		{
+			float sum = 0.0f;
+			for (i = xmin; i <= xmax; i++) {
+				float c;
+				sum += acc[i];
+				acc[i] = 0.0f;
+				c = sum < 0.0f ? -sum : sum;
+				if (fillRule == NSVG_FILLRULE_EVENODD) {
+					c = fmodf(c, 2.0f);
+					if (c > 1.0f) c = 2.0f - c;
+				} else if (c > 1.0f) {
+					c = 1.0f;
+				}
+				r->scanline[i] = (unsigned char)(c * 255.0f + 0.5f);
 			}
-			row += 4;
+			acc[xmax+1] = 0.0f;
+		}
+
+		nsvg__scanlineSolid(&r->bitmap[(y - r->bitmapY) * r->stride] + xmin*r->bpp, xmax-xmin+1, &r->scanline[xmin], xmin, y, tx,ty, scale, cache, r->spanColors, r->coverageOnly);
+	}
+}
+
+// Rasterizes the sorted edges of a shape with the anti-aliasing of r.
+static void nsvg__rasterizeEdges(NSVGrasterizer *r, float tx, float ty, float scale, NSVGcachedPaint* cache, char fillRule, int ystart, int yend)
+{
+	if (r->aaMode == NSVG_AA_ANALYTIC)
+		nsvg__rasterizeAnalytic(r, tx, ty, scale, cache, fillRule, ystart, yend);
+	else
+		nsvg__rasterizeSortedEdges(r, tx, ty, scale, cache, fillRule, ystart, yend);
+}
+
+// The band functions take rows pointing to row y0.
+static void nsvg__unpremultiplyBand(unsigned char* rows, int w, int h, int stride, int y0, int y1)
+{
+	int y;
+	(void)h;
+
+	// Unpremultiply
+	for (y = y0; y < y1; y++)
+		nsvg__unpremultiplyRow(&rows[(y-y0)*stride], w);
+}
+
+// Defringes the pixel at x,y, row pointing to it.
+static void nsvg__defringePixel(unsigned char* row, int x, int y, int w, int h, int stride)
+{
+	int r = 0, g = 0, b = 0, a = row[3], n = 0;
+	if (a == 0) {
+		if (x-1 > 0 && row[-1] != 0) {
+			r += row[-4];
+			g += row[-3];
+			b += row[-2];
+			n++;
+		}
+		if (x+1 < w && row[7] != 0) {
+			r += row[4];
+			g += row[5];
+			b += row[6];
+			n++;
+		}
+		if (y-1 > 0 && row[-stride+3] != 0) {
+			r += row[-stride];
+			g += row[-stride+1];
+			b += row[-stride+2];
+			n++;
+		}
+		if (y+1 < h && row[stride+3] != 0) {
+			r += row[stride];
+			g += row[stride+1];
+			b += row[stride+2];
+			n++;
+		}
+		if (n > 0) {
+			row[0] = (unsigned char)(r/n);
+			row[1] = (unsigned char)(g/n);
+			row[2] = (unsigned char)(b/n);
 		}
 	}
+}
+
+static void nsvg__defringeBand(unsigned char* rows, int w, int h, int stride, int y0, int y1)
+{
+	int x,y,k;
 
 	// Defringe
-	for (y = 0; y < h; y++) {
-		unsigned char *row = &image[y*stride];
-		for (x = 0; x < w; x++) {
-			int r = 0, g = 0, b = 0, a = row[3], n = 0;
-			if (a == 0) {
-				if (x-1 > 0 && row[-1] != 0) {
-					r += row[-4];
-					g += row[-3];
-					b += row[-2];
-					n++;
-				}
-				if (x+1 < w && row[7] != 0) {
-					r += row[4];
-					g += row[5];
-					b += row[6];
-					n++;
-				}
-				if (y-1 > 0 && row[-stride+3] != 0) {
-					r += row[-stride];
-					g += row[-stride+1];
-					b += row[-stride+2];
-					n++;
-				}
-				if (y+1 < h && row[stride+3] != 0) {
-					r += row[stride];
-					g += row[stride+1];
-					b += row[stride+2];
-					n++;
-				}
-				if (n > 0) {
-					row[0] = (unsigned char)(r/n);
-					row[1] = (unsigned char)(g/n);
-					row[2] = (unsigned char)(b/n);
+	for (y = y0; y < y1; y++) {
+		unsigned char *row = &rows[(y-y0)*stride];
+		for (x = 0; x < w; ) {
+#if defined(NSVG__SIMD_X86) || defined(NSVG__SIMD_NEON)
+			// Skip groups of 4 pixels which would be left untouched: all
+			// opaque, or all transparent with transparent neighbours.
+			if (x >= 1 && x+4 < w && y >= 1 && y+1 < h) {
+				unsigned char* p = row + x*4;
+				int t = nsvg__transparent4(p);
+				if (t == 0 || (t == 0xf && p[-1] == 0 && p[19] == 0 &&
+							   nsvg__transparent4(p - stride) == 0xf &&
+							   nsvg__transparent4(p + stride) == 0xf)) {
+					x += 4;
+					continue;
 				}
+				for (k = 0; k < 4; k++)
+					nsvg__defringePixel(p + k*4, x+k, y, w, h, stride);
+				x += 4;
+				continue;
 			}
-			row += 4;
+#endif
+			nsvg__defringePixel(row + x*4, x, y, w, h, stride);
+			x++;
 		}
 	}
+	(void)k;
+}
+
+static void nsvg__unpremultiplyAlpha(unsigned char* image, int w, int h, int stride)
+{
+	nsvg__unpremultiplyBand(image, w, h, stride, 0, h);
+	nsvg__defringeBand(image, w, h, stride, 0, h);
 }
 
 
@@ -1324,31 +2029,28 @@ static void nsvg__initPaint(NSVGcachedPaint* cache, NSVGpaint* paint, float opac
 static void dumpEdges(NSVGrasterizer* r, const char* name)
 {
 	float xmin = 0, xmax = 0, ymin = 0, ymax = 0;
-	NSVGedge *e = NULL;
 	int i;
 	if (r->nedges == 0) return;
 	FILE* fp = fopen(name, "w");
 	if (fp == NULL) return;
 
-	xmin = xmax = r->edges[0].x0;
-	ymin = ymax = r->edges[0].y0;
+	xmin = xmax = r->edgeX0[0];
+	ymin = ymax = r->edgeY0[0];
 	for (i = 0; i < r->nedges; i++) {
-		e = &r->edges[i];
-		xmin = nsvg__minf(xmin, e->x0);
-		xmin = nsvg__minf(xmin, e->x1);
-		xmax = nsvg__maxf(xmax, e->x0);
-		xmax = nsvg__maxf(xmax, e->x1);
-		ymin = nsvg__minf(ymin, e->y0);
-		ymin = nsvg__minf(ymin, e->y1);
-		ymax = nsvg__maxf(ymax, e->y0);
-		ymax = nsvg__maxf(ymax, e->y1);
+		xmin = nsvg__minf(xmin, r->edgeX0[i]);
+		xmin = nsvg__minf(xmin, r->edgeX1[i]);
+		xmax = nsvg__maxf(xmax, r->edgeX0[i]);
+		xmax = nsvg__maxf(xmax, r->edgeX1[i]);
+		ymin = nsvg__minf(ymin, r->edgeY0[i]);
+		ymin = nsvg__minf(ymin, r->edgeY1[i]);
+		ymax = nsvg__maxf(ymax, r->edgeY0[i]);
+		ymax = nsvg__maxf(ymax, r->edgeY1[i]);
 	}
 
 	fprintf(fp, "<svg viewBox=\"%f %f %f %f\" xmlns=\"http://www.w3.org/2000/svg\">", xmin, ymin, (xmax - xmin), (ymax - ymin));
 
 	for (i = 0; i < r->nedges; i++) {
-		e = &r->edges[i];
-		fprintf(fp ,"<line x1=\"%f\" y1=\"%f\" x2=\"%f\" y2=\"%f\" style=\"stroke:#000;\" />", e->x0,e->y0, e->x1,e->y1);
+		fprintf(fp ,"<line x1=\"%f\" y1=\"%f\" x2=\"%f\" y2=\"%f\" style=\"stroke:#000;\" />", r->edgeX0[i],r->edgeY0[i], r->edgeX1[i],r->edgeY1[i]);
 	}
 
 	for (i = 0; i < r->npoints; i++) {
@@ -1362,91 +2064,330 @@ static void dumpEdges(NSVGrasterizer* r, const char* name)
 }
 */
 
-void nsvgRasterize(NSVGrasterizer* r,
-				   NSVGimage* image, float tx, float ty, float scale,
-				   unsigned char* dst, int w, int h, int stride)
+// Appends the edges of r to flat. Returns 0 if out of memory.
+static int nsvg__appendFlattened(NSVGflattened* flat, NSVGrasterizer* r)
+{
+	int i;
+	if (flat->nedges + r->nedges > flat->cedges) {
+		int c = flat->cedges > 0 ? flat->cedges : 256;
+		float* edges;
+		int* dirs;
+		while (c < flat->nedges + r->nedges) c *= 2;
+		edges = (float*)realloc(flat->edges, sizeof(float) * 4 * c);
+		if (edges == NULL) return 0;
+		flat->edges = edges;
+		dirs = (int*)realloc(flat->dirs, sizeof(int) * c);
+		if (dirs == NULL) return 0;
+		flat->dirs = dirs;
+		flat->cedges = c;
+	}
+	for (i = 0; i < r->nedges; i++) {
+		float* e = &flat->edges[(flat->nedges + i) * 4];
+		e[0] = r->edgeX0[i];
+		e[1] = r->edgeY0[i];
+		e[2] = r->edgeX1[i];
+		e[3] = r->edgeY1[i];
+		flat->dirs[flat->nedges + i] = r->edgeDir[i];
+	}
+	flat->nedges += r->nedges;
+	return 1;
+}
+
+// Loads the edges from to end (excluded) of flat in r, rescaled from the
+// scale of flat to scale, in the same order. Edges that become horizontal
+// are skipped, as nsvg__addEdge does.
+static void nsvg__loadFlattened(NSVGrasterizer* r, const NSVGflattened* flat, int from, int end, float scale)
+{
+	float f = scale / flat->scale;
+	int i;
+	for (i = from; i < end; i++) {
+		const float* e = &flat->edges[i * 4];
+		if (flat->dirs[i] > 0)
+			nsvg__addEdge(r, e[0]*f, e[1]*f, e[2]*f, e[3]*f);
+		else
+			nsvg__addEdge(r, e[2]*f, e[3]*f, e[0]*f, e[1]*f);
+	}
+}
+
+NSVGflattened* nsvgFlattenImage(NSVGrasterizer* r, NSVGimage* image, float scale)
+{
+	NSVGflattened* flat;
+	NSVGshape* shape;
+	int i, n = 0;
+
+	for (shape = image->shapes; shape != NULL; shape = shape->next)
+		n++;
+
+	flat = (NSVGflattened*)malloc(sizeof(NSVGflattened));
+	if (flat == NULL) return NULL;
+	memset(flat, 0, sizeof(NSVGflattened));
+	flat->image = image;
+	flat->scale = scale;
+	flat->nshapes = n;
+	flat->first = (int*)malloc(sizeof(int) * (2 * n + 1));
+	flat->stroked = (unsigned char*)malloc(n > 0 ? n : 1);
+	if (flat->first == NULL || flat->stroked == NULL) goto error;
+
+	for (shape = image->shapes, i = 0; shape != NULL; shape = shape->next, i++) {
+		int visible = (shape->flags & NSVG_FLAGS_VISIBLE) != 0;
+		flat->first[2*i] = flat->nedges;
+		if (visible && shape->fill.type != NSVG_PAINT_NONE) {
+			r->nedges = 0;
+			nsvg__flattenShape(r, shape, scale);
+			if (!nsvg__appendFlattened(flat, r)) goto error;
+		}
+		flat->first[2*i+1] = flat->nedges;
+		flat->stroked[i] = (unsigned char)(visible && shape->stroke.type != NSVG_PAINT_NONE && (shape->strokeWidth * scale) > 0.01f);
+		if (flat->stroked[i]) {
+			r->nedges = 0;
+			nsvg__flattenShapeStroke(r, shape, scale);
+			if (!nsvg__appendFlattened(flat, r)) goto error;
+		}
+	}
+	flat->first[2*n] = flat->nedges;
+	r->nedges = 0;
+	return flat;
+
+error:
+	r->nedges = 0;
+	nsvgDeleteFlattened(flat);
+	return NULL;
+}
+
+void nsvgSetFlattened(NSVGrasterizer* r, const NSVGflattened* flat)
+{
+	r->flat = flat;
+}
+
+void nsvgDeleteFlattened(NSVGflattened* flat)
+{
+	if (flat == NULL) return;
+	free(flat->first);
+	free(flat->stroked);
+	free(flat->edges);
+	free(flat->dirs);
+	free(flat);
+}
+
+// dst points to row y0, and 0 <= y0 <= y1 <= h.
+static void nsvg__rasterizeBand(NSVGrasterizer* r,
+								NSVGimage* image, float tx, float ty, float scale,
+								unsigned char* dst, int w, int h, int stride,
+								int y0, int y1)
 {
 	NSVGshape *shape = NULL;
-	NSVGedge *e = NULL;
 	NSVGcachedPaint cache;
-	int i;
+	float ys = r->aaMode == NSVG_AA_ANALYTIC ? 1.0f : (float)r->subsamples;
+	const NSVGflattened* flat = (r->flat != NULL && r->flat->image == image) ? r->flat : NULL;
+	int i, index;
 
 	r->bitmap = dst;
+	r->bitmapY = y0;
 	r->width = w;
 	r->height = h;
 	r->stride = stride;
+	r->bpp = r->coverageOnly ? 1 : 4;
 
 	if (w > r->cscanline) {
 		r->cscanline = w;
 		r->scanline = (unsigned char*)realloc(r->scanline, w);
-		if (r->scanline == NULL) return;
+		r->spanColors = (unsigned int*)realloc(r->spanColors, w * sizeof(unsigned int));
+		r->coverage = (float*)realloc(r->coverage, (w+1) * sizeof(float));
+		if (r->scanline == NULL || r->spanColors == NULL || r->coverage == NULL) return;
 	}
 
-	for (i = 0; i < h; i++)
-		memset(&dst[i*stride], 0, w*4);
+	for (i = y0; i < y1; i++)
+		memset(&dst[(i-y0)*stride], 0, w*r->bpp);
 
-	for (shape = image->shapes; shape != NULL; shape = shape->next) {
+	for (shape = image->shapes, index = 0; shape != NULL; shape = shape->next, index++) {
 		if (!(shape->flags & NSVG_FLAGS_VISIBLE))
 			continue;
 
 		if (shape->fill.type != NSVG_PAINT_NONE) {
-			nsvg__resetPool(r);
-			r->freelist = NULL;
 			r->nedges = 0;
 
-			nsvg__flattenShape(r, shape, scale);
+			if (flat != NULL)
+				nsvg__loadFlattened(r, flat, flat->first[2*index], flat->first[2*index+1], scale);
+			else
+				nsvg__flattenShape(r, shape, scale);
 
 			// Scale and translate edges
 			for (i = 0; i < r->nedges; i++) {
-				e = &r->edges[i];
-				e->x0 = tx + e->x0;
-				e->y0 = (ty + e->y0) * NSVG__SUBSAMPLES;
-				e->x1 = tx + e->x1;
-				e->y1 = (ty + e->y1) * NSVG__SUBSAMPLES;
+				r->edgeX0[i] = tx + r->edgeX0[i];
+				r->edgeY0[i] = (ty + r->edgeY0[i]) * ys;
+				r->edgeX1[i] = tx + r->edgeX1[i];
+				r->edgeY1[i] = (ty + r->edgeY1[i]) * ys;
 			}
 
 			// Rasterize edges
-			qsort(r->edges, r->nedges, sizeof(NSVGedge), nsvg__cmpEdge);
+			nsvg__sortEdges(r);
 
 			// now, traverse the scanlines and find the intersections on each scanline, use non-zero rule
 			nsvg__initPaint(&cache, &shape->fill, shape->opacity);
 
-			nsvg__rasterizeSortedEdges(r, tx,ty,scale, &cache, shape->fillRule);
+			nsvg__rasterizeEdges(r, tx,ty,scale, &cache, shape->fillRule, y0, y1);
 		}
 		if (shape->stroke.type != NSVG_PAINT_NONE && (shape->strokeWidth * scale) > 0.01f) {
-			nsvg__resetPool(r);
-			r->freelist = NULL;
 			r->nedges = 0;
 
-			nsvg__flattenShapeStroke(r, shape, scale);
+			if (flat != NULL && flat->stroked[index])
+				nsvg__loadFlattened(r, flat, flat->first[2*index+1], flat->first[2*index+2], scale);
+			else
+				nsvg__flattenShapeStroke(r, shape, scale);
 
 //			dumpEdges(r, "edge.svg");
 
 			// Scale and translate edges
 			for (i = 0; i < r->nedges; i++) {
-				e = &r->edges[i];
-				e->x0 = tx + e->x0;
-				e->y0 = (ty + e->y0) * NSVG__SUBSAMPLES;
-				e->x1 = tx + e->x1;
-				e->y1 = (ty + e->y1) * NSVG__SUBSAMPLES;
+				r->edgeX0[i] = tx + r->edgeX0[i];
+				r->edgeY0[i] = (ty + r->edgeY0[i]) * ys;
+				r->edgeX1[i] = tx + r->edgeX1[i];
+				r->edgeY1[i] = (ty + r->edgeY1[i]) * ys;
 			}
 
 			// Rasterize edges
-			qsort(r->edges, r->nedges, sizeof(NSVGedge), nsvg__cmpEdge);
+			nsvg__sortEdges(r);
 
 			// now, traverse the scanlines and find the intersections on each scanline, use non-zero rule
 			nsvg__initPaint(&cache, &shape->stroke, shape->opacity);
 
-			nsvg__rasterizeSortedEdges(r, tx,ty,scale, &cache, NSVG_FILLRULE_NONZERO);
+			nsvg__rasterizeEdges(r, tx,ty,scale, &cache, NSVG_FILLRULE_NONZERO, y0, y1);
 		}
 	}
 
-	nsvg__unpremultiplyAlpha(dst, w, h, stride);
-
 	r->bitmap = NULL;
+	r->bitmapY = 0;
 	r->width = 0;
 	r->height = 0;
 	r->stride = 0;
+	r->bpp = 0;
+}
+
+// Checks the paint of a fill or stroke for nsvgSingleColor: returns 0 if it
+// is not a solid color or not the one in *color (set by the first one).
+static int nsvg__singlePaint(NSVGpaint* paint, float opacity, unsigned int* color, int* found)
+{
+	unsigned int c;
+	if (paint->type == NSVG_PAINT_NONE)
+		return 1;
+	if (paint->type != NSVG_PAINT_COLOR)
+		return 0;
+	c = nsvg__applyOpacity(paint->color, opacity);
+	if ((c >> 24) == 0)
+		return 1;
+	c |= 0xff000000u;
+	if (*found && c != *color)
+		return 0;
+	*color = c;
+	*found = 1;
+	return 1;
+}
+
+int nsvgSingleColor(NSVGimage* image, unsigned int* color)
+{
+	NSVGshape *shape = NULL;
+	unsigned int c = 0;
+	int found = 0;
+
+	for (shape = image->shapes; shape != NULL; shape = shape->next) {
+		if (!(shape->flags & NSVG_FLAGS_VISIBLE))
+			continue;
+		if (!nsvg__singlePaint(&shape->fill, shape->opacity, &c, &found))
+			return 0;
+		if (shape->strokeWidth > 0.0f &&
+			!nsvg__singlePaint(&shape->stroke, shape->opacity, &c, &found))
+			return 0;
+	}
+	if (found)
+		*color = c;
+	return found;
+}
+
+int nsvgFlatten(NSVGrasterizer* r, NSVGimage* image, float scale)
+{
+	NSVGshape *shape = NULL;
+	int n = 0;
+
+	for (shape = image->shapes; shape != NULL; shape = shape->next) {
+		if (!(shape->flags & NSVG_FLAGS_VISIBLE))
+			continue;
+
+		if (shape->fill.type != NSVG_PAINT_NONE) {
+			r->nedges = 0;
+			nsvg__flattenShape(r, shape, scale);
+			nsvg__sortEdges(r);
+			n += r->nedges;
+		}
+		if (shape->stroke.type != NSVG_PAINT_NONE && (shape->strokeWidth * scale) > 0.01f) {
+			r->nedges = 0;
+			nsvg__flattenShapeStroke(r, shape, scale);
+			nsvg__sortEdges(r);
+			n += r->nedges;
+		}
+	}
+	r->nedges = 0;
+	return n;
+}
+
+void nsvgRasterize(NSVGrasterizer* r,
+				   NSVGimage* image, float tx, float ty, float scale,
+				   unsigned char* dst, int w, int h, int stride)
+{
+	nsvg__rasterizeBand(r, image, tx, ty, scale, dst, w, h, stride, 0, h);
+	if (!r->coverageOnly)
+		nsvg__unpremultiplyAlpha(dst, w, h, stride);
+}
+
+void nsvgRasterizeRows(NSVGrasterizer* r,
+					   NSVGimage* image, float tx, float ty, float scale,
+					   unsigned char* dst, int w, int h, int stride,
+					   int y0, int y1)
+{
+	if (y0 < 0) y0 = 0;
+	if (y1 > h) y1 = h;
+	if (y0 >= y1) return;
+	nsvg__rasterizeBand(r, image, tx, ty, scale, &dst[y0*stride], w, h, stride, y0, y1);
+}
+
+void nsvgUnpremultiplyRows(unsigned char* dst, int w, int h, int stride,
+						   int y0, int y1)
+{
+	if (y0 < 0) y0 = 0;
+	if (y1 > h) y1 = h;
+	if (y0 >= y1) return;
+	nsvg__unpremultiplyBand(&dst[y0*stride], w, h, stride, y0, y1);
+}
+
+void nsvgDefringeRows(unsigned char* dst, int w, int h, int stride,
+					  int y0, int y1)
+{
+	if (y0 < 0) y0 = 0;
+	if (y1 > h) y1 = h;
+	if (y0 >= y1) return;
+	nsvg__defringeBand(&dst[y0*stride], w, h, stride, y0, y1);
+}
+
+void nsvgRasterizeBand(NSVGrasterizer* r,
+					   NSVGimage* image, float tx, float ty, float scale,
+					   unsigned char* dst, int w, int h, int stride,
+					   int y0, int y1)
+{
+	if (y0 < 0 || y1 > h || y0 >= y1) return;
+	nsvg__rasterizeBand(r, image, tx, ty, scale, dst, w, h, stride, y0, y1);
+}
+
+void nsvgUnpremultiplyBand(unsigned char* dst, int w, int h, int stride,
+						   int y0, int y1)
+{
+	if (y0 < 0 || y1 > h || y0 >= y1) return;
+	nsvg__unpremultiplyBand(dst, w, h, stride, y0, y1);
+}
+
+void nsvgDefringeBand(unsigned char* dst, int w, int h, int stride,
+					  int y0, int y1)
+{
+	if (y0 < 0 || y1 > h || y0 >= y1) return;
+	nsvg__defringeBand(dst, w, h, stride, y0, y1);
 }
 
 #endif
@@ -0,0 +1,137 @@
+#include "net_util.h"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <thread>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace gif643 {
+
+bool sendAll(int fd, const void* data, size_t size)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool sendAll(int fd, const std::string& data)
+{
+    return sendAll(fd, data.data(), data.size());
+}
+
+bool recvAll(int fd, void* data, size_t size)
+{
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = ::recv(fd, bytes, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+int listenTCP(const std::string& spec)
+{
+    std::string address = "127.0.0.1";
+    std::string port_str = spec;
+    size_t colon = spec.rfind(':');
+    if (colon != std::string::npos) {
+        address = spec.substr(0, colon);
+        port_str = spec.substr(colon + 1);
+    }
+    int port = 0;
+    auto [end, err] = std::from_chars(port_str.data(), 
+                                      port_str.data() + port_str.size(),
+                                      port);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (err != std::errc() || end != port_str.data() + port_str.size() ||
+        port <= 0 || port > 65535 ||
+        ::inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        std::cerr << "Error: Invalid address '" << spec << "'." << std::endl;
+        return -1;
+    }
+
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if (fd < 0 ||
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, 
+                     sizeof(reuse)) != 0 ||
+        ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(fd, 16) != 0) {
+        std::cerr << "Error: Cannot listen on '" << spec << "': " 
+                  << std::strerror(errno) << std::endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+void acceptConnections(int fd, 
+                       const std::atomic<bool>& stop,
+                       const std::function<void(int)>& serve)
+{
+    struct Client
+    {
+        std::thread         thread;
+        std::atomic<bool>   finished{false};
+    };
+    std::list<Client> clients;
+
+    while (!stop) {
+        // Join the threads of the finished connections.
+        clients.remove_if([](Client& client) {
+            if (!client.finished) {
+                return false;
+            }
+            client.thread.join();
+            return true;
+        });
+
+        pollfd pfd = {fd, POLLIN, 0};
+        if (::poll(&pfd, 1, SERVER_POLL_MS) <= 0) {
+            continue;
+        }
+        int client_fd = ::accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            continue;
+        }
+        Client& client = clients.emplace_back();
+        client.thread = std::thread([client_fd, &client, &serve] {
+            serve(client_fd);
+            ::close(client_fd);
+            client.finished = true;
+        });
+    }
+    for (Client& client: clients) {
+        client.thread.join();
+    }
+}
+
+}
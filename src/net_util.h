@@ -0,0 +1,41 @@
+#ifndef NET_UTIL_H
+#define NET_UTIL_H
+
+// Socket helpers of the servers (MetricsServer, TaskServer, WorkerServer)
+// and of RemotePool.
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace gif643 {
+
+const int       SERVER_POLL_MS    = 200; // Longest wait of MetricsServer,
+                                         // TaskServer and WorkerServer 
+                                         // before checking for their stop.
+
+/// \brief Sends all of size bytes of data on a socket. Returns false if the
+///        connection failed (without SIGPIPE).
+bool sendAll(int fd, const void* data, size_t size);
+
+bool sendAll(int fd, const std::string& data);
+
+/// \brief Receives exactly size bytes from a socket. Returns false if the
+///        connection ended or failed first.
+bool recvAll(int fd, void* data, size_t size);
+
+/// \brief Returns a TCP socket listening on spec, "[address:]port" (IPv4, 
+///        127.0.0.1 by default), or -1 with an error on stderr.
+int listenTCP(const std::string& spec);
+
+/// \brief Accepts connections on the listening socket fd until stop is 
+///        set, and serves each one (then closes it) on its own thread. 
+///        Returns once the connections being served are finished too.
+void acceptConnections(int fd, 
+                       const std::atomic<bool>& stop,
+                       const std::function<void(int)>& serve);
+
+}
+
+#endif // NET_UTIL_H
@@ -0,0 +1,44 @@
+#ifndef PNG_DATA_H
+#define PNG_DATA_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+
+namespace gif643 {
+
+/// \brief A compressed PNG file, in the buffer allocated by stb_image_write.
+///
+/// Keeping stb's buffer avoids copying the PNG between the encoder, the 
+/// cache and the output file.
+class PNGData
+{
+private:
+    unsigned char*  bytes_;
+    size_t          size_;
+
+public:
+    /// \brief Takes ownership of bytes, allocated with malloc.
+    PNGData(unsigned char* bytes, size_t size):
+        bytes_(bytes),
+        size_(size)
+    {
+    }
+
+    ~PNGData()
+    {
+        std::free(bytes_);
+    }
+
+    PNGData(const PNGData&) = delete;
+    PNGData& operator=(const PNGData&) = delete;
+
+    const unsigned char* data() const { return bytes_; }
+    size_t size() const { return size_; }
+};
+
+using PNGDataPtr = std::shared_ptr<const PNGData>;
+
+}
+
+#endif // PNG_DATA_H
@@ -0,0 +1,482 @@
+#include "remote.h"
+#include "net_util.h"
+#include "task_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace gif643 {
+
+RemotePool::RemotePool(double timeout_s):
+    timeout_(std::max<long long>(1, (long long)(timeout_s * 1000))),
+    next_id_(1),
+    stopping_(false)
+{
+}
+
+RemotePool::~RemotePool()
+{
+    stopping_ = true;
+    for (auto& worker: workers_) {
+        ::shutdown(worker->fd, SHUT_RDWR);
+    }
+    for (auto& worker: workers_) {
+        worker->reader.join();
+        ::close(worker->fd);
+    }
+}
+
+bool RemotePool::connect(const std::string& spec)
+{
+    std::string_view list = spec;
+    while (!list.empty()) {
+        size_t end = std::min(list.find(','), list.size());
+        const std::string address(list.substr(0, end));
+        list.remove_prefix(std::min(end + 1, list.size()));
+        if (address.empty()) {
+            continue;
+        }
+        int fd = connectTCP(address);
+        if (fd < 0) {
+            continue;
+        }
+        auto worker = std::make_unique<Worker>();
+        worker->address = address;
+        worker->key = mix(std::hash<std::string>()(address));
+        worker->fd = fd;
+        worker->reader = std::thread(&RemotePool::receive, this, 
+                                     worker.get());
+        workers_.push_back(std::move(worker));
+    }
+    if (workers_.empty()) {
+        std::cerr << "Error: No worker reachable in '" << spec << "'." 
+                  << std::endl;
+        return false;
+    }
+    std::cout << "Connected to " << workers_.size() << " workers." 
+              << std::endl;
+    return true;
+}
+
+PNGDataPtr RemotePool::render(const RemoteRequest& task)
+{
+    if (task.name.size() > REMOTE_MAX_NAME) {
+        std::cerr << "Exception while processing " << task.name 
+                  << ": Name too long for a remote task." << std::endl;
+        return nullptr;
+    }
+
+    const std::vector<Worker*> order = rank(task.hash);
+    std::vector<bool> tried(order.size(), false);
+    auto request = std::make_shared<Request>();
+    std::string svg;
+    bool svg_read = false;
+    while (true) {
+        bool dispatched = false;
+        while (!dispatched) {
+            const size_t i = pick(order, tried);
+            if (i == order.size()) {
+                break;
+            }
+            tried[i] = true;
+            Worker& worker = *order[i];
+            if (!svg_read && needsInput(worker, task.hash)) {
+                if (!readFile(task.name, svg)) {
+                    std::cerr << "Exception while processing " 
+                              << task.name << ": Cannot read '" 
+                              << task.name << "'." << std::endl;
+                    return waitFirst(request);
+                }
+                if (svg.size() > REMOTE_MAX_SVG) {
+                    std::cerr << "Exception while processing " 
+                              << task.name << ": Larger than the "
+                              << REMOTE_MAX_SVG << " bytes of a remote "
+                              << "task." << std::endl;
+                    return waitFirst(request);
+                }
+                svg_read = true;
+            }
+            dispatched = dispatch(worker, task, svg_read ? &svg : nullptr, 
+                                  request);
+        }
+
+        std::unique_lock<std::mutex> lock(request->mutex);
+        auto answered = [&request] { 
+            return request->done || request->outstanding == 0; 
+        };
+        if (dispatched) {
+            request->done_signal.wait_for(lock, timeout_, answered);
+        } else {
+            request->done_signal.wait(lock, answered);
+        }
+        if (request->done) {
+            if (!request->data) {
+                std::cerr << "Exception while processing " 
+                          << task.name << ": Failed on its worker." 
+                          << std::endl;
+            }
+            return request->data;
+        }
+        if (!dispatched && request->outstanding == 0) {
+            std::cerr << "Exception while processing " << task.name 
+                      << ": No worker left." << std::endl;
+            return nullptr;
+        }
+        TaskLog::write(std::cerr, "Dispatching ", task.name, 
+                       " again (", request->outstanding ? "timeout" 
+                                                        : "worker lost",
+                       ").");
+    }
+}
+
+int RemotePool::connectTCP(const std::string& address)
+{
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        std::cerr << "Warning: Invalid worker address '" << address 
+                  << "' (expected host:port)." << std::endl;
+        return -1;
+    }
+    const std::string host = address.substr(0, colon);
+    const std::string port = address.substr(colon + 1);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* infos = nullptr;
+    int err = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &infos);
+    if (err != 0) {
+        std::cerr << "Warning: Cannot resolve worker '" << address 
+                  << "': " << ::gai_strerror(err) << std::endl;
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* info = infos; info && fd < 0; info = info->ai_next) {
+        fd = ::socket(info->ai_family, info->ai_socktype | SOCK_CLOEXEC,
+                      info->ai_protocol);
+        if (fd >= 0 && 
+            ::connect(fd, info->ai_addr, info->ai_addrlen) != 0) {
+            err = errno;
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(infos);
+    if (fd < 0) {
+        std::cerr << "Warning: Cannot connect to worker '" << address 
+                  << "': " << std::strerror(err) << std::endl;
+        return -1;
+    }
+    int nodelay = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+bool RemotePool::readFile(const std::string& fname, std::string& data)
+{
+    std::ifstream file(fname, std::ios::binary);
+    std::ostringstream content;
+    content << file.rdbuf();
+    data = content.str();
+    return bool(file);
+}
+
+std::vector<RemotePool::Worker*> RemotePool::rank(uint64_t hash) const
+{
+    std::vector<std::pair<uint64_t, Worker*>> weights;
+    for (const auto& worker: workers_) {
+        weights.emplace_back(mix(hash ^ worker->key), worker.get());
+    }
+    std::sort(weights.begin(), weights.end(), 
+              [](const auto& a, const auto& b) { return a.first > b.first; });
+    std::vector<Worker*> order;
+    for (const auto& weight: weights) {
+        order.push_back(weight.second);
+    }
+    return order;
+}
+
+size_t RemotePool::pick(const std::vector<Worker*>& order, 
+                        const std::vector<bool>& tried)
+{
+    size_t first = order.size();
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (tried[i]) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(order[i]->mutex);
+        if (!order[i]->alive) {
+            continue;
+        }
+        if (order[i]->in_flight.size() < REMOTE_WINDOW) {
+            return i;
+        }
+        first = std::min(first, i);
+    }
+    return first;
+}
+
+bool RemotePool::needsInput(Worker& worker, uint64_t hash)
+{
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    return !worker.sent.count(hash);
+}
+
+bool RemotePool::dispatch(Worker& worker, const RemoteRequest& task,
+                          const std::string* svg, 
+                          const std::shared_ptr<Request>& request)
+{
+    std::unique_lock<std::mutex> lock(worker.mutex);
+    if (!worker.alive) {
+        return false;
+    }
+    const bool send_input = svg && !worker.sent.count(task.hash);
+    RemoteTask header = {};
+    header.hash = task.hash;
+    header.size = uint32_t(task.size);
+    header.name_bytes = uint32_t(task.name.size());
+    header.svg_bytes = send_input ? uint32_t(svg->size()) : 0;
+    std::memcpy(header.png, task.png.data(), 
+                std::min(task.png.size(), sizeof(header.png) - 1));
+    std::memcpy(header.raster, task.raster.data(), 
+                std::min(task.raster.size(), sizeof(header.raster) - 1));
+    const uint64_t id = next_id_++;
+    const RemoteFrame frame = {
+        REMOTE_TASK, 
+        uint32_t(sizeof(header) + header.name_bytes + header.svg_bytes), 
+        id
+    };
+    std::string bytes(reinterpret_cast<const char*>(&frame), 
+                      sizeof(frame));
+    bytes.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    bytes.append(task.name);
+    if (send_input) {
+        bytes.append(*svg);
+    }
+
+    {
+        std::lock_guard<std::mutex> request_lock(request->mutex);
+        ++request->outstanding;
+    }
+    worker.in_flight.emplace(id, request);
+    if (!sendAll(worker.fd, bytes)) {
+        lock.unlock();
+        lose(worker);
+        return false;
+    }
+    if (send_input) {
+        worker.sent.insert(task.hash);
+    }
+    TaskLog::write(std::cerr, "Running for ", task.name, " on ", 
+                   worker.address, "...");
+    return true;
+}
+
+void RemotePool::answer(Request& request, bool answered, PNGDataPtr data)
+{
+    {
+        std::lock_guard<std::mutex> lock(request.mutex);
+        --request.outstanding;
+        if (answered && !request.done) {
+            request.done = true;
+            request.data = std::move(data);
+        }
+    }
+    request.done_signal.notify_all();
+}
+
+PNGDataPtr RemotePool::waitFirst(const std::shared_ptr<Request>& request)
+{
+    std::unique_lock<std::mutex> lock(request->mutex);
+    request->done_signal.wait(lock, [&request] { 
+        return request->done || request->outstanding == 0; 
+    });
+    return request->data;
+}
+
+void RemotePool::lose(Worker& worker)
+{
+    std::unordered_map<uint64_t, std::shared_ptr<Request>> in_flight;
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!worker.alive) {
+            return;
+        }
+        worker.alive = false;
+        in_flight.swap(worker.in_flight);
+    }
+    ::shutdown(worker.fd, SHUT_RDWR);
+    if (!stopping_) {
+        std::cerr << "Error: Lost worker " << worker.address << ", "
+                  << in_flight.size() << " tasks dispatched again." 
+                  << std::endl;
+    }
+    for (auto& entry: in_flight) {
+        answer(*entry.second, false, nullptr);
+    }
+}
+
+void RemotePool::receive(Worker* worker)
+{
+    RemoteFrame frame;
+    while (recvAll(worker->fd, &frame, sizeof(frame))) {
+        unsigned char* bytes = nullptr;
+        if (frame.size > 0) {
+            bytes = static_cast<unsigned char*>(std::malloc(frame.size));
+            if (!bytes || !recvAll(worker->fd, bytes, frame.size)) {
+                std::free(bytes);
+                break;
+            }
+        }
+        PNGDataPtr data;
+        if (frame.type == REMOTE_RESULT && bytes) {
+            data = std::make_shared<PNGData>(bytes, frame.size);
+        } else {
+            std::free(bytes);
+        }
+
+        std::shared_ptr<Request> request;
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            auto it = worker->in_flight.find(frame.id);
+            if (it != worker->in_flight.end()) {
+                request = std::move(it->second);
+                worker->in_flight.erase(it);
+            }
+        }
+        if (request) {
+            answer(*request, true, std::move(data));
+        }
+    }
+    lose(*worker);
+}
+
+WorkerServer::WorkerServer(SessionFactory sessions):
+    sessions_(std::move(sessions)),
+    fd_(-1)
+{
+}
+
+WorkerServer::~WorkerServer()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+bool WorkerServer::start(const std::string& spec)
+{
+    fd_ = listenTCP(spec);
+    if (fd_ < 0) {
+        return false;
+    }
+    std::cout << "Worker listening on " << spec << "." << std::endl;
+    return true;
+}
+
+void WorkerServer::run(const std::atomic<bool>& stop)
+{
+    acceptConnections(fd_, stop, [this, &stop](int fd) { 
+        serve(fd, stop); 
+    });
+}
+
+void WorkerServer::serve(int fd, const std::atomic<bool>& stop)
+{
+    int nodelay = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    Session session = sessions_();
+    std::mutex send_mutex;
+    std::string payload;
+    while (!stop) {
+        pollfd pfd = {fd, POLLIN, 0};
+        int ready = ::poll(&pfd, 1, SERVER_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        RemoteFrame frame;
+        if (!recvAll(fd, &frame, sizeof(frame))) {
+            break;
+        }
+        if (frame.size > sizeof(RemoteTask) + REMOTE_MAX_NAME 
+                                            + REMOTE_MAX_SVG) {
+            std::cerr << "Error: Frame of " << frame.size << " bytes "
+                      << "from a coordinator, closing its connection." 
+                      << std::endl;
+            break;
+        }
+        payload.resize(frame.size);
+        if (!recvAll(fd, payload.data(), payload.size())) {
+            break;
+        }
+        const uint64_t id = frame.id;
+        Reply reply = [fd, &send_mutex, id](PNGDataPtr data) {
+            const RemoteFrame answer = {
+                data ? REMOTE_RESULT : REMOTE_FAILED,
+                data ? uint32_t(data->size()) : 0,
+                id
+            };
+            std::lock_guard<std::mutex> lock(send_mutex);
+            if (sendAll(fd, &answer, sizeof(answer)) && data) {
+                sendAll(fd, data->data(), data->size());
+            }
+        };
+        RemoteRequest task;
+        std::string_view svg;
+        if (frame.type != REMOTE_TASK || !parseTask(payload, task, svg) ||
+            !session.render(task, svg, std::move(reply))) {
+            std::cerr << "Error: Invalid task from a coordinator, closing"
+                      << " its connection." << std::endl;
+            break;
+        }
+    }
+
+    size_t done = 0;
+    size_t failed = 0;
+    session.wait(done, failed);
+    TaskLog::write(std::cerr, "Coordinator gone after ", done, 
+                   " tasks (", failed, " failed).");
+}
+
+bool WorkerServer::parseTask(const std::string& payload, 
+                             RemoteRequest& task,
+                             std::string_view& svg)
+{
+    RemoteTask header;
+    if (payload.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, payload.data(), sizeof(header));
+    header.png[sizeof(header.png) - 1] = '\0';
+    header.raster[sizeof(header.raster) - 1] = '\0';
+    if (header.name_bytes > REMOTE_MAX_NAME || 
+        header.svg_bytes > REMOTE_MAX_SVG ||
+        payload.size() != sizeof(header) + size_t(header.name_bytes) 
+                                         + header.svg_bytes) {
+        return false;
+    }
+    task.hash = header.hash;
+    task.name = payload.substr(sizeof(header), header.name_bytes);
+    task.size = int(std::min<uint32_t>(header.size, INT32_MAX));
+    task.png = header.png;
+    task.raster = header.raster;
+    svg = std::string_view(payload).substr(sizeof(header) 
+                                           + header.name_bytes);
+    return true;
+}
+
+}
@@ -0,0 +1,264 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+
+// Rendering on several nodes: a coordinator (--coordinator) sends its tasks
+// over TCP to workers (--worker), which send the PNG data back.
+
+#include "png_data.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace gif643 {
+
+const size_t    REMOTE_WINDOW     = 32;  // Tasks in flight on a worker 
+                                         // before others take more.
+const double    REMOTE_TIMEOUT    = 30;  // Default seconds before a remote
+                                         // task is dispatched again.
+const size_t    REMOTE_MAX_NAME   = 4096;     // Longest input name and
+const size_t    REMOTE_MAX_SVG    = 16 << 20; // largest SVG of a remote task.
+
+/// \brief Kinds of the frames between a RemotePool and its WorkerServers.
+enum RemoteFrameType : uint32_t
+{
+    REMOTE_TASK   = 1,  // To a worker: a RemoteTask.
+    REMOTE_RESULT = 2,  // To the coordinator: the PNG data.
+    REMOTE_FAILED = 3,  // To the coordinator: nothing, the task failed.
+};
+
+/// \brief Header of a frame, followed by size bytes of payload.
+///
+/// Frames are in native byte order: the nodes are expected to share it.
+struct RemoteFrame
+{
+    uint32_t type;
+    uint32_t size;
+    uint64_t id;        // The coordinator's, given back in the result.
+};
+
+/// \brief Payload of a REMOTE_TASK, followed by name_bytes of the input's 
+///        name and svg_bytes of its content.
+///
+/// The content is only sent with the first task of an input on a 
+/// connection: the worker keeps it parsed, by hash, for the next ones.
+struct RemoteTask
+{
+    uint64_t hash;
+    uint32_t size;
+    uint32_t name_bytes;
+    uint32_t svg_bytes;
+    char     png[16];       // PNGSettings::spec(), null terminated.
+    char     raster[16];    // RasterSettings::spec(), null terminated.
+};
+
+/// \brief A single-size task, as rendered remotely.
+///
+/// hash:   Content hash of the input (see contentHash), never 0.
+/// name:   The input's name on the coordinator (fname_in).
+/// size:   The size, in pixel, of the produced image.
+/// png:    Its PNGSettings::spec().
+/// raster: Its RasterSettings::spec().
+struct RemoteRequest
+{
+    uint64_t    hash;
+    std::string name;
+    int         size;
+    std::string png;
+    std::string raster;
+};
+
+/// \brief Renders tasks on remote workers (asset_conv --worker) for a 
+///        coordinator (--coordinator). Thread-safe.
+///
+/// Inputs are routed by content hash, with rendezvous hashing over the 
+/// worker addresses: the tasks of an SVG go to the same worker, which only
+/// receives and parses it once, and only the inputs of a lost worker move.
+/// Beyond REMOTE_WINDOW tasks in flight on its worker, a task spills to the
+/// next worker in its order.
+///
+/// A task not done within the timeout (slow worker) or whose worker is lost
+/// is dispatched again to the next one, and the first result wins. Lost 
+/// workers are not reconnected. A thread per worker receives the results.
+class RemotePool
+{
+private:
+    // A task being rendered, maybe dispatched on several workers.
+    struct Request
+    {
+        std::mutex              mutex;
+        std::condition_variable done_signal;
+        bool                    done = false;
+        size_t                  outstanding = 0;    // Dispatches without 
+                                                    // answer.
+        PNGDataPtr              data;
+    };
+
+    struct Worker
+    {
+        std::string     address;
+        uint64_t        key;        // Hash of address.
+        int             fd = -1;
+        std::thread     reader;
+
+        // Guards the members below, and sending on fd.
+        std::mutex      mutex;
+        bool            alive = true;
+        std::unordered_set<uint64_t>                            sent;
+        std::unordered_map<uint64_t, std::shared_ptr<Request>>  in_flight;
+    };
+
+    std::vector<std::unique_ptr<Worker>>    workers_;
+    std::chrono::milliseconds               timeout_;
+    std::atomic<uint64_t>                   next_id_;
+    std::atomic<bool>                       stopping_;
+
+public:
+    /// \param timeout_s: Seconds before a task is dispatched again.
+    explicit RemotePool(double timeout_s);
+
+    ~RemotePool();
+
+    RemotePool(const RemotePool&) = delete;
+    RemotePool& operator=(const RemotePool&) = delete;
+
+    /// \brief Connects to the workers of spec, "host:port[,host:port...]".
+    ///        Unreachable ones are skipped with a warning. Returns false, 
+    ///        with an error on stderr, if none can be reached.
+    bool connect(const std::string& spec);
+
+    /// \brief Renders a task on the workers. Returns its PNG data, or null 
+    ///        (with an error on stderr) if it failed or no worker is left.
+    PNGDataPtr render(const RemoteRequest& task);
+
+private:
+    /// \brief Returns a TCP socket connected to address, "host:port", or -1
+    ///        with a warning on stderr.
+    static int connectTCP(const std::string& address);
+
+    /// \brief Reads a whole file in data. Returns false if it cannot be read.
+    static bool readFile(const std::string& fname, std::string& data);
+
+    /// \brief Mixes the bits of a 64 bits value (splitmix64's finalizer).
+    static uint64_t mix(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    /// \brief Returns the workers in their rendezvous order for an input's
+    ///        hash: highest mix of the hash and the worker's key first.
+    std::vector<Worker*> rank(uint64_t hash) const;
+
+    /// \brief Returns the index in order of the next worker to dispatch on:
+    ///        the first alive and untried one with room in its window, or 
+    ///        else the first alive and untried one, or else order.size().
+    size_t pick(const std::vector<Worker*>& order, 
+                const std::vector<bool>& tried);
+
+    /// \brief Returns if the input of hash was not sent to worker yet.
+    static bool needsInput(Worker& worker, uint64_t hash);
+
+    /// \brief Sends a task to worker, with the input's content (svg) if it is
+    ///        not known there. Returns false if the worker is lost.
+    bool dispatch(Worker& worker, const RemoteRequest& task,
+                  const std::string* svg, 
+                  const std::shared_ptr<Request>& request);
+
+    /// \brief Answers a dispatch of request with data (null if failed), or 
+    ///        withdraws it if not answered (worker lost).
+    static void answer(Request& request, bool answered, PNGDataPtr data);
+
+    /// \brief Waits for the dispatches already made of request, if any, and
+    ///        returns the first result (or null).
+    static PNGDataPtr waitFirst(const std::shared_ptr<Request>& request);
+
+    /// \brief Marks worker as lost and withdraws its dispatches, once.
+    void lose(Worker& worker);
+
+    /// \brief Reader thread function: receives the results of worker until
+    ///        its connection ends.
+    void receive(Worker* worker);
+};
+
+/// \brief Renders the tasks of coordinators (see RemotePool) received on a 
+///        TCP port, for --worker: the results are sent back instead of 
+///        written.
+///
+/// Tasks are given to a Session per connection as they arrive: the 
+/// coordinator bounds how many it has in flight.
+class WorkerServer
+{
+public:
+    /// Sends the result of a task to its coordinator: its PNG data, or null
+    /// if it failed. Called once per task, from any thread.
+    using Reply = std::function<void(PNGDataPtr)>;
+
+    /// \brief The tasks of a connection (see workerSession in 
+    ///        asset_conv.cpp).
+    ///
+    /// render: Renders a task, svg being the content of its input if sent 
+    ///         with it (empty otherwise), and answers it with reply. 
+    ///         Returns false if the task is invalid: the connection is then
+    ///         closed.
+    /// wait:   Waits for every task rendered to be answered, and returns 
+    ///         how many were done and failed.
+    struct Session
+    {
+        std::function<bool(const RemoteRequest&, std::string_view, Reply)>
+                                                render;
+        std::function<void(size_t&, size_t&)>   wait;
+    };
+
+    /// Returns the Session of a new connection.
+    using SessionFactory = std::function<Session()>;
+
+private:
+    SessionFactory  sessions_;
+    int             fd_;
+
+public:
+    explicit WorkerServer(SessionFactory sessions);
+
+    ~WorkerServer();
+
+    WorkerServer(const WorkerServer&) = delete;
+    WorkerServer& operator=(const WorkerServer&) = delete;
+
+    /// \brief Listens on spec, "[address:]port" (see listenTCP). Returns 
+    ///        false, with an error on stderr, on failure.
+    bool start(const std::string& spec);
+
+    /// \brief Accepts and serves coordinators until stop is set. The 
+    ///        connections being served are finished first.
+    void run(const std::atomic<bool>& stop);
+
+private:
+    /// \brief Gives the tasks of a coordinator to a Session until it 
+    ///        disconnects, then waits for them: their results are sent on 
+    ///        fd from the processing threads.
+    void serve(int fd, const std::atomic<bool>& stop);
+
+    /// \brief Reads a REMOTE_TASK payload in task and svg (a view of 
+    ///        payload, empty if the input was not sent). Returns false if 
+    ///        the payload is invalid.
+    static bool parseTask(const std::string& payload, 
+                          RemoteRequest& task,
+                          std::string_view& svg);
+};
+
+}
+
+#endif // REMOTE_H
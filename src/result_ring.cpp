@@ -0,0 +1,172 @@
+#include "result_ring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+namespace gif643 {
+
+ResultRing::ResultRing():
+    map_(MAP_FAILED),
+    map_size_(0),
+    header_(nullptr),
+    descriptors_(nullptr),
+    data_(nullptr),
+    format_(RGBA),
+    ready_fd_(-1),
+    free_fd_(-1),
+    reserved_(0),
+    head_(0),
+    waiting_(false)
+{
+}
+
+ResultRing::~ResultRing()
+{
+    if (map_ != MAP_FAILED) {
+        close();
+        ::munmap(map_, map_size_);
+    }
+}
+
+bool ResultRing::open(const std::string& fname, 
+                      size_t slots, 
+                      size_t slot_bytes,
+                      int ready_fd,
+                      int free_fd,
+                      Format format)
+{
+    const size_t page = size_t(::sysconf(_SC_PAGESIZE));
+    const size_t data_offset = (RING_HEADER_BYTES 
+                                + slots * sizeof(RingSlot) + page - 1) 
+                             / page * page;
+    slot_bytes = (slot_bytes + 63) / 64 * 64;
+    const size_t size = data_offset + slots * slot_bytes;
+
+    int fd = ::open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0600);
+    if (fd < 0 || ::ftruncate(fd, size) != 0) {
+        std::cerr << "Error: Cannot create the ring '" << fname << "': " 
+                  << std::strerror(errno) << std::endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    map_ = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map_ == MAP_FAILED) {
+        std::cerr << "Error: Cannot map the ring '" << fname << "': " 
+                  << std::strerror(errno) << std::endl;
+        return false;
+    }
+    map_size_ = size;
+
+    header_ = static_cast<RingHeader*>(map_);
+    descriptors_ = reinterpret_cast<RingSlot*>(
+        static_cast<unsigned char*>(map_) + RING_HEADER_BYTES);
+    data_ = static_cast<unsigned char*>(map_) + data_offset;
+    header_->slots = uint32_t(slots);
+    header_->name_bytes = RING_NAME_BYTES;
+    header_->slot_bytes = slot_bytes;
+    header_->data_offset = data_offset;
+    std::memcpy(header_->magic, MAGIC, sizeof(MAGIC));
+
+    format_ = format;
+    ready_fd_ = ready_fd;
+    free_fd_ = free_fd;
+    published_.assign(slots, 0);
+    notify(ready_fd_);
+    return true;
+}
+
+uint64_t ResultRing::reserve()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (reserved_ - tail() >= header_->slots) {
+        if (waiting_) {
+            free_signal_.wait(lock);
+            continue;
+        }
+        // Only one thread reads free_fd_, the others wait for it. The
+        // poll times out in case a signal was consumed for an earlier 
+        // release.
+        waiting_ = true;
+        lock.unlock();
+        pollfd pfd = {free_fd_, POLLIN, 0};
+        if (::poll(&pfd, 1, RING_POLL_MS) > 0) {
+            // On failure, tail is checked again anyway.
+            uint64_t count;
+            [[maybe_unused]] ssize_t n = ::read(free_fd_, &count, 
+                                                sizeof(count));
+        }
+        lock.lock();
+        waiting_ = false;
+        free_signal_.notify_all();
+    }
+    return reserved_++;
+}
+
+void ResultRing::publish(uint64_t slot, 
+                         const std::string& name, 
+                         bool success,
+                         int width, 
+                         int height, 
+                         size_t size)
+{
+    const size_t index = slot % header_->slots;
+    RingSlot& desc = descriptors_[index];
+    desc.format = format_;
+    desc.status = success ? 0 : 1;
+    desc.width = width;
+    desc.height = height;
+    desc.size = success ? size : 0;
+    desc.name_size = uint32_t(std::min(name.size(), RING_NAME_BYTES));
+    std::memcpy(desc.name, name.data(), desc.name_size);
+
+    bool moved = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        published_[index] = 1;
+        while (head_ < reserved_ && published_[head_ % header_->slots]) {
+            published_[head_ % header_->slots] = 0;
+            ++head_;
+            moved = true;
+        }
+        if (moved) {
+            std::atomic_ref<uint64_t>(header_->head).store(
+                head_, std::memory_order_release);
+        }
+    }
+    if (moved) {
+        notify(ready_fd_);
+    }
+}
+
+void ResultRing::close()
+{
+    std::atomic_ref<uint32_t>(header_->closed).store(
+        1, std::memory_order_release);
+    notify(ready_fd_);
+}
+
+uint64_t ResultRing::tail()
+{
+    return std::atomic_ref<uint64_t>(header_->tail).load(
+        std::memory_order_acquire);
+}
+
+void ResultRing::notify(int fd)
+{
+    // On failure, the consumer is gone or has a full counter to read.
+    const uint64_t one = 1;
+    [[maybe_unused]] ssize_t n = ::write(fd, &one, sizeof(one));
+}
+
+}
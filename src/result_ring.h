@@ -0,0 +1,148 @@
+#ifndef RESULT_RING_H
+#define RESULT_RING_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace gif643 {
+
+const size_t    RING_SLOTS        = 16;       // Default slots of a ResultRing.
+const size_t    RING_SLOT_BYTES   = 4 << 20;  // Default bytes per slot (a 
+                                              // 1024px RGBA image).
+const int       RING_POLL_MS      = 200;      // Longest wait for a free slot
+                                              // before checking tail again.
+
+/// \brief A ring of result slots in a shared file, handed to a consumer 
+///        process (typically Python, see scripts/ring_results.py) with no
+///        output file and no copy through a pipe.
+///
+/// The file (native endianness) holds a RingHeader, then a RingSlot 
+/// descriptor per slot from RING_HEADER_BYTES, then the slots' data, 
+/// slot_bytes each, from data_offset (page aligned).
+///
+/// This process publishes slots by increasing head, the consumer releases
+/// them by increasing tail. Both only grow (slot n is at n % slots) and 
+/// are accessed atomically. Two eventfds, inherited from the consumer, 
+/// carry the signals: this process writes 1 to ready once the ring is 
+/// created, after head grows and when it is closed, and the consumer writes
+/// 1 to free after tail grows.
+///
+/// Workers reserve slots and fill them in parallel (e.g. rasterize straight
+/// in them): head only moves over the published ones, in order.
+class ResultRing
+{
+public:
+    enum Format : uint32_t { RGBA = 0, PNG = 1 };
+
+    static constexpr char     MAGIC[8]          = {'A', 'C', 'R', 'I', 
+                                                   'N', 'G', '0', '1'};
+    static constexpr size_t   RING_HEADER_BYTES = 64;
+    static constexpr size_t   RING_NAME_BYTES   = 256;
+
+    struct RingHeader
+    {
+        char     magic[8];
+        uint32_t slots;
+        uint32_t name_bytes;    // RING_NAME_BYTES.
+        uint64_t slot_bytes;
+        uint64_t data_offset;
+        uint64_t head;          // Slots published so far.
+        uint64_t tail;          // Slots released so far, by the consumer.
+        uint32_t closed;        // 1 once nothing more will be published.
+        uint32_t reserved;
+    };
+
+    struct RingSlot
+    {
+        uint32_t format;        // A Format.
+        uint32_t status;        // 0 if produced, 1 if the task failed.
+        uint32_t width;
+        uint32_t height;
+        uint64_t size;          // Bytes of data in the slot.
+        uint32_t name_size;
+        uint32_t reserved;
+        char     name[RING_NAME_BYTES];    // fname_out, not null terminated.
+    };
+
+    static_assert(sizeof(RingHeader) <= RING_HEADER_BYTES);
+
+private:
+    void*               map_;
+    size_t              map_size_;
+    RingHeader*         header_;
+    RingSlot*           descriptors_;
+    unsigned char*      data_;
+    Format              format_;
+    int                 ready_fd_;
+    int                 free_fd_;
+
+    uint64_t                reserved_;  // Slots reserved so far.
+    uint64_t                head_;
+    std::vector<char>       published_; // Per slot, published after head_.
+    bool                    waiting_;   // A thread polls free_fd_.
+    std::mutex              mutex_;
+    std::condition_variable free_signal_;
+
+public:
+    ResultRing();
+
+    ~ResultRing();
+
+    ResultRing(const ResultRing&) = delete;
+    ResultRing& operator=(const ResultRing&) = delete;
+
+    /// \brief Creates (or replaces) the ring in fname and signals it on 
+    ///        ready_fd. Returns false, with an error on stderr, on failure.
+    bool open(const std::string& fname, 
+              size_t slots, 
+              size_t slot_bytes,
+              int ready_fd,
+              int free_fd,
+              Format format);
+
+    Format format() const
+    {
+        return format_;
+    }
+
+    size_t slotBytes() const
+    {
+        return header_->slot_bytes;
+    }
+
+    /// \brief Reserves the next slot, waiting for the consumer to release 
+    ///        one if they are all in use. The slot has to be published.
+    uint64_t reserve();
+
+    /// \brief Returns the data of a reserved slot (slotBytes() bytes).
+    unsigned char* data(uint64_t slot)
+    {
+        return data_ + (slot % header_->slots) * header_->slot_bytes;
+    }
+
+    /// \brief Describes a reserved slot and publishes it (and the ones after
+    ///        it already published).
+    void publish(uint64_t slot, 
+                 const std::string& name, 
+                 bool success,
+                 int width, 
+                 int height, 
+                 size_t size);
+
+    /// \brief Marks the ring as closed: nothing else will be published. 
+    ///        Safe to call more than once.
+    void close();
+
+private:
+    uint64_t tail();
+
+    static void notify(int fd);
+};
+
+}
+
+#endif // RESULT_RING_H
@@ -0,0 +1,184 @@
+#include "sharding.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+
+namespace gif643 {
+
+SharedClaims::SharedClaims():
+    entries_(nullptr),
+    capacity_(0),
+    full_warned_(false)
+{
+}
+
+SharedClaims::~SharedClaims()
+{
+    if (entries_) {
+        ::munmap(entries_, capacity_ * sizeof(uint64_t));
+    }
+}
+
+bool SharedClaims::create(size_t capacity)
+{
+    void* map = ::mmap(nullptr, capacity * sizeof(uint64_t), 
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                       -1, 0);
+    if (map == MAP_FAILED) {
+        std::cerr << "Error: Cannot map the shared task claims: " 
+                  << std::strerror(errno) << std::endl;
+        return false;
+    }
+    entries_ = static_cast<uint64_t*>(map);
+    capacity_ = capacity;
+    return true;
+}
+
+bool SharedClaims::claim(uint64_t hash)
+{
+    const uint64_t key = keyOf(hash);
+    for (size_t i = 0; i < MAX_PROBES; ++i) {
+        std::atomic_ref<uint64_t> entry(entries_[((key >> 2) + i) % capacity_]);
+        uint64_t value = entry.load(std::memory_order_acquire);
+        while (value == 0 || (value & ~STATE_MASK) == key) {
+            if (value != 0 && (value & STATE_MASK) != RELEASED) {
+                return false;
+            }
+            if (entry.compare_exchange_weak(value, key | CLAIMED,
+                                            std::memory_order_acq_rel)) {
+                return true;
+            }
+        }
+    }
+    if (!full_warned_.exchange(true)) {
+        std::cerr << "Warning: The shared task claims are full." 
+                  << std::endl;
+    }
+    return true;
+}
+
+void SharedClaims::set(uint64_t hash, State state)
+{
+    const uint64_t key = keyOf(hash);
+    for (size_t i = 0; i < MAX_PROBES; ++i) {
+        std::atomic_ref<uint64_t> entry(entries_[((key >> 2) + i) % capacity_]);
+        uint64_t value = entry.load(std::memory_order_acquire);
+        if (value == 0) {
+            return;
+        }
+        if ((value & ~STATE_MASK) == key) {
+            entry.store(key | state, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+ShardQueue::ShardQueue():
+    shared_(nullptr)
+{
+}
+
+ShardQueue::~ShardQueue()
+{
+    if (shared_) {
+        ::munmap(shared_, sizeof(Shared));
+    }
+}
+
+bool ShardQueue::create()
+{
+    void* map = ::mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, 
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        std::cerr << "Error: Cannot map the shard queue: " 
+                  << std::strerror(errno) << std::endl;
+        return false;
+    }
+    shared_ = static_cast<Shared*>(map);
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared_->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&shared_->not_empty, &cond_attr);
+    pthread_cond_init(&shared_->not_full, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    return true;
+}
+
+bool ShardQueue::pushLine(std::string_view line)
+{
+    if (line.size() > SHARD_LINE_BYTES) {
+        std::cerr << "Error: Task line too long: " << line << std::endl;
+        return false;
+    }
+    push(-1, line);
+    return true;
+}
+
+bool ShardQueue::pop(int64_t& manifest_task, std::string& line)
+{
+    lock();
+    while (shared_->head == shared_->tail && !shared_->closed) {
+        wait(shared_->not_empty);
+    }
+    if (shared_->head == shared_->tail) {
+        pthread_mutex_unlock(&shared_->mutex);
+        return false;
+    }
+    const Record& record = shared_->records[shared_->head 
+                                            % SHARD_QUEUE_RECORDS];
+    manifest_task = record.manifest_task;
+    line.assign(record.line, record.size);
+    ++shared_->head;
+    pthread_cond_signal(&shared_->not_full);
+    pthread_mutex_unlock(&shared_->mutex);
+    return true;
+}
+
+void ShardQueue::close()
+{
+    lock();
+    shared_->closed = 1;
+    pthread_cond_broadcast(&shared_->not_empty);
+    pthread_mutex_unlock(&shared_->mutex);
+}
+
+void ShardQueue::push(int64_t manifest_task, std::string_view line)
+{
+    lock();
+    while (shared_->tail - shared_->head == SHARD_QUEUE_RECORDS) {
+        wait(shared_->not_full);
+    }
+    Record& record = shared_->records[shared_->tail % SHARD_QUEUE_RECORDS];
+    record.manifest_task = manifest_task;
+    record.size = uint32_t(line.size());
+    std::memcpy(record.line, line.data(), line.size());
+    ++shared_->tail;
+    pthread_cond_signal(&shared_->not_empty);
+    pthread_mutex_unlock(&shared_->mutex);
+}
+
+void ShardQueue::lock()
+{
+    if (pthread_mutex_lock(&shared_->mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shared_->mutex);
+    }
+}
+
+void ShardQueue::wait(pthread_cond_t& cond)
+{
+    if (pthread_cond_wait(&cond, &shared_->mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shared_->mutex);
+    }
+}
+
+}
@@ -0,0 +1,149 @@
+#ifndef SHARDING_H
+#define SHARDING_H
+
+// Memory shared by the processes of a sharded run (--processes), mapped
+// before they are forked: the queue they take their tasks from and the
+// claims of the tasks they do.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <pthread.h>
+
+namespace gif643 {
+
+const size_t    SHARD_QUEUE_RECORDS = 1024; // Tasks in a ShardQueue.
+const size_t    SHARD_LINE_BYTES  = 4096;   // Longest task line in it.
+const size_t    SHARED_CLAIMS     = 1 << 20;  // Entries of SharedClaims.
+
+/// \brief Claims of tasks shared by processes, in a lock-free hash table 
+///        mapped before they are forked (see TaskIndex).
+///
+/// Each entry is the 64 bits hash of a task key (see contentHash) with its
+/// state in the two low bits, 0 being a free entry. Entries are found by 
+/// linear probing and never removed: a released task keeps its entry for 
+/// the next claim. When the table is full, claims only go through the 
+/// local index.
+class SharedClaims
+{
+private:
+    enum State : uint64_t { CLAIMED = 1, DONE = 2, RELEASED = 3 };
+
+    static constexpr uint64_t STATE_MASK = 3;
+    static constexpr size_t   MAX_PROBES = 64;
+
+    uint64_t*           entries_;
+    size_t              capacity_;
+    std::atomic<bool>   full_warned_;
+
+public:
+    SharedClaims();
+
+    ~SharedClaims();
+
+    SharedClaims(const SharedClaims&) = delete;
+    SharedClaims& operator=(const SharedClaims&) = delete;
+
+    /// \brief Maps a table of capacity entries, shared with the processes
+    ///        forked afterwards. Returns false, with an error on stderr, on
+    ///        failure.
+    bool create(size_t capacity);
+
+    /// \brief Claims the task of a key hash. Returns false if another 
+    ///        process has it (claimed or done).
+    bool claim(uint64_t hash);
+
+    void commit(uint64_t hash)
+    {
+        set(hash, DONE);
+    }
+
+    void release(uint64_t hash)
+    {
+        set(hash, RELEASED);
+    }
+
+private:
+    static uint64_t keyOf(uint64_t hash)
+    {
+        const uint64_t key = hash & ~STATE_MASK;
+        return key ? key : STATE_MASK + 1;
+    }
+
+    void set(uint64_t hash, State state);
+};
+
+/// \brief A queue of tasks shared by processes, in memory mapped before 
+///        they are forked, for the processes of a sharded run to take their
+///        tasks from as they go (see queueShard).
+///
+/// Fixed-size records in a ring, guarded by a process-shared (and robust, 
+/// in case a process dies while holding it) mutex. A record holds a task 
+/// line, or the index of a task in a Manifest that the processes share.
+class ShardQueue
+{
+private:
+    struct Record
+    {
+        int64_t     manifest_task;  // -1 for a line.
+        uint32_t    size;
+        char        line[SHARD_LINE_BYTES];
+    };
+
+    struct Shared
+    {
+        pthread_mutex_t mutex;
+        pthread_cond_t  not_empty;
+        pthread_cond_t  not_full;
+        uint64_t        head;       // Records taken so far.
+        uint64_t        tail;       // Records pushed so far.
+        int             closed;
+        Record          records[SHARD_QUEUE_RECORDS];
+    };
+
+    Shared* shared_;
+
+public:
+    ShardQueue();
+
+    ~ShardQueue();
+
+    ShardQueue(const ShardQueue&) = delete;
+    ShardQueue& operator=(const ShardQueue&) = delete;
+
+    /// \brief Maps the queue, shared with the processes forked afterwards.
+    ///        Returns false, with an error on stderr, on failure.
+    bool create();
+
+    /// \brief Pushes a task line, waiting for room. Returns false, with an 
+    ///        error on stderr, if it is too long.
+    bool pushLine(std::string_view line);
+
+    /// \brief Pushes the index of a manifest task, waiting for room.
+    void pushManifestTask(size_t task)
+    {
+        push(int64_t(task), {});
+    }
+
+    /// \brief Takes the next record, waiting for one. Returns false once 
+    ///        the queue is closed and empty.
+    bool pop(int64_t& manifest_task, std::string& line);
+
+    /// \brief Tells the processes that nothing else will be pushed.
+    void close();
+
+private:
+    void push(int64_t manifest_task, std::string_view line);
+
+    /// \brief Locks the mutex, recovering it if its owner died (the queue
+    ///        is consistent between operations).
+    void lock();
+
+    void wait(pthread_cond_t& cond);
+};
+
+}
+
+#endif // SHARDING_H
@@ -186,6 +186,48 @@ STBIWDEF int stbiw_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const w
 typedef void stbi_write_func(void *context, void *data, int size);
 
 STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
+// Same as stbi_write_png_to_func, with the compression level and forced
+// filter given per call instead of stbi_write_png_compression_level and
+// stbi_write_force_png_filter (safe to use from several threads).
+STBIWDEF int stbi_write_png_to_func_ex(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes, int compression_level, int force_filter);
+// Returns the PNG file in memory instead, *out_len bytes long, to be freed
+// with STBIW_FREE (free by default). Returns NULL on error.
+STBIWDEF unsigned char *stbi_write_png_to_mem_ex(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len, int compression_level, int force_filter);
+// Building blocks of stbi_write_png_to_mem_ex, to encode an image given a few
+// rows at a time (stbi_flip_vertically_on_write is ignored):
+//  - stbi_write_png_filter_rows filters the count rows starting at row y0,
+//    rows pointing to row y0 (and rows - stride_bytes to row y0-1 if y0 is
+//    not 0), and writes count*(x*n+1) bytes to out. Returns 0 on error.
+//  - the filtered rows of the whole image are then compressed in zlib format
+//    (see stbi_zlib_compress) and stbi_write_png_from_zlib returns the PNG
+//    file, as stbi_write_png_to_mem_ex.
+STBIWDEF int stbi_write_png_filter_rows(const unsigned char *rows, int stride_bytes, int x, int y0, int count, int n, int force_filter, unsigned char *out);
+STBIWDEF unsigned char *stbi_write_png_from_zlib(const unsigned char *zlib, int zlen, int x, int y, int n, int *out_len);
+// Same as stbi_write_png_to_mem_ex and stbi_write_png_from_zlib for an 8 bits
+// indexed image, one byte per pixel (n = 1 for stbi_write_png_filter_rows):
+// palette holds its ncolors (1 to 256) colors as RGBA, written to its PLTE
+// and tRNS chunks (the latter only up to the last color not opaque).
+STBIWDEF unsigned char *stbi_write_png_indexed_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, const unsigned char *palette, int ncolors, int *out_len, int compression_level, int force_filter);
+STBIWDEF unsigned char *stbi_write_png_indexed_from_zlib(const unsigned char *zlib, int zlen, int x, int y, const unsigned char *palette, int ncolors, int *out_len);
+#ifndef STBIW_ZLIB_COMPRESS
+// zlib compression of data given in several parts with the builtin deflate,
+// each part as its own block (no match reaches into the previous parts):
+// stbi_zlib_stream_begin writes the zlib header, stbi_zlib_stream_write
+// compresses data_len more bytes (returns 0 on error), and
+// stbi_zlib_stream_end returns the zlib data, *out_len bytes long, to be
+// freed with STBIW_FREE. stbi_zlib_stream_free releases a stream not ended.
+typedef struct
+{
+   unsigned char *out;
+   unsigned int bitbuf, s1, s2;
+   int bitcount, quality;
+} stbi_zlib_stream;
+
+STBIWDEF void stbi_zlib_stream_begin(stbi_zlib_stream *z, int quality);
+STBIWDEF int stbi_zlib_stream_write(stbi_zlib_stream *z, const unsigned char *data, int data_len);
+STBIWDEF unsigned char *stbi_zlib_stream_end(stbi_zlib_stream *z, int *out_len);
+STBIWDEF void stbi_zlib_stream_free(stbi_zlib_stream *z);
+#endif
 STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
@@ -855,29 +897,25 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #endif // STBIW_ZLIB_COMPRESS
 
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+#ifndef STBIW_ZLIB_COMPRESS
+// Writes data_len bytes of data as one fixed huffman block, the last of the
+// stream if final, after the bits already in *bitbuffer. Returns 0 on error.
+static int stbiw__zlib_block(unsigned char **pout, unsigned int *bitbuffer, int *bitcounter, unsigned char *data, int data_len, int quality, int final)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
    static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
    static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
-   unsigned int bitbuf=0;
-   int i,j, bitcount=0;
-   unsigned char *out = NULL;
+   unsigned int bitbuf=*bitbuffer;
+   int i,j, bitcount=*bitcounter;
+   unsigned char *out = *pout;
    unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
    if (hash_table == NULL)
-      return NULL;
+      return 0;
    if (quality < 5) quality = 5;
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_add(final ? 1 : 0,1);  // BFINAL
    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
-
    for (i=0; i < stbiw__ZHASH; ++i)
       hash_table[i] = NULL;
 
@@ -936,37 +974,113 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
    for (;i < data_len; ++i)
       stbiw__zlib_huffb(data[i]);
    stbiw__zlib_huff(256); // end of block
-   // pad with 0 bits to byte boundary
-   while (bitcount)
-      stbiw__zlib_add(0,1);
 
    for (i=0; i < stbiw__ZHASH; ++i)
       (void) stbiw__sbfree(hash_table[i]);
    STBIW_FREE(hash_table);
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+   *pout = out;
+   *bitbuffer = bitbuf;
+   *bitcounter = bitcount;
+   return 1;
+}
+
+// Adds data_len bytes of data to the adler32 sums s1 and s2.
+static void stbiw__zlib_adler32(unsigned int *s1, unsigned int *s2, unsigned char *data, int data_len)
+{
+   int i, j=0;
+   int blocklen = (int) (data_len % 5552);
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) { *s1 += data[j+i]; *s2 += *s1; }
+      *s1 %= 65521; *s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
    }
+}
+
+// Pads the bits to a byte boundary, appends the adler32 sums and returns the
+// output as a pointer freeable with STBIW_FREE.
+static unsigned char *stbiw__zlib_finish(unsigned char *out, unsigned int bitbuf, int bitcount, unsigned int s1, unsigned int s2, int *out_len)
+{
+   // pad with 0 bits to byte boundary
+   while (bitcount)
+      stbiw__zlib_add(0,1);
+
+   stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
+   stbiw__sbpush(out, STBIW_UCHAR(s2));
+   stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
+   stbiw__sbpush(out, STBIW_UCHAR(s1));
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
    return (unsigned char *) stbiw__sbraw(out);
+}
 #endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   unsigned int bitbuf=0, s1=1, s2=0;
+   int bitcount=0;
+   unsigned char *out = NULL;
+
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   if (!stbiw__zlib_block(&out, &bitbuf, &bitcount, data, data_len, quality, 1)) {
+      (void) stbiw__sbfree(out);
+      return NULL;
+   }
+   // compute adler32 on input
+   stbiw__zlib_adler32(&s1, &s2, data, data_len);
+   return stbiw__zlib_finish(out, bitbuf, bitcount, s1, s2, out_len);
+#endif // STBIW_ZLIB_COMPRESS
+}
+
+#ifndef STBIW_ZLIB_COMPRESS
+STBIWDEF void stbi_zlib_stream_begin(stbi_zlib_stream *z, int quality)
+{
+   z->out = NULL;
+   z->bitbuf = 0;
+   z->bitcount = 0;
+   z->s1 = 1;
+   z->s2 = 0;
+   z->quality = quality;
+   stbiw__sbpush(z->out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(z->out, 0x5e);   // FLEVEL = 1
+}
+
+STBIWDEF int stbi_zlib_stream_write(stbi_zlib_stream *z, const unsigned char *data, int data_len)
+{
+   // stbiw__zlib_block only reads the data
+   if (!stbiw__zlib_block(&z->out, &z->bitbuf, &z->bitcount, (unsigned char *) data, data_len, z->quality, 0))
+      return 0;
+   stbiw__zlib_adler32(&z->s1, &z->s2, (unsigned char *) data, data_len);
+   return 1;
+}
+
+STBIWDEF unsigned char *stbi_zlib_stream_end(stbi_zlib_stream *z, int *out_len)
+{
+   unsigned char *out = z->out;
+   unsigned int bitbuf = z->bitbuf;
+   int bitcount = z->bitcount;
+   // empty final block
+   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+   stbiw__zlib_huff(256); // end of block
+   z->out = NULL;
+   return stbiw__zlib_finish(out, bitbuf, bitcount, z->s1, z->s2, out_len);
 }
 
+STBIWDEF void stbi_zlib_stream_free(stbi_zlib_stream *z)
+{
+   (void) stbiw__sbfree(z->out);
+   z->out = NULL;
+}
+#endif // STBIW_ZLIB_COMPRESS
+
 static unsigned int stbiw__crc32(unsigned char *buffer, int len)
 {
 #ifdef STBIW_CRC32
@@ -1035,15 +1149,15 @@ static unsigned char stbiw__paeth(int a, int b, int c)
 }
 
 // @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+// z points to the row to encode, and z-signed_stride to the previous one
+// (unless first is set).
+static void stbiw__encode_png_row(const unsigned char *z, int signed_stride, int width, int first, int n, int filter_type, signed char *line_buffer)
 {
    static int mapping[] = { 0,1,2,3,4 };
    static int firstmap[] = { 0,1,0,5,6 };
-   int *mymap = (y != 0) ? mapping : firstmap;
+   int *mymap = first ? firstmap : mapping;
    int i;
    int type = mymap[filter_type];
-   unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
-   int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
 
    if (type==0) {
       memcpy(line_buffer, z, width*n);
@@ -1071,14 +1185,44 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
    }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+// Filters the row z for PNG with force_filter, or the filter giving the
+// lowest estimated entropy if -1, and writes the filter type then the
+// filtered row to out (width*n+1 bytes).
+static void stbiw__filter_png_row(const unsigned char *z, int signed_stride, int width, int first, int n, int force_filter, signed char *line_buffer, unsigned char *out)
+{
+   int filter_type;
+   if (force_filter > -1) {
+      filter_type = force_filter;
+      stbiw__encode_png_row(z, signed_stride, width, first, n, force_filter, line_buffer);
+   } else { // Estimate the best filter by running through all of them:
+      int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
+      for (filter_type = 0; filter_type < 5; filter_type++) {
+         stbiw__encode_png_row(z, signed_stride, width, first, n, filter_type, line_buffer);
+
+         // Estimate the entropy of the line using this filter; the less, the better.
+         est = 0;
+         for (i = 0; i < width*n; ++i) {
+            est += abs((signed char) line_buffer[i]);
+         }
+         if (est < best_filter_val) {
+            best_filter_val = est;
+            best_filter = filter_type;
+         }
+      }
+      if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
+         stbiw__encode_png_row(z, signed_stride, width, first, n, best_filter, line_buffer);
+         filter_type = best_filter;
+      }
+   }
+   // when we get here, filter_type contains the filter type, and line_buffer contains the data
+   out[0] = (unsigned char) filter_type;
+   STBIW_MEMMOVE(out+1, line_buffer, width*n);
+}
+
+STBIWDEF int stbi_write_png_filter_rows(const unsigned char *rows, int stride_bytes, int x, int y0, int count, int n, int force_filter, unsigned char *out)
 {
-   int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
    signed char *line_buffer;
-   int j,zlen;
+   int j;
 
    if (stride_bytes == 0)
       stride_bytes = x * n;
@@ -1087,46 +1231,30 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
       force_filter = -1;
    }
 
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
-      int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
-      } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
-         for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
-
-            // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
-            if (est < best_filter_val) {
-               best_filter_val = est;
-               best_filter = filter_type;
-            }
-         }
-         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
-            filter_type = best_filter;
-         }
-      }
-      // when we get here, filter_type contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) filter_type;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
+   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) return 0;
+   for (j=0; j < count; ++j) {
+      stbiw__filter_png_row(rows + j*stride_bytes, stride_bytes, x, y0+j == 0, n, force_filter, line_buffer, out + j*(x*n+1));
    }
    STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
-   STBIW_FREE(filt);
-   if (!zlib) return 0;
+   return 1;
+}
+
+// Writes the PNG file of color type ctype, with the PLTE and tRNS chunks of
+// palette if ncolors is not 0.
+static unsigned char *stbiw__png_from_zlib(const unsigned char *zlib, int zlen, int x, int y, int ctype, const unsigned char *palette, int ncolors, int *out_len)
+{
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char *out,*o;
+   int i, ntrns = ncolors;
+
+   while (ntrns > 0 && palette[(ntrns-1)*4+3] == 255) --ntrns;
 
    // each tag requires 12 bytes of overhead
-   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
-   if (!out) return 0;
    *out_len = 8 + 12+13 + 12+zlen + 12;
+   if (ncolors) *out_len += 12 + 3*ncolors;
+   if (ntrns) *out_len += 12 + ntrns;
+   out = (unsigned char *) STBIW_MALLOC(*out_len);
+   if (!out) return 0;
 
    o=out;
    STBIW_MEMMOVE(o,sig,8); o+= 8;
@@ -1135,17 +1263,34 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    stbiw__wp32(o, x);
    stbiw__wp32(o, y);
    *o++ = 8;
-   *o++ = STBIW_UCHAR(ctype[n]);
+   *o++ = STBIW_UCHAR(ctype);
    *o++ = 0;
    *o++ = 0;
    *o++ = 0;
    stbiw__wpcrc(&o,13);
 
+   if (ncolors) {
+      stbiw__wp32(o, 3*ncolors);
+      stbiw__wptag(o, "PLTE");
+      for (i=0; i < ncolors; ++i) {
+         *o++ = palette[i*4+0];
+         *o++ = palette[i*4+1];
+         *o++ = palette[i*4+2];
+      }
+      stbiw__wpcrc(&o, 3*ncolors);
+   }
+   if (ntrns) {
+      stbiw__wp32(o, ntrns);
+      stbiw__wptag(o, "tRNS");
+      for (i=0; i < ntrns; ++i)
+         *o++ = palette[i*4+3];
+      stbiw__wpcrc(&o, ntrns);
+   }
+
    stbiw__wp32(o, zlen);
    stbiw__wptag(o, "IDAT");
    STBIW_MEMMOVE(o, zlib, zlen);
    o += zlen;
-   STBIW_FREE(zlib);
    stbiw__wpcrc(&o, zlen);
 
    stbiw__wp32(o,0);
@@ -1157,6 +1302,78 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    return out;
 }
 
+STBIWDEF unsigned char *stbi_write_png_from_zlib(const unsigned char *zlib, int zlen, int x, int y, int n, int *out_len)
+{
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   return stbiw__png_from_zlib(zlib, zlen, x, y, ctype[n], NULL, 0, out_len);
+}
+
+STBIWDEF unsigned char *stbi_write_png_indexed_from_zlib(const unsigned char *zlib, int zlen, int x, int y, const unsigned char *palette, int ncolors, int *out_len)
+{
+   if (ncolors < 1 || ncolors > 256) return 0;
+   return stbiw__png_from_zlib(zlib, zlen, x, y, 3, palette, ncolors, out_len);
+}
+
+// Filters the rows of the image and compresses them, returning the zlib
+// stream, *zlen bytes long, or NULL on error.
+static unsigned char *stbiw__png_compress_rows(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int compression_level, int force_filter, int *zlen)
+{
+   unsigned char *filt, *zlib;
+   signed char *line_buffer;
+   int j;
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   if (force_filter >= 5) {
+      force_filter = -1;
+   }
+
+   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
+   for (j=0; j < y; ++j) {
+      const unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? y-1-j : j);
+      int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+      stbiw__filter_png_row(z, signed_stride, x, j == 0, n, force_filter, line_buffer, filt+j*(x*n+1));
+   }
+   STBIW_FREE(line_buffer);
+   zlib = stbi_zlib_compress(filt, y*( x*n+1), zlen, compression_level);
+   STBIW_FREE(filt);
+   return zlib;
+}
+
+STBIWDEF unsigned char *stbi_write_png_to_mem_ex(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len, int compression_level, int force_filter)
+{
+   unsigned char *out, *zlib;
+   int zlen;
+
+   zlib = stbiw__png_compress_rows(pixels, stride_bytes, x, y, n, compression_level, force_filter, &zlen);
+   if (!zlib) return 0;
+
+   out = stbi_write_png_from_zlib(zlib, zlen, x, y, n, out_len);
+   STBIW_FREE(zlib);
+   return out;
+}
+
+STBIWDEF unsigned char *stbi_write_png_indexed_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, const unsigned char *palette, int ncolors, int *out_len, int compression_level, int force_filter)
+{
+   unsigned char *out, *zlib;
+   int zlen;
+
+   if (ncolors < 1 || ncolors > 256) return 0;
+   zlib = stbiw__png_compress_rows(pixels, stride_bytes, x, y, 1, compression_level, force_filter, &zlen);
+   if (!zlib) return 0;
+
+   out = stbi_write_png_indexed_from_zlib(zlib, zlen, x, y, palette, ncolors, out_len);
+   STBIW_FREE(zlib);
+   return out;
+}
+
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   return stbi_write_png_to_mem_ex(pixels, stride_bytes, x, y, n, out_len, stbi_write_png_compression_level, stbi_write_force_png_filter);
+}
+
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
 {
@@ -1184,6 +1401,16 @@ STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x,
    return 1;
 }
 
+STBIWDEF int stbi_write_png_to_func_ex(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes, int compression_level, int force_filter)
+{
+   int len;
+   unsigned char *png = stbi_write_png_to_mem_ex((const unsigned char *) data, stride_bytes, x, y, comp, &len, compression_level, force_filter);
+   if (png == NULL) return 0;
+   func(context, png, len);
+   STBIW_FREE(png);
+   return 1;
+}
+
 
 /* ***************************************************************************
  *
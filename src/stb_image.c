@@ -1,2 +1,280 @@
+#include <stdlib.h>
+#include <string.h>
+#include "deflate_backend.h"
+
+#if defined(ASSET_CONV_DEFLATE_ZLIB)
+
+#include <zlib.h>
+
+static unsigned char* zlibCompress(unsigned char* data, int data_len, int* out_len, int quality)
+{
+    uLongf len = compressBound(data_len);
+    unsigned char* out = (unsigned char*)malloc(len);
+    if (out == NULL) return NULL;
+
+    if (quality < 0) quality = 0;
+    if (quality > 9) quality = 9;
+    if (compress2(out, &len, data, data_len, quality) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    *out_len = (int)len;
+    return out;
+}
+
+#define STBIW_ZLIB_COMPRESS zlibCompress
+const char* deflateBackendName(void) { return "zlib"; }
+int deflateBackendMinLevel(void) { return 0; }
+int deflateBackendMaxLevel(void) { return 9; }
+
+struct DeflateStream
+{
+    z_stream z;
+    unsigned char* out;
+    size_t capacity;
+};
+
+// Makes room for at least one more byte of output.
+static int deflateStreamGrow(DeflateStream* stream)
+{
+    size_t used = stream->z.total_out;
+    size_t capacity = stream->capacity * 2;
+    unsigned char* out = (unsigned char*)realloc(stream->out, capacity);
+    if (out == NULL) return 0;
+    stream->out = out;
+    stream->capacity = capacity;
+    stream->z.next_out = out + used;
+    stream->z.avail_out = (uInt)(capacity - used);
+    return 1;
+}
+
+DeflateStream* deflateStreamBegin(int level, size_t size_hint)
+{
+    DeflateStream* stream = (DeflateStream*)calloc(1, sizeof(DeflateStream));
+    if (stream == NULL) return NULL;
+
+    if (level < 0) level = 0;
+    if (level > 9) level = 9;
+    if (deflateInit(&stream->z, level) != Z_OK) {
+        free(stream);
+        return NULL;
+    }
+    // Room for the result of compress2 over size_hint bytes, at most 64 KB
+    // to begin with: it usually is much smaller.
+    stream->capacity = compressBound(size_hint);
+    if (stream->capacity > (64 << 10)) stream->capacity = 64 << 10;
+    stream->out = (unsigned char*)malloc(stream->capacity);
+    if (stream->out == NULL) {
+        deflateStreamAbort(stream);
+        return NULL;
+    }
+    stream->z.next_out = stream->out;
+    stream->z.avail_out = (uInt)stream->capacity;
+    return stream;
+}
+
+// Runs deflate with flush until it has consumed all the input (and, with
+// Z_FINISH, written all the output).
+static int deflateStreamRun(DeflateStream* stream, int flush)
+{
+    for (;;) {
+        int r;
+        if (stream->z.avail_out == 0 && !deflateStreamGrow(stream)) return 0;
+        r = deflate(&stream->z, flush);
+        if (r == Z_STREAM_END) return 1;
+        if (r != Z_OK && r != Z_BUF_ERROR) return 0;
+        if (flush != Z_FINISH && stream->z.avail_in == 0) return 1;
+    }
+}
+
+int deflateStreamWrite(DeflateStream* stream, const unsigned char* data, size_t len)
+{
+    while (len > 0) {
+        uInt part = len > 0x40000000 ? 0x40000000 : (uInt)len;
+        stream->z.next_in = (Bytef*)data;
+        stream->z.avail_in = part;
+        if (!deflateStreamRun(stream, Z_NO_FLUSH)) return 0;
+        data += part;
+        len -= part;
+    }
+    return 1;
+}
+
+unsigned char* deflateStreamEnd(DeflateStream* stream, int* out_len)
+{
+    unsigned char* out = NULL;
+    stream->z.next_in = NULL;
+    stream->z.avail_in = 0;
+    if (deflateStreamRun(stream, Z_FINISH)) {
+        out = stream->out;
+        *out_len = (int)stream->z.total_out;
+        stream->out = NULL;
+    }
+    deflateStreamAbort(stream);
+    return out;
+}
+
+void deflateStreamAbort(DeflateStream* stream)
+{
+    if (stream == NULL) return;
+    deflateEnd(&stream->z);
+    free(stream->out);
+    free(stream);
+}
+
+#elif defined(ASSET_CONV_DEFLATE_LIBDEFLATE)
+
+#include <libdeflate.h>
+
+// Compressors are costly to create: keep one per thread, for the last level
+// used. It is never freed, like a static buffer.
+static _Thread_local struct libdeflate_compressor* compressor_ = NULL;
+static _Thread_local int compressor_level_ = -1;
+
+static unsigned char* libdeflateCompress(unsigned char* data, int data_len, int* out_len, int quality)
+{
+    size_t bound, len;
+    unsigned char* out;
+
+    if (quality < 0) quality = 0;
+    if (quality > 12) quality = 12;
+    if (compressor_ == NULL || compressor_level_ != quality) {
+        if (compressor_ != NULL) libdeflate_free_compressor(compressor_);
+        compressor_ = libdeflate_alloc_compressor(quality);
+        compressor_level_ = quality;
+        if (compressor_ == NULL) return NULL;
+    }
+
+    bound = libdeflate_zlib_compress_bound(compressor_, data_len);
+    out = (unsigned char*)malloc(bound);
+    if (out == NULL) return NULL;
+
+    len = libdeflate_zlib_compress(compressor_, data, data_len, out, bound);
+    if (len == 0) {
+        free(out);
+        return NULL;
+    }
+    *out_len = (int)len;
+    return out;
+}
+
+#define STBIW_ZLIB_COMPRESS libdeflateCompress
+const char* deflateBackendName(void) { return "libdeflate"; }
+int deflateBackendMinLevel(void) { return 0; }
+int deflateBackendMaxLevel(void) { return 12; }
+
+#else
+
+const char* deflateBackendName(void) { return "stb"; }
+// stbi_zlib_compress treats the levels below 5 as 5.
+int deflateBackendMinLevel(void) { return 5; }
+// Hash chain length for stb: no hard limit, returns past this are small.
+int deflateBackendMaxLevel(void) { return 16; }
+
+#endif
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
+
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include "stb/stb_image_resize.h"
+
+#if defined(ASSET_CONV_DEFLATE_LIBDEFLATE)
+
+// libdeflate only compresses whole buffers: the stream gathers the data.
+struct DeflateStream
+{
+    int level;
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+};
+
+DeflateStream* deflateStreamBegin(int level, size_t size_hint)
+{
+    DeflateStream* stream = (DeflateStream*)calloc(1, sizeof(DeflateStream));
+    if (stream == NULL) return NULL;
+
+    stream->level = level;
+    stream->capacity = size_hint > 0 ? size_hint : 4096;
+    stream->data = (unsigned char*)malloc(stream->capacity);
+    if (stream->data == NULL) {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+int deflateStreamWrite(DeflateStream* stream, const unsigned char* data, size_t len)
+{
+    if (stream->size + len > stream->capacity) {
+        size_t capacity = stream->capacity * 2;
+        unsigned char* grown;
+        if (capacity < stream->size + len) capacity = stream->size + len;
+        grown = (unsigned char*)realloc(stream->data, capacity);
+        if (grown == NULL) return 0;
+        stream->data = grown;
+        stream->capacity = capacity;
+    }
+    memcpy(stream->data + stream->size, data, len);
+    stream->size += len;
+    return 1;
+}
+
+unsigned char* deflateStreamEnd(DeflateStream* stream, int* out_len)
+{
+    unsigned char* out = stbi_zlib_compress(stream->data, (int)stream->size, out_len, stream->level);
+    deflateStreamAbort(stream);
+    return out;
+}
+
+void deflateStreamAbort(DeflateStream* stream)
+{
+    if (stream == NULL) return;
+    free(stream->data);
+    free(stream);
+}
+
+#elif !defined(ASSET_CONV_DEFLATE_ZLIB)
+
+// Each part is compressed as it comes, as its own deflate block.
+struct DeflateStream
+{
+    stbi_zlib_stream z;
+};
+
+DeflateStream* deflateStreamBegin(int level, size_t size_hint)
+{
+    DeflateStream* stream = (DeflateStream*)calloc(1, sizeof(DeflateStream));
+    (void)size_hint;
+    if (stream == NULL) return NULL;
+    stbi_zlib_stream_begin(&stream->z, level);
+    return stream;
+}
+
+int deflateStreamWrite(DeflateStream* stream, const unsigned char* data, size_t len)
+{
+    while (len > 0) {
+        int part = len > 0x40000000 ? 0x40000000 : (int)len;
+        if (!stbi_zlib_stream_write(&stream->z, data, part)) return 0;
+        data += part;
+        len -= part;
+    }
+    return 1;
+}
+
+unsigned char* deflateStreamEnd(DeflateStream* stream, int* out_len)
+{
+    unsigned char* out = stbi_zlib_stream_end(&stream->z, out_len);
+    deflateStreamAbort(stream);
+    return out;
+}
+
+void deflateStreamAbort(DeflateStream* stream)
+{
+    if (stream == NULL) return;
+    stbi_zlib_stream_free(&stream->z);
+    free(stream);
+}
+
+#endif
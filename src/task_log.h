@@ -0,0 +1,49 @@
+#ifndef TASK_LOG_H
+#define TASK_LOG_H
+
+#include <atomic>
+#include <ostream>
+#include <sstream>
+
+namespace gif643 {
+
+/// \brief Per-task log lines (progress, cache hits), disabled in quiet mode.
+///
+/// Each line is written to stderr at once, instead of one (unbuffered) write
+/// per piece, so lines of concurrent tasks do not mix. Errors are not task
+/// logs: they are always written.
+class TaskLog
+{
+private:
+    static std::atomic<bool>& quietFlag()
+    {
+        static std::atomic<bool> quiet(false);
+        return quiet;
+    }
+
+public:
+    static void setQuiet(bool quiet)
+    {
+        quietFlag().store(quiet, std::memory_order_relaxed);
+    }
+
+    static bool enabled()
+    {
+        return !quietFlag().load(std::memory_order_relaxed);
+    }
+
+    template <typename... Args>
+    static void write(std::ostream& stream, const Args&... args)
+    {
+        if (!enabled()) {
+            return;
+        }
+        std::ostringstream line;
+        (line << ... << args) << '\n';
+        stream << line.str() << std::flush;
+    }
+};
+
+}
+
+#endif // TASK_LOG_H
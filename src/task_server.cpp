@@ -0,0 +1,116 @@
+#include "task_server.h"
+#include "net_util.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace gif643 {
+
+TaskServer::TaskServer(SessionFactory sessions):
+    sessions_(std::move(sessions)),
+    fd_(-1)
+{
+}
+
+TaskServer::~TaskServer()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+        ::unlink(path_.c_str());
+    }
+}
+
+bool TaskServer::start(const std::string& path)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Error: Invalid socket path '" << path << "'." 
+                  << std::endl;
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot create a socket: " 
+                  << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), 
+                  sizeof(addr)) == 0) {
+        std::cerr << "Error: A server already listens on '" << path 
+                  << "'." << std::endl;
+        ::close(fd);
+        return false;
+    }
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), 
+               sizeof(addr)) != 0 ||
+        ::listen(fd, 16) != 0) {
+        std::cerr << "Error: Cannot listen on '" << path << "': " 
+                  << std::strerror(errno) << std::endl;
+        ::close(fd);
+        return false;
+    }
+    fd_ = fd;
+    path_ = path;
+    return true;
+}
+
+void TaskServer::run(const std::atomic<bool>& stop)
+{
+    acceptConnections(fd_, stop, [this, &stop](int fd) { 
+        serve(fd, stop); 
+    });
+}
+
+void TaskServer::serve(int fd, const std::atomic<bool>& stop)
+{
+    Session session = sessions_();
+    std::string block;
+    size_t kept = 0;
+    while (!stop) {
+        pollfd pfd = {fd, POLLIN, 0};
+        int ready = ::poll(&pfd, 1, SERVER_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        block.resize(kept + SERVER_BLOCK);
+        ssize_t n = ::recv(fd, &block[kept], SERVER_BLOCK, 0);
+        if (n < 0 && errno == EINTR) {
+            block.resize(kept);
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        block.resize(kept + n);
+        size_t end = block.rfind('\n');
+        if (end == std::string::npos) {
+            kept = block.size();
+            continue;
+        }
+        session.queue(std::string_view(block).substr(0, end + 1));
+        block.erase(0, end + 1);
+        kept = block.size();
+    }
+    block.resize(kept);
+    session.queue(block);
+
+    size_t done = 0;
+    size_t failed = 0;
+    session.wait(done, failed);
+    sendAll(fd, "done " + std::to_string(done) 
+                + " failed " + std::to_string(failed) + "\n");
+}
+
+}
@@ -0,0 +1,73 @@
+#ifndef TASK_SERVER_H
+#define TASK_SERVER_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace gif643 {
+
+const size_t    SERVER_BLOCK      = 1 << 20;  // Bytes of task lines received
+                                              // and queued at a time.
+
+/// \brief Takes task requests on a Unix socket, so that a long-running 
+///        processor keeps its threads and caches warm across builds.
+///
+/// A client writes task lines, as on stdin, then shuts down its side of the
+/// connection (or closes it). Lines are queued as they arrive, in a Session
+/// per connection. Once every task of the connection is finished, the 
+/// server answers "done <count> failed <count>\n" and closes it.
+///
+/// Each connection is served by its own thread (see acceptConnections).
+class TaskServer
+{
+public:
+    /// \brief The tasks of a connection (see taskSession in asset_conv.cpp).
+    ///
+    /// queue: Queues complete task lines as they arrive, then the last 
+    ///        partial line.
+    /// wait:  Waits for every task queued to be finished, and returns how 
+    ///        many were done and failed.
+    struct Session
+    {
+        std::function<void(std::string_view)>   queue;
+        std::function<void(size_t&, size_t&)>   wait;
+    };
+
+    /// Returns the Session of a new connection.
+    using SessionFactory = std::function<Session()>;
+
+private:
+    SessionFactory      sessions_;
+    std::string         path_;
+    int                 fd_;
+
+public:
+    explicit TaskServer(SessionFactory sessions);
+
+    /// \brief Removes the socket.
+    ~TaskServer();
+
+    TaskServer(const TaskServer&) = delete;
+    TaskServer& operator=(const TaskServer&) = delete;
+
+    /// \brief Listens on the socket at path, replacing a stale one (but not
+    ///        one another server answers on). Returns false, with an error on 
+    ///        stderr, on failure.
+    bool start(const std::string& path);
+
+    /// \brief Accepts and serves connections until stop is set. The 
+    ///        connections being served are finished first.
+    void run(const std::atomic<bool>& stop);
+
+private:
+    /// \brief Queues the complete lines as they arrive (as main does with 
+    ///        the input), then answers once they are finished.
+    void serve(int fd, const std::atomic<bool>& stop);
+};
+
+}
+
+#endif // TASK_SERVER_H